@@ -0,0 +1,377 @@
+#include "calib.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "stm32f4xx_flash.h"
+
+/* Flash record, the magic word is programmed last */
+typedef struct {
+	calib_offsets_t offsets;
+	uint32_t checksum;
+	uint32_t magic;
+} calib_record_t;
+
+#define CALIB_RECORD_WORDS	(sizeof(calib_record_t) / 4)
+#define CALIB_RECORDS		(CALIB_FLASH_SIZE / sizeof(calib_record_t))
+
+/* Mean and spread of samples in g, degrees/s and degrees C */
+typedef struct {
+	float sum[7];
+	float min[6];
+	float max[6];
+	uint16_t count;
+} calib_window_t;
+
+/* Still windows averaged at one temperature */
+typedef struct {
+	float temp;
+	float gyro[3];
+	uint8_t count; // 0 for an empty bin
+} calib_bin_t;
+
+static calib_window_t calib_startup;
+static calib_window_t calib_still;
+static calib_bin_t calib_bins[CALIB_TEMP_BINS];
+static uint8_t calib_temp_ready = 0;
+
+/* Add a sample to the window, returns 0 and empties it if the remote moved */
+static uint8_t calib_window_add(calib_window_t *w, const int16_t *sample, float acce_mult, float gyro_mult,
+		float temp) {
+	uint8_t i;
+
+	for (i = 0; i < 6; i++) {
+		float value = sample[i] * (i < 3 ? acce_mult : gyro_mult);
+
+		if (w->count == 0) {
+			w->sum[i] = 0;
+			w->min[i] = value;
+			w->max[i] = value;
+		}
+		w->sum[i] += value;
+		if (value < w->min[i])
+			w->min[i] = value;
+		else if (value > w->max[i])
+			w->max[i] = value;
+
+		if (w->max[i] - w->min[i] > (i < 3 ? CALIB_ACCE_MOTION : CALIB_GYRO_MOTION)) {
+			w->count = 0;
+			return 0;
+		}
+	}
+	w->sum[6] = (w->count == 0) ? temp : w->sum[6] + temp;
+	w->count++;
+	return 1;
+}
+
+void calib_start(void) {
+	calib_startup.count = 0;
+}
+
+/*
+ * Add one raw sample, ax ay az gx gy gz. Returns CALIB_DONE once
+ * CALIB_SAMPLES are collected, CALIB_MOVED if the remote moved,
+ * after which collecting starts over.
+ */
+uint8_t calib_add(const int16_t *sample, float acce_mult, float gyro_mult) {
+	if (!calib_window_add(&calib_startup, sample, acce_mult, gyro_mult, 0))
+		return CALIB_MOVED;
+	if (calib_startup.count < CALIB_SAMPLES)
+		return CALIB_BUSY;
+	return CALIB_DONE;
+}
+
+/*
+ * Offsets of the collected samples taken at temp, the temperature model
+ * starts over from them. Accelerometer offsets are only replaced if the
+ * remote was lying level, on either side.
+ */
+void calib_result(calib_offsets_t *offsets, float temp) {
+	float mean[6];
+	uint8_t i;
+
+	for (i = 0; i < 6; i++)
+		mean[i] = calib_startup.sum[i] / calib_startup.count;
+
+	for (i = 0; i < 3; i++) {
+		offsets->gyro[i] = mean[3 + i];
+		offsets->gyro_tc[i][0] = 0;
+		offsets->gyro_tc[i][1] = 0;
+	}
+	offsets->temp = temp;
+	offsets->temp_min = temp;
+	offsets->temp_max = temp;
+
+	if (fabsf(mean[0]) < CALIB_LEVEL && fabsf(mean[1]) < CALIB_LEVEL) {
+		offsets->acce[0] = mean[0];
+		offsets->acce[1] = mean[1];
+		offsets->acce[2] = mean[2] - (mean[2] < 0 ? -1.0f : 1.0f);
+	}
+}
+
+/* Gyroscope bias at temp, held at the edge outside the learned range */
+void calib_gyro_bias(const calib_offsets_t *offsets, float temp, float *gyro) {
+	uint8_t i;
+
+	if (temp < offsets->temp_min)
+		temp = offsets->temp_min;
+	else if (temp > offsets->temp_max)
+		temp = offsets->temp_max;
+	temp -= offsets->temp;
+
+	for (i = 0; i < 3; i++)
+		gyro[i] = offsets->gyro[i] + (offsets->gyro_tc[i][0] + offsets->gyro_tc[i][1] * temp) * temp;
+}
+
+static calib_bin_t *calib_bin(float temp) {
+	int16_t index = (int16_t)floorf(temp - CALIB_TEMP_MIN);
+
+	if (index < 0 || index >= CALIB_TEMP_BINS)
+		return NULL;
+	return &calib_bins[index];
+}
+
+/* Start learning from stored or freshly calibrated offsets */
+void calib_temp_init(const calib_offsets_t *offsets) {
+	calib_bin_t *bin;
+	float temp;
+
+	memset(calib_bins, 0, sizeof(calib_bins));
+	calib_still.count = 0;
+	calib_temp_ready = 1;
+	if (!(offsets->temp_max >= offsets->temp_min) || offsets->temp_max - offsets->temp_min > CALIB_TEMP_BINS)
+		return;
+
+	/* What the model learned so far counts as one window per bin, ends included */
+	for (temp = offsets->temp_min; ; temp += 1.0f) {
+		if (temp > offsets->temp_max)
+			temp = offsets->temp_max;
+		if ((bin = calib_bin(temp)) != NULL) {
+			bin->temp = temp;
+			calib_gyro_bias(offsets, temp, bin->gyro);
+			bin->count = 1;
+		}
+		if (temp >= offsets->temp_max)
+			break;
+	}
+}
+
+/*
+ * Gauss-Jordan elimination of n equations with one right hand side
+ * per axis in columns 3 to 5, returns 0 if they are singular
+ */
+static uint8_t calib_solve(float m[3][6], uint8_t n) {
+	uint8_t r, c, k, p;
+	float f;
+
+	for (k = 0; k < n; k++) {
+		p = k;
+		for (r = k + 1; r < n; r++)
+			if (fabsf(m[r][k]) > fabsf(m[p][k]))
+				p = r;
+		if (fabsf(m[p][k]) < 1e-6f)
+			return 0;
+		for (c = 0; c < 6 && p != k; c++) {
+			f = m[k][c];
+			m[k][c] = m[p][c];
+			m[p][c] = f;
+		}
+		for (r = 0; r < n; r++) {
+			if (r == k)
+				continue;
+			f = m[r][k] / m[k][k];
+			for (c = k; c < 6; c++)
+				m[r][c] -= f * m[k][c];
+		}
+	}
+	for (k = 0; k < n; k++)
+		for (c = 3; c < 6; c++)
+			m[k][c] /= m[k][k];
+	return 1;
+}
+
+/* Least squares fit of the bins around offsets->temp */
+static uint8_t calib_temp_fit(calib_offsets_t *offsets) {
+	float s[5] = { 0 }, m[3][6] = { { 0 } };
+	float low = 1000, high = -1000;
+	uint8_t i, j, k, n;
+
+	for (i = 0; i < CALIB_TEMP_BINS; i++) {
+		calib_bin_t *bin = &calib_bins[i];
+		float x = bin->temp - offsets->temp, power = 1;
+
+		if (bin->count == 0)
+			continue;
+		if (bin->temp < low)
+			low = bin->temp;
+		if (bin->temp > high)
+			high = bin->temp;
+		for (k = 0; k < 5; k++) {
+			if (k < 3)
+				for (j = 0; j < 3; j++)
+					m[k][3 + j] += bin->gyro[j] * power;
+			s[k] += power;
+			power *= x;
+		}
+	}
+
+	if (high - low >= CALIB_TEMP_QUADRATIC)
+		n = 3;
+	else if (high - low >= CALIB_TEMP_LINEAR)
+		n = 2;
+	else
+		n = 1;
+	for (i = 0; i < n; i++)
+		for (k = 0; k < n; k++)
+			m[i][k] = s[i + k];
+	if (!calib_solve(m, n))
+		return 0;
+
+	for (j = 0; j < 3; j++) {
+		offsets->gyro[j] = m[0][3 + j];
+		offsets->gyro_tc[j][0] = (n > 1) ? m[1][3 + j] : 0;
+		offsets->gyro_tc[j][1] = (n > 2) ? m[2][3 + j] : 0;
+	}
+	offsets->temp_min = low;
+	offsets->temp_max = high;
+	return 1;
+}
+
+/*
+ * Add one raw sample taken at temp while gestures are recognized. Every
+ * still window is averaged into the bin of its temperature and the model
+ * in offsets is fitted again. Windows far off the model are a slow turn
+ * rather than bias and are dropped.
+ */
+uint8_t calib_temp_add(const int16_t *sample, float acce_mult, float gyro_mult, float temp,
+		calib_offsets_t *offsets) {
+	float expect[3], mean[3], low, high;
+	calib_bin_t *bin;
+	uint8_t i, n;
+
+	if (!calib_temp_ready)
+		return CALIB_TEMP_SAME;
+	if (!calib_window_add(&calib_still, sample, acce_mult, gyro_mult, temp)
+			|| calib_still.count < CALIB_TEMP_WINDOW)
+		return CALIB_TEMP_SAME;
+
+	temp = calib_still.sum[6] / calib_still.count;
+	for (i = 0; i < 3; i++)
+		mean[i] = calib_still.sum[3 + i] / calib_still.count;
+	calib_still.count = 0;
+
+	if ((bin = calib_bin(temp)) == NULL)
+		return CALIB_TEMP_SAME;
+	calib_gyro_bias(offsets, temp, expect);
+	for (i = 0; i < 3; i++)
+		if (fabsf(mean[i] - expect[i]) > CALIB_TEMP_OUTLIER)
+			return CALIB_TEMP_SAME;
+
+	n = (bin->count < CALIB_TEMP_AVERAGE) ? ++bin->count : CALIB_TEMP_AVERAGE;
+	bin->temp += (temp - bin->temp) / n;
+	for (i = 0; i < 3; i++)
+		bin->gyro[i] += (mean[i] - bin->gyro[i]) / n;
+
+	low = offsets->temp_min;
+	high = offsets->temp_max;
+	if (!calib_temp_fit(offsets))
+		return CALIB_TEMP_SAME;
+	if (offsets->temp_min < low - 0.5f || offsets->temp_max > high + 0.5f)
+		return CALIB_TEMP_GROWN;
+	return CALIB_TEMP_UPDATED;
+}
+
+static uint32_t calib_checksum(const calib_record_t *record) {
+	const uint32_t *word = (const uint32_t *)&record->offsets;
+	uint32_t sum = CALIB_MAGIC;
+	uint8_t i;
+
+	for (i = 0; i < sizeof(calib_offsets_t) / 4; i++)
+		sum = ((sum << 5) | (sum >> 27)) ^ word[i];
+	return sum;
+}
+static const calib_record_t *calib_record(uint16_t index) {
+	return (const calib_record_t *)(CALIB_FLASH_ADDR + index * sizeof(calib_record_t));
+}
+
+static uint8_t calib_erased(const calib_record_t *record) {
+	const uint32_t *word = (const uint32_t *)record;
+	uint8_t i;
+
+	for (i = 0; i < CALIB_RECORD_WORDS; i++)
+		if (word[i] != 0xFFFFFFFF)
+			return 0;
+	return 1;
+}
+
+/* Newest valid record, NULL if there is none */
+static const calib_record_t *calib_newest(void) {
+	const calib_record_t *found = NULL;
+	uint16_t i;
+
+	for (i = 0; i < CALIB_RECORDS; i++) {
+		const calib_record_t *record = calib_record(i);
+
+		if (calib_erased(record))
+			break;
+		if (record->magic == CALIB_MAGIC && record->checksum == calib_checksum(record))
+			found = record;
+	}
+	return found;
+}
+
+/* Newest stored offsets, returns 0 if there are none */
+uint8_t calib_load(calib_offsets_t *offsets) {
+	const calib_record_t *found = calib_newest();
+
+	if (found == NULL)
+		return 0;
+	memcpy(offsets, &found->offsets, sizeof(calib_offsets_t));
+	return 1;
+}
+
+/*
+ * Append offsets behind the last record, erasing the sector when it is
+ * full. Erasing takes a few hundred milliseconds, call from a task that
+ * may block that long. Offsets equal to the newest record are not written
+ * again. Returns 0 on failure.
+ */
+uint8_t calib_save(const calib_offsets_t *offsets) {
+	const calib_record_t *newest = calib_newest();
+	calib_record_t record;
+	const uint32_t *word = (const uint32_t *)&record;
+	uint32_t address;
+	uint16_t index;
+	uint8_t i, ok = 1;
+
+	if (newest != NULL && memcmp(&newest->offsets, offsets, sizeof(calib_offsets_t)) == 0)
+		return 1;
+
+	memcpy(&record.offsets, offsets, sizeof(calib_offsets_t));
+	record.checksum = calib_checksum(&record);
+	record.magic = CALIB_MAGIC;
+
+	/* Slot after the last used one, even if that one is torn */
+	for (index = CALIB_RECORDS; index > 0; index--)
+		if (!calib_erased(calib_record(index - 1)))
+			break;
+
+	FLASH_Unlock();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR
+			| FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	if (index == CALIB_RECORDS) {
+		if (FLASH_EraseSector(CALIB_FLASH_SECTOR, VoltageRange_3) != FLASH_COMPLETE)
+			ok = 0;
+		index = 0;
+	}
+
+	address = (uint32_t)calib_record(index);
+	for (i = 0; ok && i < CALIB_RECORD_WORDS; i++)
+		if (FLASH_ProgramWord(address + i * 4, word[i]) != FLASH_COMPLETE)
+			ok = 0;
+
+	FLASH_Lock();
+	return ok;
+}
@@ -0,0 +1,81 @@
+#ifndef _MPU6050_CALIB_H
+#define _MPU6050_CALIB_H
+
+/*
+ * Bias calibration of the MPU6050.
+ *
+ * Raw samples taken while the remote lies still at startup are averaged
+ * into gyroscope offsets, and accelerometer offsets if it lies level.
+ * Later still periods teach a per-axis model of gyroscope bias against
+ * die temperature, so the bias follows the board as it warms up.
+ * Offsets are kept in a flash sector so later boots can use them
+ * right away instead of waiting for a new calibration.
+ */
+
+#include <stdint.h>
+
+/* Samples averaged, about 2.5s at the default data rate */
+#define CALIB_SAMPLES		256
+
+/* Largest spread allowed over the samples, more means the remote moved */
+#define CALIB_GYRO_MOTION	3.0f // degrees/s
+#define CALIB_ACCE_MOTION	0.05f // g
+
+/* Gravity is measured on Z when X and Y read less than this */
+#define CALIB_LEVEL			0.15f // g
+
+/* Results of @ref calib_add */
+#define CALIB_BUSY			0
+#define CALIB_DONE			1
+#define CALIB_MOVED			2
+
+/*
+ * Temperature model. Still windows of CALIB_TEMP_WINDOW samples are
+ * averaged into 1 degree C bins, the bins are fitted with a constant,
+ * line or parabola depending on how wide a range they cover.
+ */
+#define CALIB_TEMP_WINDOW	128
+#define CALIB_TEMP_MIN		0 // degrees C of the first bin
+#define CALIB_TEMP_BINS		64
+#define CALIB_TEMP_AVERAGE	16 // windows a bin averages over
+#define CALIB_TEMP_LINEAR	3.0f // degrees C covered for a line
+#define CALIB_TEMP_QUADRATIC	10.0f // and for a parabola
+#define CALIB_TEMP_OUTLIER	1.0f // degrees/s off the model, a slow turn
+
+/* Results of @ref calib_temp_add */
+#define CALIB_TEMP_SAME		0
+#define CALIB_TEMP_UPDATED	1 // model refitted
+#define CALIB_TEMP_GROWN	2 // and covers a wider range than before
+
+/*
+ * Offsets are stored in sector 12, the first one of flash bank 2. The
+ * linker script leaves bank 2 out of the image, so writing it does not
+ * stall code running from bank 1. Records are appended and the sector
+ * is only erased once it is full.
+ */
+#define CALIB_FLASH_SECTOR	FLASH_Sector_12
+#define CALIB_FLASH_ADDR	0x08100000
+#define CALIB_FLASH_SIZE	0x4000
+#define CALIB_MAGIC			0xCA1B0002 // changes with the record layout
+
+/* Gyroscope bias is gyro + gyro_tc[0] (t - temp) + gyro_tc[1] (t - temp)^2 */
+typedef struct {
+	float gyro[3];       // degrees/s at temp
+	float acce[3];       // g
+	float temp;          // degrees C
+	float gyro_tc[3][2]; // per degree C and per degree C squared
+	float temp_min;      // range the model was learned over, t is clamped to it
+	float temp_max;
+} calib_offsets_t;
+
+void calib_start(void);
+uint8_t calib_add(const int16_t *sample, float acce_mult, float gyro_mult);
+void calib_result(calib_offsets_t *offsets, float temp);
+void calib_temp_init(const calib_offsets_t *offsets);
+uint8_t calib_temp_add(const int16_t *sample, float acce_mult, float gyro_mult, float temp,
+		calib_offsets_t *offsets);
+void calib_gyro_bias(const calib_offsets_t *offsets, float temp, float *gyro);
+uint8_t calib_load(calib_offsets_t *offsets);
+uint8_t calib_save(const calib_offsets_t *offsets);
+
+#endif
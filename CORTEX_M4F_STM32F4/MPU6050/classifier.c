@@ -0,0 +1,9 @@
+#include "classifier.h"
+
+uint8_t classifier_predict(const int8_t *features) {
+	const classifier_node_t *node = classifier_nodes;
+
+	while (node->feature != CLASSIFIER_LEAF)
+		node = &classifier_nodes[(features[node->feature] <= node->threshold) ? node->left : node->right];
+	return node->left;
+}
@@ -0,0 +1,49 @@
+#ifndef _MPU6050_CLASSIFIER_H
+#define _MPU6050_CLASSIFIER_H
+
+/*
+ * Decision tree classifying a window of samples into a GESTURE_* command.
+ * The tree is trained on the host from recorded traces by remote_train
+ * (sim/train.c), which generates classifier_model.c. Inference compares
+ * int8 features only.
+ */
+
+#include <stdint.h>
+
+/* Window averages, 1/32 g, degrees and 8 degrees/s per step */
+#define CLASSIFIER_ACC_X		0
+#define CLASSIFIER_ACC_Y		1
+#define CLASSIFIER_ACC_Z		2
+#define CLASSIFIER_ROLL			3
+#define CLASSIFIER_PITCH		4
+#define CLASSIFIER_GYRO_X		5
+#define CLASSIFIER_GYRO_Y		6
+#define CLASSIFIER_GYRO_Z		7
+#define CLASSIFIER_FEATURES		8
+
+#define CLASSIFIER_ACC_SCALE	256 // raw units of the 4G range per step
+#define CLASSIFIER_GYRO_STEP	8.0f // degrees/s per step
+
+/* Windows per second, samples are averaged over 1 / CLASSIFIER_RATE */
+#define CLASSIFIER_RATE			25
+
+#define CLASSIFIER_LEAF			-1
+#define CLASSIFIER_MAX_NODES	255
+
+/*
+ * Inner nodes continue at left if features[feature] <= threshold and at
+ * right otherwise, leaves carry the command in left
+ */
+typedef struct {
+	int8_t feature;
+	int8_t threshold;
+	uint8_t left;
+	uint8_t right;
+} classifier_node_t;
+
+extern const classifier_node_t classifier_nodes[];
+extern const uint8_t classifier_node_count;
+
+uint8_t classifier_predict(const int8_t *features);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Generated by remote_train (sim/train.c), do not edit.
+ * orientation sweep, 100 Hz, depth 7, min leaf 4
+ * 65160 windows, 99.07% classified as labelled
+ */
+
+#include "classifier.h"
+#include "gesture.h"
+
+const classifier_node_t classifier_nodes[] = {
+	/*   0 */ { CLASSIFIER_ACC_Z, 0, 1, 44 },
+	/*   1 */ { CLASSIFIER_PITCH, -30, 2, 15 },
+	/*   2 */ { CLASSIFIER_ROLL, 89, 3, 12 },
+	/*   3 */ { CLASSIFIER_ROLL, -90, 4, 7 },
+	/*   4 */ { CLASSIFIER_PITCH, -40, 5, 6 },
+	/*   5 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*   6 */ { CLASSIFIER_LEAF, 0, GESTURE_LEFT, 0 },
+	/*   7 */ { CLASSIFIER_ACC_Y, -25, 8, 9 },
+	/*   8 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*   9 */ { CLASSIFIER_ACC_Y, 24, 10, 11 },
+	/*  10 */ { CLASSIFIER_LEAF, 0, GESTURE_DOWN, 0 },
+	/*  11 */ { CLASSIFIER_LEAF, 0, GESTURE_LEFT, 0 },
+	/*  12 */ { CLASSIFIER_PITCH, -40, 13, 14 },
+	/*  13 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  14 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*  15 */ { CLASSIFIER_PITCH, 46, 16, 39 },
+	/*  16 */ { CLASSIFIER_PITCH, 24, 17, 32 },
+	/*  17 */ { CLASSIFIER_ACC_Z, -19, 18, 25 },
+	/*  18 */ { CLASSIFIER_ROLL, -51, 19, 22 },
+	/*  19 */ { CLASSIFIER_ACC_X, -7, 20, 21 },
+	/*  20 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  21 */ { CLASSIFIER_LEAF, 0, GESTURE_LEFT, 0 },
+	/*  22 */ { CLASSIFIER_ROLL, 50, 23, 24 },
+	/*  23 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  24 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*  25 */ { CLASSIFIER_ACC_Y, -24, 26, 29 },
+	/*  26 */ { CLASSIFIER_ACC_Y, -25, 27, 28 },
+	/*  27 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*  28 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  29 */ { CLASSIFIER_ACC_Y, 24, 30, 31 },
+	/*  30 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  31 */ { CLASSIFIER_LEAF, 0, GESTURE_LEFT, 0 },
+	/*  32 */ { CLASSIFIER_ACC_Y, -25, 33, 34 },
+	/*  33 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*  34 */ { CLASSIFIER_ACC_Y, 24, 35, 38 },
+	/*  35 */ { CLASSIFIER_ACC_Z, -1, 36, 37 },
+	/*  36 */ { CLASSIFIER_LEAF, 0, GESTURE_UP, 0 },
+	/*  37 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  38 */ { CLASSIFIER_LEAF, 0, GESTURE_LEFT, 0 },
+	/*  39 */ { CLASSIFIER_ROLL, 89, 40, 43 },
+	/*  40 */ { CLASSIFIER_ROLL, -90, 41, 42 },
+	/*  41 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  42 */ { CLASSIFIER_LEAF, 0, GESTURE_FORWARD, 0 },
+	/*  43 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  44 */ { CLASSIFIER_ACC_Y, -25, 45, 46 },
+	/*  45 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*  46 */ { CLASSIFIER_ACC_Y, 24, 47, 56 },
+	/*  47 */ { CLASSIFIER_ACC_Y, -24, 48, 55 },
+	/*  48 */ { CLASSIFIER_PITCH, -40, 49, 50 },
+	/*  49 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  50 */ { CLASSIFIER_PITCH, 39, 51, 54 },
+	/*  51 */ { CLASSIFIER_ROLL, 98, 52, 53 },
+	/*  52 */ { CLASSIFIER_LEAF, 0, GESTURE_RIGHT, 0 },
+	/*  53 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  54 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  55 */ { CLASSIFIER_LEAF, 0, GESTURE_SUSPEND, 0 },
+	/*  56 */ { CLASSIFIER_LEAF, 0, GESTURE_LEFT, 0 },
+};
+
+const uint8_t classifier_node_count = sizeof(classifier_nodes) / sizeof(classifier_nodes[0]);
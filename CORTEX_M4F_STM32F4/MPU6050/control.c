@@ -0,0 +1,117 @@
+#include "control.h"
+#include "gesture.h"
+
+#define CONTROL_PERIOD_US	(1000000 / CONTROL_RATE)
+
+static control_axis_t axes[CONTROL_AXES] = {
+	{ 30, 350, 30 },   // roll, 3 to 35 degrees
+	{ 30, 350, 30 },   // pitch
+	{ 100, 1800, 30 }  // yaw, 10 to 180 degrees/s
+};
+
+static volatile uint8_t enabled; // requested by the command task
+static uint8_t running;
+static uint32_t next_frame;
+
+/* Yaw rate in 0.1 degrees/s per LSB, Q16 */
+static uint32_t yaw_mult_bits;
+static int32_t yaw_scale;
+
+void control_init(void) {
+	running = 0;
+	yaw_mult_bits = 0;
+	yaw_scale = 0;
+}
+
+void control_enable(uint8_t enable) {
+	enabled = enable;
+}
+
+uint8_t control_enabled(void) {
+	return enabled;
+}
+
+/* Setpoint of one axis, value in the unit of the axis settings */
+int16_t control_curve(const control_axis_t *axis, int32_t value) {
+	int32_t x, magnitude = (value < 0) ? -value : value;
+
+	if (magnitude <= axis->deadband)
+		return 0;
+	if (magnitude >= axis->range)
+		x = CONTROL_MAX;
+	else
+		x = (magnitude - axis->deadband) * CONTROL_MAX / (axis->range - axis->deadband);
+
+	/* Blend of linear and cubic, x^3 / CONTROL_MAX^2 stays within CONTROL_MAX */
+	x = (x * (100 - axis->expo) + (x * x / CONTROL_MAX * x / CONTROL_MAX) * axis->expo) / 100;
+	return (int16_t)((value < 0) ? -x : x);
+}
+
+/*
+ * Call after gesture_fuse, returns 1 and fills setpoints when the next
+ * frame is due. Frames follow sample timestamps, so a frame goes out
+ * with the first sample after each 1 / CONTROL_RATE.
+ */
+uint8_t control_update(float gyro_mult, uint32_t timestamp, int16_t *setpoints) {
+	union {
+		float f;
+		uint32_t u;
+	} mult = { gyro_mult };
+	int32_t roll, pitch, yaw;
+
+	if (!enabled) {
+		running = 0;
+		return 0;
+	}
+	if (!running) {
+		running = 1;
+		next_frame = timestamp;
+	}
+	if ((int32_t)(timestamp - next_frame) < 0)
+		return 0;
+	next_frame += CONTROL_PERIOD_US;
+	/* Behind by more than a frame after a gap, start over */
+	if ((int32_t)(timestamp - next_frame) >= 0)
+		next_frame = timestamp + CONTROL_PERIOD_US;
+
+	/* Only touch the FPU when the gyro range changes */
+	if (mult.u != yaw_mult_bits) {
+		yaw_mult_bits = mult.u;
+		yaw_scale = (int32_t)(gyro_mult * 10 * 65536);
+	}
+
+#ifdef GESTURE_FIXED
+	roll = (angleX * 10) >> 16;
+	pitch = (angleY * 10) >> 16;
+	yaw = (gyroZ * yaw_scale) >> 16;
+#else
+	roll = (int32_t)(angleX * 10);
+	pitch = (int32_t)(angleY * 10);
+	yaw = ((int32_t)gyroZ * yaw_scale) >> 16;
+#endif
+	setpoints[CONTROL_ROLL] = control_curve(&axes[CONTROL_ROLL], roll);
+	setpoints[CONTROL_PITCH] = control_curve(&axes[CONTROL_PITCH], pitch);
+	setpoints[CONTROL_YAW] = control_curve(&axes[CONTROL_YAW], yaw);
+	return 1;
+}
+
+/* Payload for the setpoints, returns its length */
+uint8_t control_pack(const int16_t *setpoints, uint8_t *payload) {
+	uint8_t i;
+
+	for (i = 0; i < CONTROL_AXES; i++) {
+		payload[2 * i] = (uint8_t)setpoints[i];
+		payload[2 * i + 1] = (uint8_t)((uint16_t)setpoints[i] >> 8);
+	}
+	return CONTROL_PAYLOAD_SIZE;
+}
+
+void control_set_axis(uint8_t axis, uint16_t deadband, uint16_t range, uint8_t expo) {
+	axes[axis].deadband = deadband;
+	axes[axis].range = range;
+	axes[axis].expo = expo;
+}
+
+const control_axis_t *control_get_axes(void) {
+	return axes;
+}
@@ -0,0 +1,49 @@
+#ifndef _MPU6050_CONTROL_H
+#define _MPU6050_CONTROL_H
+
+/*
+ * Proportional control output, the alternative to discrete gestures.
+ * Roll and pitch of the remote and its yaw rate are mapped to setpoints
+ * through a deadband and an expo curve per axis, and sent at a fixed
+ * rate. The heading drifts without a magnetometer, so yaw follows how
+ * fast the remote turns. Integer only like GESTURE_FIXED, no hardware
+ * dependencies.
+ */
+
+#include <stdint.h>
+
+#define CONTROL_ROLL		0
+#define CONTROL_PITCH		1
+#define CONTROL_YAW			2
+#define CONTROL_AXES		3
+
+/* Setpoints go from -CONTROL_MAX to CONTROL_MAX */
+#define CONTROL_MAX			1000
+
+/* Frames per second, independent of the sample rate */
+#define CONTROL_RATE		50
+
+/* Payload of PROTOCOL_CONTROL frames, roll, pitch and yaw as int16 little endian */
+#define CONTROL_PAYLOAD_SIZE	(2 * CONTROL_AXES)
+
+/*
+ * Deadband and full deflection in 0.1 degrees, 0.1 degrees/s for yaw.
+ * expo in percent, 0 is linear, 100 cubic.
+ */
+typedef struct {
+	uint16_t deadband;
+	uint16_t range;
+	uint8_t expo;
+} control_axis_t;
+
+void control_init(void);
+void control_enable(uint8_t enable);
+uint8_t control_enabled(void);
+uint8_t control_update(float gyro_mult, uint32_t timestamp, int16_t *setpoints);
+uint8_t control_pack(const int16_t *setpoints, uint8_t *payload);
+int16_t control_curve(const control_axis_t *axis, int32_t value);
+
+void control_set_axis(uint8_t axis, uint16_t deadband, uint16_t range, uint8_t expo);
+const control_axis_t *control_get_axes(void);
+
+#endif
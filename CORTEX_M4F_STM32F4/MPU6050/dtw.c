@@ -0,0 +1,306 @@
+#include "dtw.h"
+#include "gesture.h"
+
+#include <string.h>
+
+#define DTW_CELLS			(2 * DTW_BAND + 1) // per template frame
+#define DTW_INFINITY		0x3FFFFFFF
+#define DTW_NO_MATCH		0xFFFF
+
+static dtw_template_t templates[DTW_TEMPLATES];
+
+/* Frames oldest first up to ring_head, steps of DTW_UNIT */
+static int8_t ring[DTW_RING][DTW_AXES];
+static uint8_t ring_head = 0;
+static uint8_t ring_count = 0;
+
+static int32_t frame_sum[DTW_AXES]; // steps in Q16
+static uint8_t frame_samples = 0;
+static uint8_t decimation = 1;      // samples per frame
+static uint8_t per_sample = DTW_TEMPLATES; // comparisons per sample
+static uint32_t mult_bits = 0;      // gyro_mult the scale was computed for
+static int32_t scale_q16 = 0;       // steps per LSB
+
+/* Templates compared with the newest frame so far */
+static uint8_t next_slot = DTW_TEMPLATES;
+static uint8_t hold = 0; // frames left before a match counts again
+
+/* Best match ending at the newest frame and the best one so far, 256 is the threshold */
+static uint8_t frame_command, candidate_command;
+static uint8_t frame_length, candidate_length;
+static uint16_t frame_score, candidate_score;
+
+static volatile uint8_t record_request = 0;
+static volatile uint8_t forget_request = 0; // slot + 1
+static uint8_t recording = 0; // command being recorded
+static uint16_t record_wait;
+static uint8_t record_quiet;
+static dtw_template_t record;
+
+static dtw_stats_t stats;
+
+void dtw_init(uint16_t rate) {
+	ring_head = 0;
+	ring_count = 0;
+	next_slot = DTW_TEMPLATES;
+	hold = 0;
+	frame_command = candidate_command = GESTURE_NONE;
+	frame_score = candidate_score = DTW_NO_MATCH;
+	recording = 0;
+	dtw_set_rate(rate);
+}
+
+/* Sample rate changed, the window is kept */
+void dtw_set_rate(uint16_t rate) {
+	decimation = (rate > DTW_RATE) ? rate / DTW_RATE : 1;
+	per_sample = (DTW_TEMPLATES + decimation - 1) / decimation;
+	memset(frame_sum, 0, sizeof(frame_sum));
+	frame_samples = 0;
+}
+
+static uint16_t dtw_abs(int16_t value) {
+	return (value < 0) ? -value : value;
+}
+
+/*
+ * Warped distance between a template and the window ending at the newest
+ * frame, relative to the threshold. The window is DTW_BAND frames longer
+ * than the template, so the match may start anywhere in the first
+ * 2 * DTW_BAND + 1 frames. Gives up once a whole row is above the
+ * threshold, the distance only grows from there.
+ */
+static uint16_t dtw_compare(const dtw_template_t *t, uint16_t *cells) {
+	uint32_t rows[2][DTW_CELLS];
+	uint32_t *prev = rows[0], *cur = rows[1], *swap;
+	uint32_t cost, best;
+	uint8_t n = t->length + DTW_BAND;
+	uint8_t start = ring_head - n;
+	uint8_t i, j, k;
+
+	/* Row j pairs template frame j with window frames j to j + 2 * DTW_BAND */
+	for (j = 0; j < t->length; j++) {
+		const int8_t *y = t->frames[j];
+
+		best = DTW_INFINITY;
+		for (k = 0; k < DTW_CELLS; k++) {
+			const int8_t *x;
+
+			i = j + k;
+			if (i >= n) {
+				cur[k] = DTW_INFINITY;
+				continue;
+			}
+			x = ring[(uint8_t)(start + i) & (DTW_RING - 1)];
+			cost = dtw_abs(x[0] - y[0]) + dtw_abs(x[1] - y[1]) + dtw_abs(x[2] - y[2]);
+			if (j > 0) {
+				/* Both advance, the window advances, the template advances */
+				uint32_t step = prev[k];
+
+				if (k > 0 && cur[k - 1] < step)
+					step = cur[k - 1];
+				if (k < DTW_CELLS - 1 && prev[k + 1] < step)
+					step = prev[k + 1];
+				cost += step;
+			}
+			cur[k] = cost;
+			if (cost < best)
+				best = cost;
+		}
+		*cells += DTW_CELLS;
+		if (best > t->threshold) {
+			stats.abandoned++;
+			return DTW_NO_MATCH;
+		}
+		swap = prev;
+		prev = cur;
+		cur = swap;
+	}
+
+	/* The last template frame pairs with the newest frame */
+	cost = prev[DTW_BAND];
+	if (cost > t->threshold)
+		return DTW_NO_MATCH;
+	return (uint16_t)((cost << 8) / t->threshold);
+}
+
+/* Compare the newest frame with the next few templates */
+static void dtw_match(void) {
+	uint8_t budget = per_sample;
+	uint16_t cells = 0, score;
+
+	while (budget > 0 && next_slot < DTW_TEMPLATES) {
+		const dtw_template_t *t = &templates[next_slot++];
+
+		if (t->command == GESTURE_NONE || ring_count < t->length + DTW_BAND)
+			continue;
+		budget--;
+		stats.compared++;
+		score = dtw_compare(t, &cells);
+		if (score < frame_score) {
+			frame_score = score;
+			frame_command = t->command;
+			frame_length = t->length;
+		}
+	}
+	if (cells > stats.cells_max)
+		stats.cells_max = cells;
+}
+
+/* Add a recorded frame, returns an event once the recording ended */
+static uint8_t dtw_record_frame(const int8_t *frame) {
+	uint16_t motion = dtw_abs(frame[0]) + dtw_abs(frame[1]) + dtw_abs(frame[2]);
+	uint8_t command = recording, slot;
+
+	/* Wait for the motion to start */
+	if (record.length == 0 && motion < DTW_RECORD_MOTION) {
+		if (++record_wait < DTW_RECORD_TIMEOUT)
+			return GESTURE_NONE;
+		recording = 0;
+		return DTW_EVENT_NO_MOTION;
+	}
+
+	memcpy(record.frames[record.length++], frame, DTW_AXES);
+	record_quiet = (motion < DTW_RECORD_MOTION) ? record_quiet + 1 : 0;
+	if (record_quiet < DTW_RECORD_QUIET && record.length < DTW_MAX_LENGTH)
+		return GESTURE_NONE;
+
+	/* Motion ended, drop the quiet tail */
+	recording = 0;
+	record.length -= record_quiet;
+	if (record.length < DTW_MIN_LENGTH)
+		return DTW_EVENT_SHORT;
+	for (slot = 0; slot < DTW_TEMPLATES; slot++)
+		if (templates[slot].command == GESTURE_NONE)
+			break;
+	if (slot == DTW_TEMPLATES)
+		return DTW_EVENT_FULL;
+
+	record.command = command;
+	record.threshold = DTW_THRESHOLD * record.length;
+	templates[slot] = record;
+
+	/* The recorded motion itself must not match */
+	hold = record.length + DTW_BAND;
+	return DTW_EVENT_RECORDED;
+}
+
+/* A frame completed, returns a command or event */
+static uint8_t dtw_frame(void) {
+	int8_t *frame = ring[ring_head];
+	uint8_t command = GESTURE_NONE, slot;
+	int32_t value;
+	uint8_t a;
+
+	for (a = 0; a < DTW_AXES; a++) {
+		value = frame_sum[a] / ((int32_t)decimation << 16);
+		frame[a] = (int8_t)((value > 127) ? 127 : (value < -127) ? -127 : value);
+		frame_sum[a] = 0;
+	}
+	frame_samples = 0;
+	ring_head = (ring_head + 1) & (DTW_RING - 1);
+	if (ring_count < DTW_RING)
+		ring_count++;
+
+	if (record_request) {
+		recording = record_request;
+		record_request = 0;
+		record.length = 0;
+		record_wait = 0;
+		record_quiet = 0;
+		/* Nothing compared before the recording may be reported after it */
+		candidate_command = frame_command = GESTURE_NONE;
+		candidate_score = frame_score = DTW_NO_MATCH;
+	}
+	if (recording) {
+		next_slot = DTW_TEMPLATES;
+		return dtw_record_frame(frame);
+	}
+
+	/*
+	 * The frames of a reported gesture must leave the window first. They
+	 * are still compared, so every sample costs the same.
+	 */
+	if (hold > 0) {
+		hold--;
+		frame_score = DTW_NO_MATCH;
+	}
+
+	/* A match is reported once its distance stops falling */
+	if (frame_score < candidate_score) {
+		candidate_command = frame_command;
+		candidate_length = frame_length;
+		candidate_score = frame_score;
+	} else if (candidate_command != GESTURE_NONE) {
+		command = candidate_command;
+		hold = candidate_length;
+		candidate_command = GESTURE_NONE;
+		candidate_score = DTW_NO_MATCH;
+		stats.matches++;
+	}
+	frame_command = GESTURE_NONE;
+	frame_score = DTW_NO_MATCH;
+	next_slot = 0;
+
+	/* After the comparisons of this frame, a reported match goes first */
+	if (forget_request && command == GESTURE_NONE) {
+		slot = forget_request - 1;
+		forget_request = 0;
+		/* An empty slot stays as it is, nothing to save */
+		if (templates[slot].command != GESTURE_NONE) {
+			templates[slot].command = GESTURE_NONE;
+			candidate_command = GESTURE_NONE;
+			candidate_score = DTW_NO_MATCH;
+			command = DTW_EVENT_FORGOTTEN;
+		}
+	}
+	return command;
+}
+
+/*
+ * Add a bias corrected gyroscope sample. Returns a GESTURE_* command when
+ * a template matched, a DTW_EVENT_* when a request was carried out,
+ * GESTURE_NONE otherwise.
+ */
+uint8_t dtw_push(const int16_t *gyro, float gyro_mult) {
+	union {
+		float f;
+		uint32_t u;
+	} mult = { gyro_mult };
+	uint8_t result = GESTURE_NONE;
+	uint8_t a;
+
+	/* Only touch the FPU when the gyro range changes */
+	if (mult.u != mult_bits) {
+		mult_bits = mult.u;
+		scale_q16 = (int32_t)(gyro_mult / DTW_UNIT * 65536);
+	}
+	for (a = 0; a < DTW_AXES; a++)
+		frame_sum[a] += gyro[a] * scale_q16;
+	if (++frame_samples >= decimation)
+		result = dtw_frame();
+
+	dtw_match();
+	return result;
+}
+
+/* Record the next motion as a template for command */
+void dtw_record(uint8_t command) {
+	record_request = command;
+}
+
+void dtw_forget(uint8_t slot) {
+	if (slot < DTW_TEMPLATES)
+		forget_request = slot + 1;
+}
+
+const dtw_template_t *dtw_get_templates(void) {
+	return templates;
+}
+
+void dtw_set_templates(const dtw_template_t *stored) {
+	memcpy(templates, stored, sizeof(templates));
+}
+
+void dtw_get_stats(dtw_stats_t *stats_out) {
+	memcpy(stats_out, &stats, sizeof(stats));
+}
@@ -0,0 +1,87 @@
+#ifndef _MPU6050_DTW_H
+#define _MPU6050_DTW_H
+
+/*
+ * Motion gestures matched against recorded templates with dynamic time
+ * warping. Gyroscope samples are averaged into frames of DTW_RATE and the
+ * newest frames kept in a ring buffer. Each completed frame is compared
+ * with every template, spread over the samples until the next frame so
+ * the cost of one sample stays bounded. A match is reported once its
+ * distance stopped falling.
+ *
+ * No hardware or RTOS dependencies, so it also runs in the benchmarks.
+ * Templates are kept in flash by dtw_flash.c.
+ */
+
+#include <stdint.h>
+
+#define DTW_RATE			50 // frames per second
+#define DTW_AXES			3
+#define DTW_UNIT			4.0f // degrees/s per step, frames are int8
+
+#define DTW_TEMPLATES		8
+#define DTW_MAX_LENGTH		48 // frames
+#define DTW_MIN_LENGTH		8
+
+/*
+ * Frames a template may be shifted against the window (Sakoe-Chiba band),
+ * also how much earlier or later than its length a gesture may start
+ */
+#define DTW_BAND			6
+#define DTW_RING			64 // frames kept, power of 2 at least DTW_MAX_LENGTH + DTW_BAND
+
+/* Largest distance per template frame that is a match, in steps summed over the axes */
+#define DTW_THRESHOLD		12
+
+/* Recording starts with motion above this and ends after DTW_RECORD_QUIET frames below */
+#define DTW_RECORD_MOTION	10 // steps summed over the axes
+#define DTW_RECORD_QUIET	10
+#define DTW_RECORD_TIMEOUT	(5 * DTW_RATE) // frames to wait for the motion
+
+/*
+ * Templates are stored in sector 13 behind the calibration (calib.h),
+ * appended like its records
+ */
+#define DTW_FLASH_SECTOR	FLASH_Sector_13
+#define DTW_FLASH_ADDR		0x08104000
+#define DTW_FLASH_SIZE		0x4000
+#define DTW_MAGIC			0xD7A10001 // changes with the template layout
+
+/* Results of @ref dtw_push besides the GESTURE_* commands of gesture.h */
+#define DTW_EVENT_RECORDED	0x80
+#define DTW_EVENT_SHORT		0x81 // recorded motion was shorter than DTW_MIN_LENGTH
+#define DTW_EVENT_NO_MOTION	0x82
+#define DTW_EVENT_FULL		0x83 // no free template slot
+#define DTW_EVENT_FORGOTTEN	0x84
+
+typedef struct {
+	uint8_t command;     // GESTURE_* reported on a match, 0 for a free slot
+	uint8_t length;      // frames
+	uint16_t threshold;  // largest warped distance that is a match
+	int8_t frames[DTW_MAX_LENGTH][DTW_AXES];
+} dtw_template_t;
+
+typedef struct {
+	uint32_t matches;    // gestures reported
+	uint32_t compared;   // template comparisons
+	uint32_t abandoned;  // comparisons stopped early
+	uint16_t cells_max;  // most DTW cells computed for one sample
+} dtw_stats_t;
+
+void dtw_init(uint16_t rate);
+void dtw_set_rate(uint16_t rate);
+uint8_t dtw_push(const int16_t *gyro, float gyro_mult);
+
+/* Requests from other tasks, carried out by the next dtw_push */
+void dtw_record(uint8_t command);
+void dtw_forget(uint8_t slot);
+
+const dtw_template_t *dtw_get_templates(void);
+void dtw_set_templates(const dtw_template_t *templates);
+void dtw_get_stats(dtw_stats_t *stats);
+
+/* Flash storage, dtw_flash.c */
+uint8_t dtw_load(void);
+uint8_t dtw_save(void);
+
+#endif
@@ -0,0 +1,118 @@
+#include "dtw.h"
+
+#include <string.h>
+
+#include "stm32f4xx.h"
+#include "stm32f4xx_flash.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Flash record of all template slots, the magic word is programmed last */
+typedef struct {
+	dtw_template_t templates[DTW_TEMPLATES];
+	uint32_t checksum;
+	uint32_t magic;
+} dtw_record_t;
+
+#define DTW_RECORD_WORDS	(sizeof(dtw_record_t) / 4)
+#define DTW_RECORDS			(DTW_FLASH_SIZE / sizeof(dtw_record_t))
+
+static dtw_record_t dtw_buffer;
+
+static uint32_t dtw_checksum(const dtw_record_t *record) {
+	const uint32_t *word = (const uint32_t *)record->templates;
+	uint32_t sum = DTW_MAGIC;
+	uint16_t i;
+
+	for (i = 0; i < sizeof(record->templates) / 4; i++)
+		sum = ((sum << 5) | (sum >> 27)) ^ word[i];
+	return sum;
+}
+
+static const dtw_record_t *dtw_stored(uint16_t index) {
+	return (const dtw_record_t *)(DTW_FLASH_ADDR + index * sizeof(dtw_record_t));
+}
+
+static uint8_t dtw_erased(const dtw_record_t *record) {
+	const uint32_t *word = (const uint32_t *)record;
+	uint16_t i;
+
+	for (i = 0; i < DTW_RECORD_WORDS; i++)
+		if (word[i] != 0xFFFFFFFF)
+			return 0;
+	return 1;
+}
+
+/* Newest valid record, NULL if there is none */
+static const dtw_record_t *dtw_newest(void) {
+	const dtw_record_t *found = NULL;
+	uint16_t i;
+
+	for (i = 0; i < DTW_RECORDS; i++) {
+		const dtw_record_t *record = dtw_stored(i);
+
+		if (dtw_erased(record))
+			break;
+		if (record->magic == DTW_MAGIC && record->checksum == dtw_checksum(record))
+			found = record;
+	}
+	return found;
+}
+
+/* Newest stored templates, returns 0 if there are none */
+uint8_t dtw_load(void) {
+	const dtw_record_t *found = dtw_newest();
+
+	if (found == NULL)
+		return 0;
+	dtw_set_templates(found->templates);
+	return 1;
+}
+
+/*
+ * Append all templates behind the last record, erasing the sector when
+ * it is full. Erasing takes a few hundred milliseconds, call from a task
+ * of lower priority than the sensor task. Templates equal to the newest
+ * record are not written again. Returns 0 on failure.
+ */
+uint8_t dtw_save(void) {
+	const dtw_record_t *newest = dtw_newest();
+	const uint32_t *word = (const uint32_t *)&dtw_buffer;
+	uint32_t address;
+	uint16_t index, i;
+	uint8_t ok = 1;
+
+	/* The sensor task must not change a slot halfway through the copy */
+	taskENTER_CRITICAL();
+	memcpy(dtw_buffer.templates, dtw_get_templates(), sizeof(dtw_buffer.templates));
+	taskEXIT_CRITICAL();
+	if (newest != NULL && memcmp(newest->templates, dtw_buffer.templates, sizeof(dtw_buffer.templates)) == 0)
+		return 1;
+
+	dtw_buffer.checksum = dtw_checksum(&dtw_buffer);
+	dtw_buffer.magic = DTW_MAGIC;
+
+	/* Slot after the last used one, even if that one is torn */
+	for (index = DTW_RECORDS; index > 0; index--)
+		if (!dtw_erased(dtw_stored(index - 1)))
+			break;
+
+	FLASH_Unlock();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR
+			| FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	if (index == DTW_RECORDS) {
+		if (FLASH_EraseSector(DTW_FLASH_SECTOR, VoltageRange_3) != FLASH_COMPLETE)
+			ok = 0;
+		index = 0;
+	}
+
+	address = (uint32_t)dtw_stored(index);
+	for (i = 0; ok && i < DTW_RECORD_WORDS; i++)
+		if (FLASH_ProgramWord(address + i * 4, word[i]) != FLASH_COMPLETE)
+			ok = 0;
+
+	FLASH_Lock();
+	return ok;
+}
@@ -0,0 +1,219 @@
+#include "filter.h"
+
+#include <math.h>
+
+#ifdef STM32F429_439xx
+#include "stm32f4xx.h"
+#endif
+
+#ifdef FILTER_CMSIS_DSP
+#include "arm_math.h"
+#endif
+
+/*
+ * Coefficients are stored as {b0, 0, b1, b2, a1, a2} per stage, scaled
+ * down by 2^FILTER_POST_SHIFT so that |a1| up to 2 fits in Q15, with
+ * y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] + a1 y[n-1] + a2 y[n-2].
+ * State is {x[n-1], x[n-2], y[n-1], y[n-2]} per stage.
+ */
+#define FILTER_POST_SHIFT	1
+
+#define FILTER_PI			3.14159265f
+
+typedef struct {
+	uint8_t stages;
+	int16_t coeffs[6 * FILTER_MAX_STAGES];
+	int16_t state[4 * FILTER_MAX_STAGES];
+#ifdef FILTER_CMSIS_DSP
+	arm_biquad_casd_df1_inst_q15 inst;
+#endif
+} filter_channel_t;
+
+static filter_channel_t channels_f[FILTER_CHANNELS];
+
+static int16_t filter_q15(float x) {
+	int32_t q = (int32_t)lrintf(x * (32768 >> FILTER_POST_SHIFT));
+
+	if (q > 32767)
+		q = 32767;
+	else if (q < -32768)
+		q = -32768;
+	return (int16_t)q;
+}
+
+/* Append a normalized stage, b and a from the RBJ cookbook with a0 = 1 */
+static uint8_t filter_add(uint8_t channels, float b0, float b1, float b2, float a1, float a2) {
+	uint8_t i;
+
+	for (i = 0; i < FILTER_CHANNELS; i++)
+		if ((channels & (1 << i)) && channels_f[i].stages == FILTER_MAX_STAGES)
+			return 0;
+
+	for (i = 0; i < FILTER_CHANNELS; i++) {
+		filter_channel_t *f = &channels_f[i];
+		int16_t *c;
+
+		if (!(channels & (1 << i)))
+			continue;
+
+		c = &f->coeffs[6 * f->stages];
+		c[0] = filter_q15(b0);
+		c[1] = 0;
+		c[2] = filter_q15(b1);
+		c[3] = filter_q15(b2);
+		c[4] = filter_q15(-a1); // CMSIS adds the feedback terms
+		c[5] = filter_q15(-a2);
+		f->stages++;
+#ifdef FILTER_CMSIS_DSP
+		arm_biquad_cascade_df1_init_q15(&f->inst, f->stages, f->coeffs, f->state, FILTER_POST_SHIFT);
+#endif
+	}
+	return 1;
+}
+
+void filter_clear(uint8_t channels) {
+	uint8_t i, j;
+
+	for (i = 0; i < FILTER_CHANNELS; i++) {
+		if (!(channels & (1 << i)))
+			continue;
+		channels_f[i].stages = 0;
+		for (j = 0; j < 4 * FILTER_MAX_STAGES; j++)
+			channels_f[i].state[j] = 0;
+	}
+}
+
+uint8_t filter_add_lowpass(uint8_t channels, float cutoff, float rate, float q) {
+	float w0 = 2.0f * FILTER_PI * cutoff / rate;
+	float cosw = cosf(w0), alpha = sinf(w0) / (2.0f * q);
+	float a0 = 1.0f + alpha;
+
+	return filter_add(channels, (1.0f - cosw) / 2.0f / a0, (1.0f - cosw) / a0,
+			(1.0f - cosw) / 2.0f / a0, -2.0f * cosw / a0, (1.0f - alpha) / a0);
+}
+
+uint8_t filter_add_notch(uint8_t channels, float freq, float rate, float q) {
+	float w0 = 2.0f * FILTER_PI * freq / rate;
+	float cosw = cosf(w0), alpha = sinf(w0) / (2.0f * q);
+	float a0 = 1.0f + alpha;
+
+	return filter_add(channels, 1.0f / a0, -2.0f * cosw / a0, 1.0f / a0,
+			-2.0f * cosw / a0, (1.0f - alpha) / a0);
+}
+
+void filter_init(float rate) {
+	filter_clear(FILTER_ACC | FILTER_GYRO);
+
+	if (FILTER_ACC_CUTOFF > 0)
+		filter_add_lowpass(FILTER_ACC, FILTER_ACC_CUTOFF, rate, 0.7071f);
+	if (FILTER_GYRO_CUTOFF > 0)
+		filter_add_lowpass(FILTER_GYRO, FILTER_GYRO_CUTOFF, rate, 0.7071f);
+	if (FILTER_NOTCH_FREQ > 0)
+		filter_add_notch(FILTER_ACC | FILTER_GYRO, FILTER_NOTCH_FREQ, rate, FILTER_NOTCH_Q);
+}
+
+/* Start from a steady input, both filter types have unity gain at DC */
+void filter_prime(const int16_t *sample) {
+	uint8_t i, j;
+
+	for (i = 0; i < FILTER_CHANNELS; i++)
+		for (j = 0; j < 4 * FILTER_MAX_STAGES; j++)
+			channels_f[i].state[j] = sample[i];
+}
+
+#ifndef FILTER_CMSIS_DSP
+static void filter_biquad_q15(filter_channel_t *f, const int16_t *src, int16_t *dst, uint16_t n) {
+	const int16_t *c = f->coeffs;
+	int16_t *s = f->state;
+	uint8_t stage;
+	uint16_t i;
+
+	for (stage = 0; stage < f->stages; stage++, c += 6, s += 4) {
+		int32_t b0 = c[0];
+#ifdef STM32F429_439xx
+		/* Pairs of Q15 values packed in one word for the dual MAC */
+		uint32_t b12 = (uint16_t)c[2] | (uint32_t)c[3] << 16;
+		uint32_t a12 = (uint16_t)c[4] | (uint32_t)c[5] << 16;
+		uint32_t x12 = (uint16_t)s[0] | (uint32_t)s[1] << 16;
+		uint32_t y12 = (uint16_t)s[2] | (uint32_t)s[3] << 16;
+
+		for (i = 0; i < n; i++) {
+			int32_t x = src[i];
+			int64_t acc = (int64_t)(b0 * x);
+			int32_t y;
+
+			acc = (int64_t)__SMLALD(b12, x12, (uint64_t)acc);
+			acc = (int64_t)__SMLALD(a12, y12, (uint64_t)acc);
+			y = __SSAT((int32_t)(acc >> (15 - FILTER_POST_SHIFT)), 16);
+
+			x12 = __PKHBT(x, x12, 16);
+			y12 = __PKHBT(y, y12, 16);
+			dst[i] = (int16_t)y;
+		}
+
+		s[0] = (int16_t)x12;
+		s[1] = (int16_t)(x12 >> 16);
+		s[2] = (int16_t)y12;
+		s[3] = (int16_t)(y12 >> 16);
+#else
+		int32_t x1 = s[0], x2 = s[1], y1 = s[2], y2 = s[3];
+
+		for (i = 0; i < n; i++) {
+			int32_t x = src[i];
+			int64_t acc = (int64_t)b0 * x + (int64_t)c[2] * x1 + (int64_t)c[3] * x2
+					+ (int64_t)c[4] * y1 + (int64_t)c[5] * y2;
+			int32_t y = (int32_t)(acc >> (15 - FILTER_POST_SHIFT));
+
+			if (y > 32767)
+				y = 32767;
+			else if (y < -32768)
+				y = -32768;
+
+			x2 = x1;
+			x1 = x;
+			y2 = y1;
+			y1 = y;
+			dst[i] = (int16_t)y;
+		}
+
+		s[0] = (int16_t)x1;
+		s[1] = (int16_t)x2;
+		s[2] = (int16_t)y1;
+		s[3] = (int16_t)y2;
+#endif
+		src = dst; // later stages work in place
+	}
+}
+#endif
+
+/* Filter count interleaved samples in place */
+void filter_block(int16_t *samples, uint16_t count) {
+	int16_t block[FILTER_BLOCK_SIZE];
+	uint16_t done, n, i;
+	uint8_t ch;
+
+	for (done = 0; done < count; done += n) {
+		n = count - done;
+		if (n > FILTER_BLOCK_SIZE)
+			n = FILTER_BLOCK_SIZE;
+
+		for (ch = 0; ch < FILTER_CHANNELS; ch++) {
+			filter_channel_t *f = &channels_f[ch];
+			int16_t *p = &samples[done * FILTER_CHANNELS + ch];
+
+			if (f->stages == 0)
+				continue;
+
+			/* One contiguous block per channel */
+			for (i = 0; i < n; i++)
+				block[i] = p[i * FILTER_CHANNELS];
+#ifdef FILTER_CMSIS_DSP
+			arm_biquad_cascade_df1_q15(&f->inst, block, block, n);
+#else
+			filter_biquad_q15(f, block, block, n);
+#endif
+			for (i = 0; i < n; i++)
+				p[i * FILTER_CHANNELS] = block[i];
+		}
+	}
+}
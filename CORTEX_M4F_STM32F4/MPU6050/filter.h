@@ -0,0 +1,36 @@
+#ifndef _MPU6050_FILTER_H
+#define _MPU6050_FILTER_H
+
+/*
+ * Biquad pre-filter for raw MPU6050 samples.
+ *
+ * Every channel runs a cascade of Q15 direct form I biquads with the
+ * coefficient and state layout of arm_biquad_cascade_df1_q15, so the
+ * CMSIS-DSP library can be linked in instead of the local kernel
+ * (FILTER_CMSIS_DSP, see Makefile). No hardware or RTOS dependencies.
+ */
+
+#include <stdint.h>
+
+/* Samples are interleaved as ax ay az gx gy gz */
+#define FILTER_CHANNELS		6
+#define FILTER_ACC			0x07 // channel masks
+#define FILTER_GYRO			0x38
+
+#define FILTER_MAX_STAGES	2
+#define FILTER_BLOCK_SIZE	32 // samples per channel handled in one pass
+
+/* Default stages set by @ref filter_init, 0 disables one */
+#define FILTER_ACC_CUTOFF	10.0f // Hz, second order Butterworth low-pass
+#define FILTER_GYRO_CUTOFF	30.0f
+#define FILTER_NOTCH_FREQ	0.0f  // Hz, applied to all channels
+#define FILTER_NOTCH_Q		5.0f
+
+void filter_init(float rate);
+void filter_clear(uint8_t channels);
+uint8_t filter_add_lowpass(uint8_t channels, float cutoff, float rate, float q);
+uint8_t filter_add_notch(uint8_t channels, float freq, float rate, float q);
+void filter_prime(const int16_t *sample);
+void filter_block(int16_t *samples, uint16_t count);
+
+#endif
@@ -0,0 +1,208 @@
+#include "fusion.h"
+
+#include <string.h>
+
+typedef struct {
+	int16_t gyro[3];
+	uint32_t timestamp;
+} fusion_sample_t;
+
+static fusion_sample_t history[FUSION_HISTORY];
+static uint16_t history_head = 0; // next slot, newest sample is before it
+static uint16_t history_count = 0;
+static int16_t second_step[3]; // between the two newest second gyroscope samples
+static int16_t mpu_last[3];
+
+static float gyro_mult_last, second_mult_last;
+static int32_t scale_q8;    // second gyroscope to MPU6050 units
+static int32_t still_raw;   // FUSION_STILL in MPU6050 units
+static int32_t disagree_raw;
+
+static int32_t bias_q8[3];
+static uint32_t var_mpu_q4 = 0; // noise variance summed over axes, MPU6050 units
+static uint32_t var_second_q4 = 0; // second gyroscope units
+static uint16_t learned = 0;
+static uint8_t disagree_run = 0;
+static uint8_t still_run = 0;
+static fusion_stats_t stats;
+
+/* Noise above this is a slow turn, also keeps the squares in range */
+#define FUSION_NOISE_MAX	4096
+
+void fusion_init(void) {
+	history_head = 0;
+	history_count = 0;
+	memset(bias_q8, 0, sizeof(bias_q8));
+	var_mpu_q4 = 0;
+	var_second_q4 = 0;
+	learned = 0;
+	disagree_run = 0;
+	still_run = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+static int32_t fusion_clamp(int32_t value, int32_t limit) {
+	if (value > limit)
+		return limit;
+	if (value < -limit)
+		return -limit;
+	return value;
+}
+
+/* Degrees/s per LSB of both sensors, again whenever a range changes */
+void fusion_set_scale(float gyro_mult, float second_mult) {
+	float ratio;
+	uint8_t i;
+
+	/* What was learned is kept in raw units */
+	if (scale_q8 != 0) {
+		ratio = gyro_mult_last / gyro_mult;
+		for (i = 0; i < 3; i++) {
+			bias_q8[i] = (int32_t)(bias_q8[i] * ratio);
+			mpu_last[i] = (int16_t)(mpu_last[i] * ratio);
+		}
+		var_mpu_q4 = (uint32_t)(var_mpu_q4 * ratio * ratio);
+		ratio = second_mult_last / second_mult;
+		var_second_q4 = (uint32_t)(var_second_q4 * ratio * ratio);
+	}
+	gyro_mult_last = gyro_mult;
+	second_mult_last = second_mult;
+	scale_q8 = (int32_t)(second_mult / gyro_mult * 256 + 0.5f);
+	still_raw = (int32_t)(FUSION_STILL / gyro_mult);
+	disagree_raw = (int32_t)(FUSION_DISAGREE / gyro_mult);
+}
+
+/* Add a second gyroscope sample, oldest first */
+void fusion_push(const int16_t *gyro, uint32_t timestamp) {
+	fusion_sample_t *s = &history[history_head];
+	const fusion_sample_t *last = &history[(history_head - 1) & (FUSION_HISTORY - 1)];
+	uint8_t i;
+
+	for (i = 0; i < 3; i++)
+		second_step[i] = (history_count > 0) ? gyro[i] - last->gyro[i] : 0;
+	s->gyro[0] = gyro[0];
+	s->gyro[1] = gyro[1];
+	s->gyro[2] = gyro[2];
+	s->timestamp = timestamp;
+	history_head = (history_head + 1) & (FUSION_HISTORY - 1);
+	if (history_count < FUSION_HISTORY)
+		history_count++;
+}
+
+/* Second gyroscope at timestamp in its own units, 0 if there is none close enough */
+static uint8_t fusion_interpolate(uint32_t timestamp, int32_t *gyro) {
+	const fusion_sample_t *newer, *older;
+	uint16_t n, index;
+	int32_t span, frac;
+	uint8_t i;
+
+	if (history_count == 0)
+		return 0;
+
+	/* Walk back from the newest sample to the first one not after timestamp */
+	index = (history_head - 1) & (FUSION_HISTORY - 1);
+	newer = &history[index];
+	if ((int32_t)(timestamp - newer->timestamp) >= 0) {
+		if (timestamp - newer->timestamp > FUSION_STALE)
+			return 0;
+		for (i = 0; i < 3; i++)
+			gyro[i] = newer->gyro[i];
+		return 1;
+	}
+	for (n = 1; n < history_count; n++) {
+		index = (index - 1) & (FUSION_HISTORY - 1);
+		older = &history[index];
+		if ((int32_t)(timestamp - older->timestamp) >= 0) {
+			span = (int32_t)(newer->timestamp - older->timestamp);
+			if (span <= 0 || span > FUSION_STALE)
+				return 0;
+			frac = (int32_t)(((timestamp - older->timestamp) << 8) / (uint32_t)span);
+			for (i = 0; i < 3; i++)
+				gyro[i] = older->gyro[i] + (((newer->gyro[i] - older->gyro[i]) * frac) >> 8);
+			return 1;
+		}
+		newer = older;
+	}
+	return 0;
+}
+
+/*
+ * Combine bias corrected MPU6050 gyroscope raw values taken at timestamp
+ * with the second gyroscope, in place. Returns 1 if both were used.
+ */
+uint8_t fusion_apply(int16_t *gyro, uint32_t timestamp) {
+	int32_t second[3], diff[3], mpu, limit, value;
+	uint32_t var_mpu = 0, var_second = 0;
+	uint64_t var_scaled;
+	uint8_t i, still = 1, disagree = 0;
+
+	if (scale_q8 == 0 || !fusion_interpolate(timestamp, second)) {
+		stats.stale++;
+		return 0;
+	}
+
+	for (i = 0; i < 3; i++) {
+		mpu = gyro[i];
+		second[i] = second[i] * scale_q8; // Q8
+		diff[i] = ((second[i] - bias_q8[i]) >> 8) - mpu;
+
+		if (mpu > still_raw || mpu < -still_raw)
+			still = 0;
+		limit = disagree_raw + ((mpu < 0 ? -mpu : mpu) >> 3);
+		if (diff[i] > limit || diff[i] < -limit)
+			disagree = 1;
+	}
+	if (!still)
+		still_run = 0;
+	else if (still_run < FUSION_STILL_SAMPLES)
+		still_run++;
+
+	/*
+	 * While turning slowly the difference is bias. Noise is measured on
+	 * the steps between samples, twice its variance, where a slow turn
+	 * cancels out.
+	 */
+	if (still_run == FUSION_STILL_SAMPLES && !(disagree && learned >= FUSION_SETTLE)) {
+		for (i = 0; i < 3; i++) {
+			if (learned == 0)
+				bias_q8[i] = second[i] - (gyro[i] << 8);
+			else
+				bias_q8[i] += (second[i] - (gyro[i] << 8) - bias_q8[i]) >> FUSION_BIAS_SHIFT;
+			value = fusion_clamp(second_step[i], FUSION_NOISE_MAX);
+			var_second += (uint32_t)(value * value);
+			value = fusion_clamp(gyro[i] - mpu_last[i], FUSION_NOISE_MAX);
+			var_mpu += (uint32_t)(value * value);
+		}
+		var_mpu_q4 += (int32_t)((var_mpu << 4) - var_mpu_q4) >> FUSION_BIAS_SHIFT;
+		var_second_q4 += (int32_t)((var_second << 4) - var_second_q4) >> FUSION_BIAS_SHIFT;
+		if (learned < FUSION_SETTLE)
+			learned++;
+
+		var_scaled = ((uint64_t)var_second_q4 * (uint32_t)(scale_q8 * scale_q8)) >> 16;
+		if (var_mpu_q4 + var_scaled != 0)
+			stats.weight = (uint16_t)(((uint64_t)var_mpu_q4 << 15) / (var_mpu_q4 + var_scaled));
+	}
+	for (i = 0; i < 3; i++)
+		mpu_last[i] = gyro[i];
+	if (learned < FUSION_SETTLE)
+		return 0;
+
+	/* One sensor is off, keep the MPU6050 alone */
+	if (disagree) {
+		if (disagree_run < FUSION_DISAGREE_SAMPLES && ++disagree_run == FUSION_DISAGREE_SAMPLES)
+			stats.disagreements++;
+		return 0;
+	}
+	disagree_run = 0;
+
+	/* Inverse variance weighting */
+	for (i = 0; i < 3; i++)
+		gyro[i] = (int16_t)fusion_clamp(gyro[i] + ((diff[i] * stats.weight) >> 15), 32767);
+	stats.fused++;
+	return 1;
+}
+
+void fusion_get_stats(fusion_stats_t *stats_out) {
+	memcpy(stats_out, &stats, sizeof(stats));
+	memcpy(stats_out->bias, bias_q8, sizeof(bias_q8));
+}
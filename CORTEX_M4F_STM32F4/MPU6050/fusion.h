@@ -0,0 +1,52 @@
+#ifndef _MPU6050_FUSION_H
+#define _MPU6050_FUSION_H
+
+/*
+ * Fusion of the MPU6050 gyroscope with a second gyroscope, the L3GD20
+ * on the Discovery board.
+ *
+ * Second gyroscope samples are kept with their timestamps and linearly
+ * interpolated to the time of each MPU6050 sample, so the two sensor
+ * clocks do not need to agree. Its bias is learned from the difference
+ * to the bias corrected MPU6050 while the remote turns slowly, and the
+ * noise of both is measured at the same time to weight them. Integer
+ * only, no hardware or RTOS dependencies.
+ */
+
+#include <stdint.h>
+
+/* Second gyroscope samples kept, enough for a MPU6050 FIFO burst */
+#define FUSION_HISTORY		64 // power of 2
+
+/* Learn bias and noise below this rate, once it stayed there a while */
+#define FUSION_STILL		5.0f // degrees/s
+#define FUSION_STILL_SAMPLES	16
+#define FUSION_BIAS_SHIFT	8 // bias and noise average over 2^shift samples
+#define FUSION_SETTLE		256 // samples learned before fusing
+
+/*
+ * Sensors disagree by more than this plus 1/8 of the rate, the MPU6050
+ * is used alone then. FUSION_DISAGREE_SAMPLES in a row count as one
+ * disagreement in the stats.
+ */
+#define FUSION_DISAGREE		20.0f // degrees/s
+#define FUSION_DISAGREE_SAMPLES	8
+
+/* Samples older than this do not count, the second gyroscope stopped */
+#define FUSION_STALE		20000 // microseconds
+
+typedef struct {
+	uint32_t fused;       // MPU6050 samples combined with the second gyroscope
+	uint32_t stale;       // no second gyroscope sample close enough
+	uint32_t disagreements;
+	uint16_t weight;      // of the second gyroscope, Q15
+	int32_t bias[3];      // of the second gyroscope in MPU6050 units, Q8
+} fusion_stats_t;
+
+void fusion_init(void);
+void fusion_set_scale(float gyro_mult, float second_mult);
+void fusion_push(const int16_t *gyro, uint32_t timestamp);
+uint8_t fusion_apply(int16_t *gyro, uint32_t timestamp);
+void fusion_get_stats(fusion_stats_t *stats);
+
+#endif
@@ -0,0 +1,318 @@
+#include "gesture.h"
+#include "classifier.h"
+#include "mahony.h"
+#include "mahony_q.h"
+#include "shell.h"
+
+#include <string.h>
+
+#define Square(x) ((x)*(x))
+
+/* IMU Data */
+gesture_raw_t accX, accY, accZ;
+gesture_raw_t gyroX, gyroY, gyroZ;
+
+gesture_angle_t angleX, angleY, angleZ;
+
+#ifdef GESTURE_FIXED
+MahonyQ ahrs; // Attitude estimator
+
+uint32_t dt_us;
+
+static uint32_t nominal_dt_us;
+static uint32_t gyro_mult_bits; // gyro_mult the scale was computed for
+static int32_t gyro_scale;      // rad/s per LSB, Q32
+static int32_t gyro_feature;    // classifier steps per LSB, Q16
+#else
+Mahony ahrs; // Attitude estimator
+
+float dt;
+
+static float nominal_dt;
+static float gyro_feature;      // classifier steps per LSB, Q8
+#endif
+static uint32_t last_timestamp;
+
+/* Classifier features summed over the window, in 1/256 steps */
+static int32_t window_sum[CLASSIFIER_FEATURES];
+static uint8_t window_count;
+static uint8_t window_samples;
+static uint32_t window_start; // timestamp of the first sample in the window
+
+/* Confirmation, all times from sample timestamps */
+static gesture_confirm_t confirm[GESTURE_SUSPEND + 1] = {
+	{ 0, 0 },
+	{ GESTURE_DWELL_MS, GESTURE_RELEASE_MS },
+	{ GESTURE_DWELL_MS, GESTURE_RELEASE_MS },
+	{ GESTURE_DWELL_MS, GESTURE_RELEASE_MS },
+	{ GESTURE_DWELL_MS, GESTURE_RELEASE_MS },
+	{ GESTURE_DWELL_MS, GESTURE_RELEASE_MS },
+	{ GESTURE_DWELL_MS, GESTURE_RELEASE_MS }
+};
+static gesture_stats_t stats;
+static uint8_t controller_command; // classified by the latest window
+static uint8_t active_command;     // fired last, not fired again until released
+static uint32_t candidate_since;   // controller_command classified since
+static uint32_t active_lost;       // active_command no longer classified since
+
+static const char * const gesture_names[] = {
+	"",
+	"move right",
+	"move left",
+	"forward",
+	"DOWN",
+	"UP",
+	"suspend"
+};
+
+void gesture_init(uint16_t rate, int16_t ax, int16_t ay, int16_t az, uint32_t timestamp) {
+	accX = ax;
+	accY = ay;
+	accZ = az;
+
+	float roll = atan2f(-(float)ay, -(float)az);
+	float pitch = atan1(-ax / sqrt1(Square((float)ay) + Square((float)az)));
+
+#ifdef GESTURE_FIXED
+	initMahonyQ(&ahrs);
+	setAttitudeQ(&ahrs, roll, pitch, 0); // Set starting angle
+
+	angleX = getRollQ(&ahrs);
+	angleY = getPitchQ(&ahrs);
+	angleZ = 0;
+
+	nominal_dt_us = 1000000 / rate;
+	dt_us = nominal_dt_us;
+	gyro_mult_bits = 0;
+	gyro_scale = 0;
+#else
+	initMahony(&ahrs);
+	setAttitude(&ahrs, roll, pitch, 0); // Set starting angle
+
+	angleX = roll * RAD_TO_DEG;
+	angleY = pitch * RAD_TO_DEG;
+	angleZ = 0;
+
+	nominal_dt = 1.0f / rate;
+	dt = nominal_dt;
+#endif
+	last_timestamp = timestamp;
+
+	controller_command = GESTURE_NONE;
+	active_command = GESTURE_NONE;
+	memset(&stats, 0, sizeof(stats));
+
+	memset(window_sum, 0, sizeof(window_sum));
+	window_count = 0;
+	window_samples = (rate > CLASSIFIER_RATE) ? rate / CLASSIFIER_RATE : 1;
+}
+
+/* Sample rate changed, keeps the attitude */
+void gesture_set_rate(uint16_t rate) {
+#ifdef GESTURE_FIXED
+	nominal_dt_us = 1000000 / rate;
+#else
+	nominal_dt = 1.0f / rate;
+#endif
+
+	memset(window_sum, 0, sizeof(window_sum));
+	window_count = 0;
+	window_samples = (rate > CLASSIFIER_RATE) ? rate / CLASSIFIER_RATE : 1;
+}
+
+#ifdef GESTURE_FIXED
+void gesture_fuse(int16_t ax, int16_t ay, int16_t az, int16_t gx, int16_t gy, int16_t gz,
+		float gyro_mult, uint32_t timestamp) {
+	union {
+		float f;
+		uint32_t u;
+	} mult = { gyro_mult };
+
+	accX = ax;
+	accY = ay;
+	accZ = az;
+	gyroX = gx;
+	gyroY = gy;
+	gyroZ = gz;
+
+	/* Time step measured from sample timestamps */
+	dt_us = timestamp - last_timestamp;
+	if (dt_us == 0 || dt_us > (uint32_t)(GESTURE_MAX_DT * 1000000))
+		dt_us = nominal_dt_us;
+	last_timestamp = timestamp;
+
+	/* Only touch the FPU when the gyro range changes */
+	if (mult.u != gyro_mult_bits) {
+		gyro_mult_bits = mult.u;
+		gyro_scale = (int32_t)(gyro_mult * DEG_TO_RAD * 4294967296.0f);
+		gyro_feature = (int32_t)(gyro_mult / CLASSIFIER_GYRO_STEP * 65536);
+	}
+
+	/* rad/s in Q16, body frame turned 180 degrees about X as below */
+	updateMahonyQ(&ahrs, (int32_t)(((int64_t)gx * gyro_scale) >> 16),
+			-(int32_t)(((int64_t)gy * gyro_scale) >> 16),
+			-(int32_t)(((int64_t)gz * gyro_scale) >> 16),
+			ax, -(int32_t)ay, -(int32_t)az, dt_us);
+
+	angleX = getRollQ(&ahrs);
+	angleY = getPitchQ(&ahrs);
+	angleZ = getYawQ(&ahrs);
+}
+#else
+void gesture_fuse(int16_t ax, int16_t ay, int16_t az, int16_t gx, int16_t gy, int16_t gz,
+		float gyro_mult, uint32_t timestamp) {
+	accX = ax;
+	accY = ay;
+	accZ = az;
+	gyroX = gx;
+	gyroY = gy;
+	gyroZ = gz;
+	gyro_feature = gyro_mult / CLASSIFIER_GYRO_STEP * 256;
+
+	/* Time step measured from sample timestamps */
+	dt = (timestamp - last_timestamp) * 1e-6f;
+	if (dt <= 0 || dt > GESTURE_MAX_DT)
+		dt = nominal_dt;
+	last_timestamp = timestamp;
+
+	float gyroRate = gyro_mult * DEG_TO_RAD; // Convert to rad/s
+
+	/*
+	 * The remote is level with the sensor Z axis pointing down,
+	 * turn the body frame 180 degrees about X to match
+	 */
+	updateMahony(&ahrs, gyroX * gyroRate, -gyroY * gyroRate, -gyroZ * gyroRate,
+			accX, -accY, -accZ, dt);
+
+	angleX = getRoll(&ahrs) * RAD_TO_DEG;
+	angleY = getPitch(&ahrs) * RAD_TO_DEG;
+	angleZ = getYaw(&ahrs) * RAD_TO_DEG;
+}
+#endif
+
+/*
+ * Hand-tuned thresholds on the current sample the classifier replaced,
+ * remote_train can label traces with them
+ */
+uint8_t gesture_rules(void) {
+	if (accY < -6300)
+		return GESTURE_RIGHT;
+	if (accY > 6300)
+		return GESTURE_LEFT;
+	if (accZ < 0 && angleY > GESTURE_ANGLE(47))
+		return GESTURE_FORWARD;
+	if (accZ < 0 && angleY < GESTURE_ANGLE(-30))
+		return GESTURE_DOWN;
+	if (accZ < 0 && angleY > GESTURE_ANGLE(25) && angleY < GESTURE_ANGLE(47))
+		return GESTURE_UP;
+	return GESTURE_SUSPEND;
+}
+
+/*
+ * Add the current sample to the window, returns 1 and the averaged
+ * features (classifier.h) once the window is complete
+ */
+uint8_t gesture_window(int8_t *features) {
+	int32_t value;
+	uint8_t i;
+
+#ifdef GESTURE_FIXED
+	window_sum[CLASSIFIER_ACC_X] += accX;
+	window_sum[CLASSIFIER_ACC_Y] += accY;
+	window_sum[CLASSIFIER_ACC_Z] += accZ;
+	window_sum[CLASSIFIER_ROLL] += angleX >> 8;
+	window_sum[CLASSIFIER_PITCH] += angleY >> 8;
+	window_sum[CLASSIFIER_GYRO_X] += (gyroX * gyro_feature) >> 8;
+	window_sum[CLASSIFIER_GYRO_Y] += (gyroY * gyro_feature) >> 8;
+	window_sum[CLASSIFIER_GYRO_Z] += (gyroZ * gyro_feature) >> 8;
+#else
+	window_sum[CLASSIFIER_ACC_X] += (int32_t)accX;
+	window_sum[CLASSIFIER_ACC_Y] += (int32_t)accY;
+	window_sum[CLASSIFIER_ACC_Z] += (int32_t)accZ;
+	window_sum[CLASSIFIER_ROLL] += (int32_t)(angleX * 256);
+	window_sum[CLASSIFIER_PITCH] += (int32_t)(angleY * 256);
+	window_sum[CLASSIFIER_GYRO_X] += (int32_t)(gyroX * gyro_feature);
+	window_sum[CLASSIFIER_GYRO_Y] += (int32_t)(gyroY * gyro_feature);
+	window_sum[CLASSIFIER_GYRO_Z] += (int32_t)(gyroZ * gyro_feature);
+#endif
+	if (window_count == 0)
+		window_start = last_timestamp;
+	if (++window_count < window_samples)
+		return 0;
+
+	for (i = 0; i < CLASSIFIER_FEATURES; i++) {
+		value = window_sum[i] / ((int32_t)window_samples << 8);
+		features[i] = (int8_t)((value > 127) ? 127 : (value < -128) ? -128 : value);
+		window_sum[i] = 0;
+	}
+	window_count = 0;
+	return 1;
+}
+
+/*
+ * A command fires once it was classified for its dwell time and the
+ * previous one was gone for its release time. It fires once, until
+ * another command fired or it was released and classified again.
+ */
+uint8_t gesture_classify(void) {
+	int8_t features[CLASSIFIER_FEATURES];
+	uint8_t command;
+
+	if (gesture_window(features)) {
+		command = classifier_predict(features);
+		if (command != controller_command) {
+			if (controller_command == active_command)
+				active_lost = window_start;
+			else if (controller_command != GESTURE_NONE)
+				stats.rejected++;
+			controller_command = command;
+			candidate_since = window_start;
+		}
+	}
+
+	if (controller_command == active_command || controller_command == GESTURE_NONE)
+		return GESTURE_NONE;
+	if (active_command != GESTURE_NONE
+			&& last_timestamp - active_lost < (uint32_t)confirm[active_command].release_ms * 1000)
+		return GESTURE_NONE;
+	if (last_timestamp - candidate_since < (uint32_t)confirm[controller_command].dwell_ms * 1000)
+		return GESTURE_NONE;
+
+	active_command = controller_command;
+	stats.fired++;
+	stats.latency_us = last_timestamp - candidate_since;
+	if (stats.latency_us > stats.latency_max_us)
+		stats.latency_max_us = stats.latency_us;
+	return active_command;
+}
+
+/*
+ * Fire a detection that needs no confirmation, e.g. a motion gesture.
+ * The classified command has to dwell again before it fires after it.
+ */
+uint8_t gesture_fire(uint8_t command) {
+	active_command = command;
+	active_lost = last_timestamp;
+	candidate_since = last_timestamp;
+	stats.immediate++;
+	return command;
+}
+
+void gesture_set_confirm(uint8_t command, uint16_t dwell_ms, uint16_t release_ms) {
+	confirm[command].dwell_ms = dwell_ms;
+	confirm[command].release_ms = release_ms;
+}
+
+const gesture_confirm_t *gesture_get_confirm(void) {
+	return confirm;
+}
+
+void gesture_get_stats(gesture_stats_t *out) {
+	*out = stats;
+}
+
+const char *gesture_name(uint8_t command) {
+	if (command > GESTURE_SUSPEND)
+		return "";
+	return gesture_names[command];
+}
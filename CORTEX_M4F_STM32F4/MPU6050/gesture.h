@@ -0,0 +1,88 @@
+#ifndef _MPU6050_GESTURE_H
+#define _MPU6050_GESTURE_H
+
+/*
+ * Attitude estimation and gesture classification of raw MPU6050 samples.
+ * No hardware or RTOS dependencies, so the same code runs in the sensor
+ * task and in the host simulation (sim/).
+ *
+ * Building with GESTURE_FIXED runs scaling and attitude estimation in
+ * fixed point (mahony_q.h), only gesture_init uses floats. Commands come
+ * from the decision tree in classifier.h, run once per window.
+ */
+
+#include <stdint.h>
+
+#ifdef GESTURE_FIXED
+typedef int16_t gesture_raw_t;
+typedef int32_t gesture_angle_t; // degrees in Q16
+#define GESTURE_ANGLE(deg)	((gesture_angle_t)((deg) * 65536))
+#define GESTURE_DEG(angle)	((angle) * (1.0f / 65536)) // to float, for debug output
+#define GESTURE_DT			(dt_us * 1e-6f)
+#else
+typedef float gesture_raw_t;
+typedef float gesture_angle_t; // degrees
+#define GESTURE_ANGLE(deg)	((gesture_angle_t)(deg))
+#define GESTURE_DEG(angle)	(angle)
+#define GESTURE_DT			dt
+#endif
+
+/* Gaps between samples longer than this fall back to the nominal period */
+#define GESTURE_MAX_DT		0.1f
+
+/* Default confirmation times, see @ref gesture_confirm_t */
+#define GESTURE_DWELL_MS	250
+#define GESTURE_RELEASE_MS	150
+
+/* Commands, @ref gesture_classify returns one of these once confirmed */
+#define GESTURE_NONE		0
+#define GESTURE_RIGHT		1
+#define GESTURE_LEFT		2
+#define GESTURE_FORWARD		3
+#define GESTURE_DOWN		4
+#define GESTURE_UP			5
+#define GESTURE_SUSPEND		6
+
+/*
+ * Hysteresis per command: it has to be classified for dwell_ms before it
+ * fires, and once fired it is held until something else was classified
+ * for release_ms
+ */
+typedef struct {
+	uint16_t dwell_ms;
+	uint16_t release_ms;
+} gesture_confirm_t;
+
+typedef struct {
+	uint32_t fired;          // commands confirmed by dwell time
+	uint32_t immediate;      // commands fired by @ref gesture_fire
+	uint32_t rejected;       // commands classified shorter than their dwell time
+	uint32_t latency_us;     // first classified to fired, last command
+	uint32_t latency_max_us; // and the longest
+} gesture_stats_t;
+
+/* IMU Data */
+extern gesture_raw_t accX, accY, accZ;
+extern gesture_raw_t gyroX, gyroY, gyroZ;
+
+extern gesture_angle_t angleX, angleY, angleZ; // Roll, pitch and yaw
+#ifdef GESTURE_FIXED
+extern uint32_t dt_us; // Time step of the last sample in microseconds
+#else
+extern float dt; // Time step of the last sample in seconds
+#endif
+
+void gesture_init(uint16_t rate, int16_t ax, int16_t ay, int16_t az, uint32_t timestamp);
+void gesture_set_rate(uint16_t rate);
+void gesture_fuse(int16_t ax, int16_t ay, int16_t az, int16_t gx, int16_t gy, int16_t gz,
+		float gyro_mult, uint32_t timestamp);
+uint8_t gesture_classify(void);
+uint8_t gesture_fire(uint8_t command);
+void gesture_set_confirm(uint8_t command, uint16_t dwell_ms, uint16_t release_ms);
+const gesture_confirm_t *gesture_get_confirm(void);
+void gesture_get_stats(gesture_stats_t *stats);
+uint8_t gesture_window(int8_t *features);
+uint8_t gesture_rules(void);
+const char *gesture_name(uint8_t command);
+
+#endif
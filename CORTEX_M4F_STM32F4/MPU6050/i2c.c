@@ -1,44 +1,123 @@
 #include "i2c.h"
+
+#include "mpu6050.h"
 
 /*
- * FIXME
- * Time out
+ * State of the interrupt driven transaction:
+ * START, address(W), register, then either the data bytes and STOP,
+ * or repeated START, address(R) and DMA moves the data bytes while
+ * the transfer-complete interrupt sends STOP. BTF after the register
+ * stays set until the repeated START is on the bus, the event handler
+ * waits for SB there instead of being entered again and again.
  */
+#define I2C_PHASE_IDLE	0
+#define I2C_PHASE_WRITE	1
+#define I2C_PHASE_READ	2
+#define I2C_PHASE_DATA	3
+
+typedef struct {
+	I2C_TypeDef* I2Cx;
+	DMA_Stream_TypeDef* DMA_Stream;
+	uint32_t DMA_Channel;
+	uint32_t DMA_TC_IT;
+	uint32_t DMA_Flags;
+	IRQn_Type DMA_IRQn;
+	IRQn_Type EV_IRQn;
+	IRQn_Type ER_IRQn;
+	/* Pins, driven as GPIO during bus recovery */
+	uint32_t I2C_Clock;
+	uint32_t GPIO_Clock;
+	uint8_t AF;
+	GPIO_TypeDef* SCL_GPIO;
+	uint16_t SCL_Pin;
+	uint8_t SCL_Source;
+	GPIO_TypeDef* SDA_GPIO;
+	uint16_t SDA_Pin;
+	uint8_t SDA_Source;
+	/* Deadline of interrupt driven transactions */
+	uint16_t TIM_IT;
+	volatile uint32_t* TIM_CCR;
+	int clock_speed;
+	/* Running transaction */
+	I2C_Transaction_t* current;
+	uint16_t tx_index;
+	volatile uint8_t phase;
+	volatile uint8_t error;
+	SemaphoreHandle_t done;
+	/* Bus manager */
+	QueueHandle_t queue;
+	SemaphoreHandle_t lock;  // serializes clients of I2C_Transfer
+	SemaphoreHandle_t sync;  // completion of I2C_Transfer
+	xTaskHandle task;
+	I2C_Stats_t stats;
+} I2C_Bus_t;
+
+static I2C_Bus_t I2C_Buses[] = {
+	{ I2C1, DMA1_Stream0, DMA_Channel_1, DMA_IT_TCIF0,
+		DMA_FLAG_TCIF0 | DMA_FLAG_HTIF0 | DMA_FLAG_TEIF0 | DMA_FLAG_DMEIF0 | DMA_FLAG_FEIF0,
+		DMA1_Stream0_IRQn, I2C1_EV_IRQn, I2C1_ER_IRQn,
+		RCC_APB1Periph_I2C1, RCC_AHB1Periph_GPIOB, GPIO_AF_I2C1,
+		GPIOB, GPIO_Pin_6, GPIO_PinSource6,   // SCL = PB6
+		GPIOB, GPIO_Pin_7, GPIO_PinSource7,   // SDA = PB7
+		TIM_IT_CC1, &TIM5->CCR1 },
+	{ I2C3, DMA1_Stream2, DMA_Channel_3, DMA_IT_TCIF2,
+		DMA_FLAG_TCIF2 | DMA_FLAG_HTIF2 | DMA_FLAG_TEIF2 | DMA_FLAG_DMEIF2 | DMA_FLAG_FEIF2,
+		DMA1_Stream2_IRQn, I2C3_EV_IRQn, I2C3_ER_IRQn,
+		RCC_APB1Periph_I2C3, RCC_AHB1Periph_GPIOA | RCC_AHB1Periph_GPIOC, GPIO_AF_I2C3,
+		GPIOA, GPIO_Pin_8, GPIO_PinSource8,   // SCL = PA8
+		GPIOC, GPIO_Pin_9, GPIO_PinSource9,   // SDA = PC9
+		TIM_IT_CC2, &TIM5->CCR2 },
+};
+
+#define I2C_BUS_COUNT	(sizeof(I2C_Buses) / sizeof(I2C_Buses[0]))
+
+static void I2C_ManagerTask(void *pvParameters);
+
+static I2C_Bus_t* I2C_GetBus(I2C_TypeDef* I2Cx) {
+	uint8_t i;
 
-static uint32_t MPU6050_I2C_Timeout;
+	for (i = 0; i < I2C_BUS_COUNT; i++)
+		if (I2C_Buses[i].I2Cx == I2Cx)
+			return &I2C_Buses[i];
+	return NULL;
+}
 
 void I2C_MPU6050_Init(I2C_TypeDef* I2Cx, int clock_speed) {
-	/*
-	 *         SCL = PB6
-	 *         SDA = PB7
-	 */
 	GPIO_InitTypeDef GPIO_InitStructure;
+	I2C_Bus_t* bus = I2C_GetBus(I2Cx);
+
+	if (bus == NULL)
+		return;
+	bus->clock_speed = clock_speed;
 
-	/* Enable IOE_I2C and IOE_I2C_GPIO_PORT & Alternate Function clocks */
-	RCC_APB1PeriphClockCmd(RCC_APB1Periph_I2C1, ENABLE);
-	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOB | RCC_AHB1Periph_GPIOB, ENABLE);
+	/* Deadlines are measured with the microsecond timer */
+	if (!(TIM5->CR1 & TIM_CR1_CEN))
+		MPU6050_TIM5_Init();
 
-	/* Connect PXx to I2C_SCL*/
-	GPIO_PinAFConfig(GPIOB, GPIO_PinSource6, GPIO_AF_I2C1);
-	/* Connect PXx to I2C_SDA*/
-	GPIO_PinAFConfig(GPIOB, GPIO_PinSource7, GPIO_AF_I2C1);
+	/* Enable I2C and GPIO clocks */
+	RCC_APB1PeriphClockCmd(bus->I2C_Clock, ENABLE);
+	RCC_AHB1PeriphClockCmd(bus->GPIO_Clock, ENABLE);
+
+	/* Connect pins to I2C_SCL and I2C_SDA */
+	GPIO_PinAFConfig(bus->SCL_GPIO, bus->SCL_Source, bus->AF);
+	GPIO_PinAFConfig(bus->SDA_GPIO, bus->SDA_Source, bus->AF);
 
 	/* SCL and SDA pins configuration */
-	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_6;
 	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
 	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_25MHz;
 	GPIO_InitStructure.GPIO_OType = GPIO_OType_OD;
 	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
-	GPIO_Init(GPIOB, &GPIO_InitStructure);
+	GPIO_InitStructure.GPIO_Pin = bus->SCL_Pin;
+	GPIO_Init(bus->SCL_GPIO, &GPIO_InitStructure);
 
-	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_7;
-	GPIO_Init(GPIOB, &GPIO_InitStructure);
+	GPIO_InitStructure.GPIO_Pin = bus->SDA_Pin;
+	GPIO_Init(bus->SDA_GPIO, &GPIO_InitStructure);
 
 	NVIC_InitTypeDef NVIC_InitStructure;
 
-	/* Configure the I2C event priority */
-	NVIC_InitStructure.NVIC_IRQChannel = I2C1_ER_IRQn;
-	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+	/* Configure the I2C error priority */
+	NVIC_InitStructure.NVIC_IRQChannel = bus->ER_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = MPU6050_I2C_IRQ_PRIORITY;
 	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
 	NVIC_Init(&NVIC_InitStructure);
@@ -62,54 +141,536 @@ void I2C_MPU6050_Init(I2C_TypeDef* I2Cx, int clock_speed) {
 	I2C_Cmd(I2Cx, ENABLE);
 }
 
-void I2C1_ER_IRQHandler(void)
-{
-  /* ACK failure */
-
-  if (I2C_GetITStatus(I2C1, I2C_IT_AF))
-  {
-    USART1_puts("I2C_IT_AF");
-    I2C_ClearITPendingBit(I2C1, I2C_IT_AF);
-  }
-  else if(I2C_GetITStatus(I2C1, I2C_IT_BERR))
-  {
-    USART1_puts("I2C_IT_BERR");
-  }
-  else if(I2C_GetITStatus(I2C1, I2C_IT_ARLO))
-  {
-    USART1_puts("I2C_IT_ARLO");
-  }
-    else if(I2C_GetITStatus(I2C1, I2C_IT_OVR))
-  {
-    USART1_puts("I2C_IT_OVR");
-  }
-    else if(I2C_GetITStatus(I2C1, I2C_IT_PECERR))
-  {
-    USART1_puts("I2C_IT_PECERR");
-  }
-    else if(I2C_GetITStatus(I2C1, I2C_IT_TIMEOUT))
-  {
-    USART1_puts("I2C_IT_TIMEOUT");
-  }
-  else if(I2C_GetITStatus(I2C1, I2C_IT_SMBALERT))
-  {
-    USART1_puts("I2C_IT_SMBALERT");
-  }
-
-}
-
-int16_t I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint16_t ack) {
+void I2C_MPU6050_DMA_Init(I2C_TypeDef* I2Cx) {
+	DMA_InitTypeDef DMA_InitStructure;
+	NVIC_InitTypeDef NVIC_InitStructure;
+	I2C_Bus_t* bus = I2C_GetBus(I2Cx);
+
+	if (bus == NULL)
+		return;
+
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
+
+	DMA_Cmd(bus->DMA_Stream, DISABLE);
+	DMA_DeInit(bus->DMA_Stream);
+
+	/* Memory address and length are set for every transfer */
+	DMA_InitStructure.DMA_Channel = bus->DMA_Channel;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&I2Cx->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = 0;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = 1;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(bus->DMA_Stream, &DMA_InitStructure);
+	DMA_ITConfig(bus->DMA_Stream, DMA_IT_TC, ENABLE);
+
+	/* DMA transfer complete wakes up the waiting task */
+	NVIC_InitStructure.NVIC_IRQChannel = bus->DMA_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = MPU6050_I2C_IRQ_PRIORITY;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	/* Address and register phases are driven by the event interrupt */
+	NVIC_InitStructure.NVIC_IRQChannel = bus->EV_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+
+	/* Deadlines, the same priority keeps them from preempting a transfer */
+	NVIC_InitStructure.NVIC_IRQChannel = TIM5_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+
+	if (bus->done == NULL)
+		bus->done = xSemaphoreCreateBinary();
+
+	bus->phase = I2C_PHASE_IDLE;
+
+	/* Start the bus manager once, transactions are polled until the scheduler runs */
+	if (bus->queue == NULL) {
+		bus->queue = xQueueCreate(I2C_QUEUE_LENGTH, sizeof(I2C_Transaction_t*));
+		bus->lock = xSemaphoreCreateMutex();
+		bus->sync = xSemaphoreCreateBinary();
+		xTaskCreate(I2C_ManagerTask, I2Cx == I2C1 ? "I2C1" : "I2C3", I2C_TASK_STACK,
+				bus, I2C_TASK_PRIORITY, &bus->task);
+	}
+}
+
+/*
+ * Stop the running transfer, must be called with the I2C
+ * and DMA interrupts masked.
+ */
+static void I2C_AbortTransfer(I2C_Bus_t* bus) {
+	I2C_ITConfig(bus->I2Cx, I2C_IT_EVT | I2C_IT_BUF, DISABLE);
+	DMA_Cmd(bus->DMA_Stream, DISABLE);
+	bus->I2Cx->CR2 &= ~(I2C_CR2_DMAEN | I2C_CR2_LAST);
+	bus->I2Cx->CR1 |= I2C_CR1_STOP;
+	bus->phase = I2C_PHASE_IDLE;
+}
+
+static void I2C_EV_Handler(I2C_Bus_t* bus) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	I2C_TypeDef* I2Cx = bus->I2Cx;
+	I2C_Transaction_t* t = bus->current;
+	uint16_t sr1 = I2Cx->SR1;
+	uint32_t start;
+
+	if (sr1 & I2C_SR1_SB) {
+		if (bus->phase == I2C_PHASE_WRITE) {
+			I2Cx->DR = t->address & ~I2C_OAR1_ADD0;
+		} else if (t->count >= 2) {
+			/* Let DMA read the bytes and NACK the last one */
+			I2Cx->CR2 |= I2C_CR2_DMAEN | I2C_CR2_LAST;
+			I2Cx->CR1 |= I2C_CR1_ACK;
+			I2Cx->DR = t->address | I2C_OAR1_ADD0;
+		} else {
+			/* Single byte is NACKed */
+			I2Cx->CR1 &= ~I2C_CR1_ACK;
+			I2Cx->DR = t->address | I2C_OAR1_ADD0;
+		}
+	} else if (sr1 & I2C_SR1_ADDR) {
+		/* Read status register to clear ADDR flag */
+		I2Cx->SR2;
+		if (bus->phase == I2C_PHASE_WRITE) {
+			I2Cx->DR = t->reg;
+		} else if (t->count >= 2) {
+			bus->phase = I2C_PHASE_DATA;
+			I2C_ITConfig(I2Cx, I2C_IT_EVT, DISABLE);
+		} else {
+			/* STOP right after ADDR, the byte arrives with RXNE */
+			bus->phase = I2C_PHASE_DATA;
+			I2Cx->CR1 |= I2C_CR1_STOP;
+			I2C_ITConfig(I2Cx, I2C_IT_BUF, ENABLE);
+		}
+	} else if (sr1 & I2C_SR1_RXNE) {
+		if (bus->phase == I2C_PHASE_DATA) {
+			t->data[0] = I2Cx->DR;
+			I2C_ITConfig(I2Cx, I2C_IT_EVT | I2C_IT_BUF, DISABLE);
+			bus->phase = I2C_PHASE_IDLE;
+			xSemaphoreGiveFromISR(bus->done, &xHigherPriorityTaskWoken);
+		}
+	} else if ((sr1 & I2C_SR1_BTF) && bus->phase == I2C_PHASE_WRITE) {
+		if (t->type == I2C_TRANSACTION_WRITE && bus->tx_index < t->count) {
+			I2Cx->DR = t->data[bus->tx_index++];
+		} else if (t->type == I2C_TRANSACTION_READ) {
+			/*
+			 * Register pointer is sent, switch to receiver. Nothing but
+			 * the START clears BTF, so wait for SB, which enters the
+			 * handler again. Without it the event interrupt stays off
+			 * and the deadline aborts the transfer.
+			 */
+			bus->phase = I2C_PHASE_READ;
+			I2Cx->CR1 |= I2C_CR1_START;
+			start = MPU6050_Micros();
+			while (!(I2Cx->SR1 & I2C_SR1_SB)) {
+				if (MPU6050_Micros() - start > I2C_RESTART_TIME) {
+					I2C_ITConfig(I2Cx, I2C_IT_EVT, DISABLE);
+					break;
+				}
+			}
+		} else {
+			/* Burst write is done */
+			I2C_ITConfig(I2Cx, I2C_IT_EVT, DISABLE);
+			I2Cx->CR1 |= I2C_CR1_STOP;
+			bus->phase = I2C_PHASE_IDLE;
+			xSemaphoreGiveFromISR(bus->done, &xHigherPriorityTaskWoken);
+		}
+	}
+
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+static void I2C_DMA_Handler(I2C_Bus_t* bus) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	if (DMA_GetITStatus(bus->DMA_Stream, bus->DMA_TC_IT)) {
+		DMA_ClearITPendingBit(bus->DMA_Stream, bus->DMA_TC_IT);
+
+		bus->I2Cx->CR1 |= I2C_CR1_STOP;
+		bus->I2Cx->CR2 &= ~(I2C_CR2_DMAEN | I2C_CR2_LAST);
+		bus->phase = I2C_PHASE_IDLE;
+
+		xSemaphoreGiveFromISR(bus->done, &xHigherPriorityTaskWoken);
+	}
+
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+
+static void I2C_ER_Handler(I2C_Bus_t* bus) {
+	I2C_TypeDef* I2Cx = bus->I2Cx;
+	uint16_t sr1 = I2Cx->SR1;
+	uint8_t error;
+
+	if (sr1 & I2C_SR1_AF)
+		error = I2C_Result_Nack;
+	else if (sr1 & I2C_SR1_ARLO)
+		error = I2C_Result_ArbitrationLost;
+	else if (sr1 & I2C_SR1_OVR)
+		error = I2C_Result_Overrun;
+	else
+		error = I2C_Result_BusError;
+
+	/* Error flags have to be cleared by software */
+	I2Cx->SR1 &= ~(I2C_SR1_AF | I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_OVR | I2C_SR1_PECERR | I2C_SR1_TIMEOUT | I2C_SR1_SMBALERT);
+
+	/* Wake up the bus manager waiting for the transaction */
+	if (bus->phase != I2C_PHASE_IDLE) {
+		BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+		I2C_AbortTransfer(bus);
+		bus->error = error;
+		xSemaphoreGiveFromISR(bus->done, &xHigherPriorityTaskWoken);
+		portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+	}
+}
+
+/* A transaction missed its deadline */
+static void I2C_TIM_Handler(I2C_Bus_t* bus) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	if (TIM_GetITStatus(TIM5, bus->TIM_IT) == RESET)
+		return;
+	TIM_ClearITPendingBit(TIM5, bus->TIM_IT);
+	TIM_ITConfig(TIM5, bus->TIM_IT, DISABLE);
+
+	if (bus->phase != I2C_PHASE_IDLE) {
+		I2C_AbortTransfer(bus);
+		bus->error = I2C_Result_Timeout;
+		xSemaphoreGiveFromISR(bus->done, &xHigherPriorityTaskWoken);
+	}
+
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+void I2C1_EV_IRQHandler(void) {
+	I2C_EV_Handler(&I2C_Buses[0]);
+}
+
+void I2C1_ER_IRQHandler(void) {
+	I2C_ER_Handler(&I2C_Buses[0]);
+}
+
+void DMA1_Stream0_IRQHandler(void) {
+	I2C_DMA_Handler(&I2C_Buses[0]);
+}
+
+void I2C3_EV_IRQHandler(void) {
+	I2C_EV_Handler(&I2C_Buses[1]);
+}
+
+void I2C3_ER_IRQHandler(void) {
+	I2C_ER_Handler(&I2C_Buses[1]);
+}
+
+void DMA1_Stream2_IRQHandler(void) {
+	I2C_DMA_Handler(&I2C_Buses[1]);
+}
+
+void TIM5_IRQHandler(void) {
+	I2C_TIM_Handler(&I2C_Buses[0]);
+	I2C_TIM_Handler(&I2C_Buses[1]);
+}
+
+/* Polling transfers, used until the scheduler starts */
+/* Wait until all flags are set in SR1 */
+static I2C_Result_t I2C_WaitFlags(I2C_TypeDef* I2Cx, uint16_t flags) {
+	uint32_t start = MPU6050_Micros();
+
+	while ((I2Cx->SR1 & flags) != flags) {
+		if (I2Cx->SR1 & I2C_SR1_AF) {
+			I2Cx->SR1 &= ~I2C_SR1_AF;
+			return I2C_Result_Nack;
+		}
+		if (MPU6050_Micros() - start > MPU6050_I2C_TIMEOUT)
+			return I2C_Result_Timeout;
+	}
+	return I2C_Result_Ok;
+}
+
+/* Wait for an event, reads SR1 and SR2 like I2C_CheckEvent */
+static I2C_Result_t I2C_WaitEvent(I2C_TypeDef* I2Cx, uint32_t event) {
+	uint32_t start = MPU6050_Micros();
+
+	while (!I2C_CheckEvent(I2Cx, event)) {
+		if (I2Cx->SR1 & I2C_SR1_AF) {
+			I2Cx->SR1 &= ~I2C_SR1_AF;
+			return I2C_Result_Nack;
+		}
+		if (MPU6050_Micros() - start > MPU6050_I2C_TIMEOUT)
+			return I2C_Result_Timeout;
+	}
+	return I2C_Result_Ok;
+}
+
+/* Polling transfers, used until the scheduler starts */
+static I2C_Result_t I2C_PollTransaction(I2C_TypeDef* I2Cx, I2C_Transaction_t* t) {
+	I2C_Result_t result;
+	uint16_t i;
+
+	if (t->type == I2C_TRANSACTION_READ) {
+		result = I2C_Start(I2Cx, t->address, I2C_Direction_Transmitter, I2C_Ack_Enable);
+		if (result == I2C_Result_Ok)
+			result = I2C_WriteData(I2Cx, t->reg);
+		if (result == I2C_Result_Ok)
+			result = I2C_Stop(I2Cx);
+		if (result == I2C_Result_Ok)
+			result = I2C_Start(I2Cx, t->address, I2C_Direction_Receiver, I2C_Ack_Enable);
+		for (i = 0; i < t->count && result == I2C_Result_Ok; i++) {
+			if (i == (t->count - 1)) {
+				/* Last byte */
+				result = I2C_ReadNack(I2Cx, &t->data[i]);
+			} else {
+				result = I2C_ReadAck(I2Cx, &t->data[i]);
+			}
+		}
+	} else {
+		result = I2C_Start(I2Cx, t->address, I2C_Direction_Transmitter, I2C_Ack_Disable);
+		if (result == I2C_Result_Ok)
+			result = I2C_WriteData(I2Cx, t->reg);
+		for (i = 0; i < t->count && result == I2C_Result_Ok; i++)
+			result = I2C_WriteData(I2Cx, t->data[i]);
+		if (result == I2C_Result_Ok)
+			result = I2C_Stop(I2Cx);
+	}
+
+	/* Release the bus on failure */
+	if (result != I2C_Result_Ok)
+		I2Cx->CR1 |= I2C_CR1_STOP;
+	return result;
+}
+
+/*
+ * Run one transaction on the bus, the manager task sleeps until the
+ * interrupts are done or the deadline interrupt aborts the transfer
+ */
+static I2C_Result_t I2C_RunTransaction(I2C_Bus_t* bus, I2C_Transaction_t* t) {
+	I2C_TypeDef* I2Cx = bus->I2Cx;
+	uint32_t deadline = MPU6050_I2C_TIMEOUT + (t->count + 3) * I2C_BYTE_TIME;
+
+	/* Drop a completion left over from an aborted transfer */
+	xSemaphoreTake(bus->done, 0);
+
+	bus->current = t;
+	bus->tx_index = 0;
+	bus->error = I2C_Result_Ok;
+	bus->phase = I2C_PHASE_WRITE;
+
+	/* Reads of 2 bytes and more go through DMA, a single byte through RXNE */
+	if (t->type == I2C_TRANSACTION_READ && t->count >= 2) {
+		DMA_Cmd(bus->DMA_Stream, DISABLE);
+		DMA_ClearFlag(bus->DMA_Stream, bus->DMA_Flags);
+		DMA_MemoryTargetConfig(bus->DMA_Stream, (uint32_t)t->data, DMA_Memory_0);
+		DMA_SetCurrDataCounter(bus->DMA_Stream, t->count);
+		DMA_Cmd(bus->DMA_Stream, ENABLE);
+	}
+
+	/* Both bus managers share the enable register of TIM5 */
+	taskENTER_CRITICAL();
+	*bus->TIM_CCR = MPU6050_Micros() + deadline;
+	TIM_ClearITPendingBit(TIM5, bus->TIM_IT);
+	TIM_ITConfig(TIM5, bus->TIM_IT, ENABLE);
+	taskEXIT_CRITICAL();
+
+	/* Generate start, the rest is done by interrupts */
+	I2C_ITConfig(I2Cx, I2C_IT_EVT, ENABLE);
+	I2Cx->CR1 |= I2C_CR1_START;
+
+	xSemaphoreTake(bus->done, portMAX_DELAY);
+
+	taskENTER_CRITICAL();
+	TIM_ITConfig(TIM5, bus->TIM_IT, DISABLE);
+	taskEXIT_CRITICAL();
+
+	return (I2C_Result_t)bus->error;
+}
+
+static void I2C_Delay(uint32_t us) {
+	uint32_t start = MPU6050_Micros();
+
+	while (MPU6050_Micros() - start < us)
+		;
+}
+
+/*
+ * Free a bus held by a slave that lost track of the transfer: clock SCL
+ * until the slave releases SDA, at most 9 clocks finish any byte, then
+ * send STOP. The peripheral is reset and configured again afterwards.
+ */
+static void I2C_RecoverBus(I2C_Bus_t* bus) {
+	GPIO_InitTypeDef GPIO_InitStructure;
+	uint8_t i;
+
+	I2C_Cmd(bus->I2Cx, DISABLE);
+
+	GPIO_SetBits(bus->SCL_GPIO, bus->SCL_Pin);
+	GPIO_SetBits(bus->SDA_GPIO, bus->SDA_Pin);
+	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_25MHz;
+	GPIO_InitStructure.GPIO_OType = GPIO_OType_OD;
+	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+	GPIO_InitStructure.GPIO_Pin = bus->SCL_Pin;
+	GPIO_Init(bus->SCL_GPIO, &GPIO_InitStructure);
+	GPIO_InitStructure.GPIO_Pin = bus->SDA_Pin;
+	GPIO_Init(bus->SDA_GPIO, &GPIO_InitStructure);
+	I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+
+	for (i = 0; i < 9 && !GPIO_ReadInputDataBit(bus->SDA_GPIO, bus->SDA_Pin); i++) {
+		GPIO_ResetBits(bus->SCL_GPIO, bus->SCL_Pin);
+		I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+		GPIO_SetBits(bus->SCL_GPIO, bus->SCL_Pin);
+		I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+	}
+
+	/* STOP, SDA rises while SCL is high */
+	GPIO_ResetBits(bus->SCL_GPIO, bus->SCL_Pin);
+	I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+	GPIO_ResetBits(bus->SDA_GPIO, bus->SDA_Pin);
+	I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+	GPIO_SetBits(bus->SCL_GPIO, bus->SCL_Pin);
+	I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+	GPIO_SetBits(bus->SDA_GPIO, bus->SDA_Pin);
+	I2C_Delay(I2C_RECOVERY_HALF_CLOCK);
+
+	/* Peripheral reset, pins back to I2C */
+	I2C_MPU6050_Init(bus->I2Cx, bus->clock_speed);
+	if (bus->done != NULL)
+		I2C_MPU6050_DMA_Init(bus->I2Cx);
+}
+
+/* Run a transaction and recover the bus if it hung */
+static I2C_Result_t I2C_Execute(I2C_Bus_t* bus, I2C_Transaction_t* t, uint8_t polling) {
+	uint32_t start = MPU6050_Micros();
+	uint32_t elapsed;
+	I2C_Result_t result;
+
+	result = polling ? I2C_PollTransaction(bus->I2Cx, t) : I2C_RunTransaction(bus, t);
+	bus->stats.Transactions++;
+	if (result == I2C_Result_Ok)
+		return result;
+
+	bus->stats.Errors++;
+	if (result == I2C_Result_Nack)
+		return result; // bus is fine, the slave did not answer
+
+	I2C_RecoverBus(bus);
+	elapsed = MPU6050_Micros() - start;
+	bus->stats.Recoveries++;
+	bus->stats.RecoveryTime = elapsed;
+	if (elapsed > bus->stats.RecoveryTimeMax)
+		bus->stats.RecoveryTimeMax = elapsed;
+	return result;
+}
+
+static void I2C_Complete(I2C_Transaction_t* t, I2C_Result_t result) {
+	t->result = result;
+	if (t->callback != NULL)
+		t->callback(t);
+	if (t->done != NULL)
+		xSemaphoreGive(t->done);
+}
+
+static void I2C_ManagerTask(void *pvParameters) {
+	I2C_Bus_t* bus = (I2C_Bus_t*)pvParameters;
+	I2C_Transaction_t* t;
+
+	while (1) {
+		if (xQueueReceive(bus->queue, &t, portMAX_DELAY) == pdTRUE)
+			I2C_Complete(t, I2C_Execute(bus, t, 0));
+	}
+}
+
+I2C_Result_t I2C_Submit(I2C_TypeDef* I2Cx, I2C_Transaction_t* transaction) {
+	I2C_Bus_t* bus = I2C_GetBus(I2Cx);
+
+	if (bus == NULL) {
+		I2C_Complete(transaction, I2C_Result_Invalid);
+		return I2C_Result_Invalid;
+	}
+
+	if (bus->queue == NULL || xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) {
+		I2C_Complete(transaction, I2C_Execute(bus, transaction, 1));
+		return I2C_Result_Ok;
+	}
+
+	if (xQueueSend(bus->queue, &transaction, 0) != pdTRUE) {
+		I2C_Complete(transaction, I2C_Result_QueueFull);
+		return I2C_Result_QueueFull;
+	}
+	return I2C_Result_Ok;
+}
+
+I2C_Result_t I2C_Wait(I2C_Transaction_t* transaction) {
+	if (transaction->done != NULL)
+		xSemaphoreTake(transaction->done, portMAX_DELAY);
+	return (I2C_Result_t)transaction->result;
+}
+
+I2C_Result_t I2C_Transfer(I2C_TypeDef* I2Cx, I2C_Transaction_t* transaction) {
+	I2C_Bus_t* bus = I2C_GetBus(I2Cx);
+	I2C_Result_t result;
+
+	if (bus == NULL || bus->queue == NULL
+			|| xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) {
+		transaction->done = NULL;
+		I2C_Submit(I2Cx, transaction);
+		return (I2C_Result_t)transaction->result;
+	}
+
+	/* Clients share the bus semaphore one at a time */
+	xSemaphoreTake(bus->lock, portMAX_DELAY);
+	transaction->done = bus->sync;
+	I2C_Submit(I2Cx, transaction);
+	result = I2C_Wait(transaction);
+	xSemaphoreGive(bus->lock);
+
+	return result;
+}
+
+uint8_t I2C_GetStats(I2C_TypeDef* I2Cx, I2C_Stats_t* stats) {
+	I2C_Bus_t* bus = I2C_GetBus(I2Cx);
+
+	if (bus == NULL || bus->clock_speed == 0)
+		return 0;
+	taskENTER_CRITICAL();
+	*stats = bus->stats;
+	taskEXIT_CRITICAL();
+	return 1;
+}
+
+/* Blocking register access for one-off configuration */
+static I2C_Result_t I2C_Simple(I2C_TypeDef* I2Cx, uint8_t type, uint8_t address, uint8_t reg,
+		uint8_t* data, uint16_t count) {
+	I2C_Transaction_t t;
+
+	t.type = type;
+	t.address = address;
+	t.reg = reg;
+	t.data = data;
+	t.count = count;
+	t.callback = NULL;
+	t.done = NULL;
+	t.context = NULL;
+	return I2C_Transfer(I2Cx, &t);
+}
+
+I2C_Result_t I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint16_t ack) {
+	I2C_Result_t result;
+
 	/* Generate I2C start pulse */
 	I2Cx->CR1 |= I2C_CR1_START;
 
 	/* Wait till I2C is busy */
-	MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-	while (!(I2Cx->SR1 & I2C_SR1_SB)) {
-		if (--MPU6050_I2C_Timeout == 0x00) {
-			USART1_puts("\r\nTime OUT Start1");
-			return 1;
-		}
-	}
+	result = I2C_WaitFlags(I2Cx, I2C_SR1_SB);
+	if (result != I2C_Result_Ok)
+		return result;
 
 	/* Enable ack if we select it */
 	if (ack) {
@@ -122,86 +683,63 @@ int16_t I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint16_
 		I2Cx->DR = address & ~I2C_OAR1_ADD0;
 
 		/* Wait till finished */
-		MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-		while (!(I2Cx->SR1 & I2C_SR1_ADDR)) {
-			if (--MPU6050_I2C_Timeout == 0x00) {
-				USART1_puts("\r\nTime OUT Start2");
-				return 1;
-			}
-		}
-	}
-	if (direction == I2C_Direction_Receiver) {
+		result = I2C_WaitFlags(I2Cx, I2C_SR1_ADDR);
+	} else {
 		/* Send address with 1 last bit */
 		I2Cx->DR = address | I2C_OAR1_ADD0;
 
 		/* Wait till finished */
-		MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-		while (!I2C_CheckEvent(I2Cx, I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED)) {
-			if (--MPU6050_I2C_Timeout == 0x00) {
-				USART1_puts("\r\nTime OUT Start3");
-				return 1;
-			}
-		}
+		result = I2C_WaitEvent(I2Cx, I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED);
 	}
+	if (result != I2C_Result_Ok)
+		return result;
 
 	/* Read status register to clear ADDR flag */
 	I2Cx->SR2;
 
 	/* Return 0, everything ok */
-	return 0;
+	return I2C_Result_Ok;
 }
 
-uint8_t I2C_Stop(I2C_TypeDef* I2Cx) {
+I2C_Result_t I2C_Stop(I2C_TypeDef* I2Cx) {
+	I2C_Result_t result;
+
 	/* Wait till transmitter not empty */
-	MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-	while (((!(I2Cx->SR1 & I2C_SR1_TXE)) || (!(I2Cx->SR1 & I2C_SR1_BTF)))) {
-		if (--MPU6050_I2C_Timeout == 0x00) {
-			USART1_puts("\r\nTime OUT Stop");
-			return 1;
-		}
-	}
+	result = I2C_WaitFlags(I2Cx, I2C_SR1_TXE | I2C_SR1_BTF);
+	if (result != I2C_Result_Ok)
+		return result;
 
 	/* Generate stop */
 	I2Cx->CR1 |= I2C_CR1_STOP;
 
 	/* Return 0, everything ok */
-	return 0;
+	return I2C_Result_Ok;
 }
 
 uint8_t I2C_Read(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg) {
-	uint8_t received_data;
-	I2C_Start(I2Cx, address, I2C_Direction_Transmitter, I2C_Ack_Disable);
-	I2C_WriteData(I2Cx, reg);
-	I2C_Stop(I2Cx);
-	I2C_Start(I2Cx, address, I2C_Direction_Receiver, I2C_Ack_Disable);
-	received_data = I2C_ReadNack(I2Cx);
+	uint8_t received_data = 0;
+	I2C_Simple(I2Cx, I2C_TRANSACTION_READ, address, reg, &received_data, 1);
 	return received_data;
 }
 
-uint8_t I2C_ReadAck(I2C_TypeDef* I2Cx) {
-	uint8_t data;
+I2C_Result_t I2C_ReadAck(I2C_TypeDef* I2Cx, uint8_t* data) {
+	I2C_Result_t result;
 
 	/* Enable ACK */
 	I2Cx->CR1 |= I2C_CR1_ACK;
 
 	/* Wait till not received */
-	MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-	while (!I2C_CheckEvent(I2Cx, I2C_EVENT_MASTER_BYTE_RECEIVED)) {
-		if (--MPU6050_I2C_Timeout == 0x00) {
-			USART1_puts("\r\nTime OUT ReadAck");
-			return 1;
-		}
-	}
+	result = I2C_WaitEvent(I2Cx, I2C_EVENT_MASTER_BYTE_RECEIVED);
+	if (result != I2C_Result_Ok)
+		return result;
 
 	/* Read data */
-	data = I2Cx->DR;
-
-	/* Return data */
-	return data;
+	*data = I2Cx->DR;
+	return I2C_Result_Ok;
 }
 
-uint8_t I2C_ReadNack(I2C_TypeDef* I2Cx) {
-	uint8_t data;
+I2C_Result_t I2C_ReadNack(I2C_TypeDef* I2Cx, uint8_t* data) {
+	I2C_Result_t result;
 
 	/* Disable ACK */
 	I2Cx->CR1 &= ~I2C_CR1_ACK;
@@ -210,53 +748,32 @@ uint8_t I2C_ReadNack(I2C_TypeDef* I2Cx) {
 	I2Cx->CR1 |= I2C_CR1_STOP;
 
 	/* Wait till received */
-	MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-	while (!I2C_CheckEvent(I2Cx, I2C_EVENT_MASTER_BYTE_RECEIVED)) {
-		if (--MPU6050_I2C_Timeout == 0x00) {
-			USART1_puts("\r\nTime OUT ReadNack");
-			return 1;
-		}
-	}
+	result = I2C_WaitEvent(I2Cx, I2C_EVENT_MASTER_BYTE_RECEIVED);
+	if (result != I2C_Result_Ok)
+		return result;
 
 	/* Read data */
-	data = I2Cx->DR;
-
-	/* Return data */
-	return data;
+	*data = I2Cx->DR;
+	return I2C_Result_Ok;
 }
 
-void I2C_ReadMulti(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t* data, uint16_t count) {
-	uint8_t i;
-	I2C_Start(I2Cx, address, I2C_Direction_Transmitter, I2C_Ack_Enable);
-	I2C_WriteData(I2Cx, reg);
-	I2C_Stop(I2Cx);
-	I2C_Start(I2Cx, address, I2C_Direction_Receiver, I2C_Ack_Enable);
-	for (i = 0; i < count; i++) {
-		if (i == (count - 1)) {
-			/* Last byte */
-			data[i] = I2C_ReadNack(I2Cx);
-		} else {
-			data[i] = I2C_ReadAck(I2Cx);
-		}
-	}
+I2C_Result_t I2C_ReadMulti(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t* data, uint16_t count) {
+	return I2C_Simple(I2Cx, I2C_TRANSACTION_READ, address, reg, data, count);
 }
 
-void I2C_Write(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t data) {
-	I2C_Start(I2Cx, address, I2C_Direction_Transmitter, I2C_Ack_Disable);
-	I2C_WriteData(I2Cx, reg);
-	I2C_WriteData(I2Cx, data);
-	I2C_Stop(I2Cx);
+I2C_Result_t I2C_Write(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t data) {
+	return I2C_Simple(I2Cx, I2C_TRANSACTION_WRITE, address, reg, &data, 1);
 }
 
-void I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data) {
+I2C_Result_t I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data) {
+	I2C_Result_t result;
+
 	/* Wait till I2C is not busy anymore */
-	MPU6050_I2C_Timeout = MPU6050_I2C_TIMEOUT;
-	while (!(I2Cx->SR1 & I2C_SR1_TXE) && MPU6050_I2C_Timeout) {
-		if (--MPU6050_I2C_Timeout == 0x00) {
-			USART1_puts("\r\nTime OUT Writedata");
-		}
-	}
+	result = I2C_WaitFlags(I2Cx, I2C_SR1_TXE);
+	if (result != I2C_Result_Ok)
+		return result;
 
 	/* Send I2C data */
 	I2Cx->DR = data;
+	return I2C_Result_Ok;
 }
@@ -5,27 +5,134 @@
 #include "stm32f4xx_gpio.h"
 #include "stm32f4xx_rcc.h"
 #include "stm32f4xx_i2c.h"
+#include "stm32f4xx_dma.h"
 
-#define MPU6050_I2C_TIMEOUT 50000
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+
+/* Longest wait for one bus event while polling, in microseconds */
+#define MPU6050_I2C_TIMEOUT 1000
+
+/* SCL half period while clocking out a stuck slave, in microseconds */
+#define I2C_RECOVERY_HALF_CLOCK		5
+
+/*
+ * Supported buses, each receives through its own DMA stream so
+ * transfers on different buses run in parallel:
+ *   I2C1 SCL = PB6, SDA = PB7, RX on DMA1 stream 0, channel 1
+ *   I2C3 SCL = PA8, SDA = PC9, RX on DMA1 stream 2, channel 3
+ * I2C3 is shared with the touch panel controller of the Discovery board.
+ * Interrupts which call FreeRTOS API must not be above
+ * configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY.
+ */
+#define MPU6050_I2C_IRQ_PRIORITY	6
+
+/*
+ * Interrupt driven transactions get a deadline on the microsecond timer,
+ * MPU6050_I2C_TIMEOUT plus I2C_BYTE_TIME for every byte on the bus. A
+ * TIM5 compare channel per bus (CC1 for I2C1, CC2 for I2C3) aborts them.
+ */
+#define I2C_BYTE_TIME				100 // 9 clocks at 100 kHz and margin
+
+/* Longest wait for the repeated START in the event interrupt, in microseconds */
+#define I2C_RESTART_TIME			20
+
+/*
+ * Once the scheduler runs, a bus manager task owns each bus and runs
+ * the transactions queued by client tasks back to back
+ */
+#define I2C_QUEUE_LENGTH			8
+#define I2C_TASK_STACK				192
+#define I2C_TASK_PRIORITY			(tskIDLE_PRIORITY + 4)
+
+#define I2C_TRANSACTION_READ		0 // write register, repeated start, read count bytes
+#define I2C_TRANSACTION_WRITE		1 // write register followed by count bytes
+
+/*
+ * Transaction results. Timeouts, bus errors and lost arbitration reset
+ * the bus before the transaction completes, a NACK leaves it alone.
+ */
+typedef enum {
+	I2C_Result_Ok = 0x00,
+	I2C_Result_Timeout,         // bus event did not happen in time
+	I2C_Result_Nack,            // slave did not acknowledge
+	I2C_Result_BusError,        // misplaced START or STOP
+	I2C_Result_ArbitrationLost,
+	I2C_Result_Overrun,
+	I2C_Result_QueueFull,       // bus manager queue is full, nothing was sent
+	I2C_Result_Invalid          // bus is not supported
+} I2C_Result_t;
+
+typedef struct {
+	uint32_t Transactions;
+	uint32_t Errors;            // failed transactions
+	uint32_t Recoveries;        // bus resets after a hang
+	uint32_t RecoveryTime;      // last failed transaction including reset, in microseconds
+	uint32_t RecoveryTimeMax;
+} I2C_Stats_t;
+
+typedef struct I2C_Transaction {
+	uint8_t type;            // I2C_TRANSACTION_READ or I2C_TRANSACTION_WRITE
+	uint8_t address;         // 8-bit slave address
+	uint8_t reg;             // first register
+	uint8_t* data;           // buffer, DMA target for reads
+	uint16_t count;          // bytes to read or write after the register
+	volatile uint8_t result; // I2C_Result_t
+	/* Completion, either or both may be NULL. The callback runs in the bus manager task. */
+	void (*callback)(struct I2C_Transaction* transaction);
+	SemaphoreHandle_t done;
+	void* context;           // free for the client
+} I2C_Transaction_t;
 
 void I2C_MPU6050_Init(I2C_TypeDef* I2Cx, int clock_speed);
 
+void I2C_MPU6050_DMA_Init(I2C_TypeDef* I2Cx);
+
 void I2C1_ER_IRQHandler(void);
 
-int16_t I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint16_t ack);
+void I2C1_EV_IRQHandler(void);
+
+void I2C3_ER_IRQHandler(void);
+
+void I2C3_EV_IRQHandler(void);
+
+void DMA1_Stream0_IRQHandler(void);
+
+void DMA1_Stream2_IRQHandler(void);
 
-uint8_t I2C_Stop(I2C_TypeDef* I2Cx);
+I2C_Result_t I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint16_t ack);
+
+I2C_Result_t I2C_Stop(I2C_TypeDef* I2Cx);
 
 uint8_t I2C_Read(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg);
 
-uint8_t I2C_ReadAck(I2C_TypeDef* I2Cx);
+I2C_Result_t I2C_ReadAck(I2C_TypeDef* I2Cx, uint8_t* data);
+
+I2C_Result_t I2C_ReadNack(I2C_TypeDef* I2Cx, uint8_t* data);
+
+I2C_Result_t I2C_ReadMulti(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t* data, uint16_t count);
+
+/*
+ * Queue a transaction for the bus manager, never blocks. The transaction
+ * must stay valid until it completed. Before the scheduler starts it is
+ * run right away by polling. If the queue is full the transaction
+ * is completed with I2C_Result_QueueFull.
+ */
+I2C_Result_t I2C_Submit(I2C_TypeDef* I2Cx, I2C_Transaction_t* transaction);
+
+/* Block until a transaction with a done semaphore completed, returns its result */
+I2C_Result_t I2C_Wait(I2C_Transaction_t* transaction);
 
-uint8_t I2C_ReadNack(I2C_TypeDef* I2Cx);
+/* Submit and wait, for clients without a semaphore of their own */
+I2C_Result_t I2C_Transfer(I2C_TypeDef* I2Cx, I2C_Transaction_t* transaction);
 
-void I2C_ReadMulti(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t* data, uint16_t count);
+/* Copy error and recovery counters of a bus, returns 0 if the bus is not initialized */
+uint8_t I2C_GetStats(I2C_TypeDef* I2Cx, I2C_Stats_t* stats);
 
-void I2C_Write(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t data);
+I2C_Result_t I2C_Write(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t data);
 
-void I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data);
+I2C_Result_t I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data);
 
 #endif
@@ -0,0 +1,262 @@
+#include "l3gd20.h"
+
+#include "mpu6050.h"
+
+#define L3GD20_BURST_SIZE	(1 + L3GD20_FIFO_SIZE * 6)
+
+/* Command byte followed by dummy bytes, the answer lands in rx_buffer */
+static uint8_t tx_buffer[L3GD20_BURST_SIZE];
+static uint8_t rx_buffer[L3GD20_BURST_SIZE];
+
+static SemaphoreHandle_t L3GD20_Done;
+static uint16_t L3GD20_Pending = 0; // samples of the running burst
+static uint32_t L3GD20_ReadTime;
+static uint8_t L3GD20_Lost = 1; // samples before the measuring window were lost or not counted
+static uint32_t L3GD20_WindowStart;
+static uint32_t L3GD20_WindowFrames;
+static L3GD20_Stats_t L3GD20_Stats;
+
+static void L3GD20_Select(void) {
+	GPIO_ResetBits(L3GD20_CS_GPIO, L3GD20_CS_PIN);
+}
+
+static void L3GD20_Deselect(void) {
+	GPIO_SetBits(L3GD20_CS_GPIO, L3GD20_CS_PIN);
+}
+
+/* Polled full duplex byte, 0 on timeout */
+static uint8_t L3GD20_Transfer(uint8_t data) {
+	uint32_t start = MPU6050_Micros();
+
+	SPI_I2S_SendData(L3GD20_SPI, data);
+	while (SPI_I2S_GetFlagStatus(L3GD20_SPI, SPI_I2S_FLAG_RXNE) == RESET)
+		if (MPU6050_Micros() - start > L3GD20_SPI_TIMEOUT)
+			return 0;
+	return (uint8_t)SPI_I2S_ReceiveData(L3GD20_SPI);
+}
+
+static uint8_t L3GD20_ReadRegister(uint8_t reg) {
+	uint8_t value;
+
+	L3GD20_Select();
+	L3GD20_Transfer(reg | L3GD20_READ);
+	value = L3GD20_Transfer(0x00);
+	L3GD20_Deselect();
+	return value;
+}
+
+static void L3GD20_WriteRegister(uint8_t reg, uint8_t value) {
+	L3GD20_Select();
+	L3GD20_Transfer(reg);
+	L3GD20_Transfer(value);
+	L3GD20_Deselect();
+}
+
+static void L3GD20_DMA_Init(void) {
+	DMA_InitTypeDef DMA_InitStructure;
+	NVIC_InitTypeDef NVIC_InitStructure;
+
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+
+	DMA_Cmd(L3GD20_RX_DMA_STREAM, DISABLE);
+	DMA_Cmd(L3GD20_TX_DMA_STREAM, DISABLE);
+	DMA_DeInit(L3GD20_RX_DMA_STREAM);
+	DMA_DeInit(L3GD20_TX_DMA_STREAM);
+
+	/* Length is set for every burst */
+	DMA_InitStructure.DMA_Channel = L3GD20_DMA_CHANNEL;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&L3GD20_SPI->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)rx_buffer;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = 1;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(L3GD20_RX_DMA_STREAM, &DMA_InitStructure);
+	DMA_ITConfig(L3GD20_RX_DMA_STREAM, DMA_IT_TC, ENABLE);
+
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)tx_buffer;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+	DMA_Init(L3GD20_TX_DMA_STREAM, &DMA_InitStructure);
+
+	/* The last received byte ends the burst */
+	NVIC_InitStructure.NVIC_IRQChannel = L3GD20_RX_DMA_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = L3GD20_IRQ_PRIORITY;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	if (L3GD20_Done == NULL)
+		L3GD20_Done = xSemaphoreCreateBinary();
+}
+
+uint8_t L3GD20_Gyro_Init(void) {
+	GPIO_InitTypeDef GPIO_InitStructure;
+	SPI_InitTypeDef SPI_InitStructure;
+	uint8_t id;
+
+	RCC_APB2PeriphClockCmd(L3GD20_SPI_CLK, ENABLE);
+	RCC_AHB1PeriphClockCmd(L3GD20_SPI_GPIO_CLK | L3GD20_CS_GPIO_CLK, ENABLE);
+
+	GPIO_PinAFConfig(L3GD20_SPI_GPIO, GPIO_PinSource7, GPIO_AF_SPI5);
+	GPIO_PinAFConfig(L3GD20_SPI_GPIO, GPIO_PinSource8, GPIO_AF_SPI5);
+	GPIO_PinAFConfig(L3GD20_SPI_GPIO, GPIO_PinSource9, GPIO_AF_SPI5);
+
+	GPIO_InitStructure.GPIO_Pin = GPIO_Pin_7 | GPIO_Pin_8 | GPIO_Pin_9;
+	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+	GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_DOWN;
+	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+	GPIO_Init(L3GD20_SPI_GPIO, &GPIO_InitStructure);
+
+	GPIO_InitStructure.GPIO_Pin = L3GD20_CS_PIN;
+	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_NOPULL;
+	GPIO_Init(L3GD20_CS_GPIO, &GPIO_InitStructure);
+	L3GD20_Deselect();
+
+	/* Mode 3, MSB first */
+	SPI_I2S_DeInit(L3GD20_SPI);
+	SPI_InitStructure.SPI_Direction = SPI_Direction_2Lines_FullDuplex;
+	SPI_InitStructure.SPI_Mode = SPI_Mode_Master;
+	SPI_InitStructure.SPI_DataSize = SPI_DataSize_8b;
+	SPI_InitStructure.SPI_CPOL = SPI_CPOL_High;
+	SPI_InitStructure.SPI_CPHA = SPI_CPHA_2Edge;
+	SPI_InitStructure.SPI_NSS = SPI_NSS_Soft;
+	SPI_InitStructure.SPI_BaudRatePrescaler = L3GD20_SPI_PRESCALER;
+	SPI_InitStructure.SPI_FirstBit = SPI_FirstBit_MSB;
+	SPI_InitStructure.SPI_CRCPolynomial = 7;
+	SPI_Init(L3GD20_SPI, &SPI_InitStructure);
+	SPI_Cmd(L3GD20_SPI, ENABLE);
+
+	L3GD20_DMA_Init();
+
+	id = L3GD20_ReadRegister(L3GD20_WHO_AM_I);
+	if (id != L3GD20_ID && id != I3G4250D_ID)
+		return 0;
+
+	L3GD20_WriteRegister(L3GD20_CTRL_REG4, L3GD20_CTRL4_VALUE);
+	L3GD20_WriteRegister(L3GD20_FIFO_CTRL, L3GD20_FIFO_STREAM);
+	L3GD20_WriteRegister(L3GD20_CTRL_REG5, L3GD20_FIFO_ENABLE);
+	L3GD20_WriteRegister(L3GD20_CTRL_REG1, L3GD20_CTRL1_VALUE);
+
+	tx_buffer[0] = L3GD20_OUT_X_L | L3GD20_READ | L3GD20_INCREMENT;
+	L3GD20_Stats.Period = L3GD20_PERIOD;
+	return 1;
+}
+
+uint16_t L3GD20_Gyro_Start(void) {
+	uint8_t status = L3GD20_ReadRegister(L3GD20_FIFO_SRC);
+	uint16_t count = status & L3GD20_FIFO_LEVEL;
+
+	L3GD20_ReadTime = MPU6050_Micros();
+	if (status & L3GD20_FIFO_OVERRUN) {
+		L3GD20_Stats.Overruns++;
+		L3GD20_Lost = 1;
+		count = L3GD20_FIFO_SIZE;
+	}
+	if (status & L3GD20_FIFO_EMPTY)
+		count = 0;
+	L3GD20_Pending = count;
+	if (count == 0)
+		return 0;
+
+	/* Receive first so no byte is missed, the transmit stream clocks the burst */
+	DMA_ClearFlag(L3GD20_RX_DMA_STREAM, L3GD20_RX_DMA_FLAGS);
+	DMA_ClearFlag(L3GD20_TX_DMA_STREAM, L3GD20_TX_DMA_FLAGS);
+	DMA_SetCurrDataCounter(L3GD20_RX_DMA_STREAM, 1 + count * 6);
+	DMA_SetCurrDataCounter(L3GD20_TX_DMA_STREAM, 1 + count * 6);
+	DMA_Cmd(L3GD20_RX_DMA_STREAM, ENABLE);
+	DMA_Cmd(L3GD20_TX_DMA_STREAM, ENABLE);
+
+	L3GD20_Select();
+	SPI_I2S_DMACmd(L3GD20_SPI, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, ENABLE);
+	return count;
+}
+
+/*
+ * Sample period against MPU6050_Micros, the gyroscope runs on its own
+ * clock. The window counts samples taken after it started, so it starts
+ * over at a read whenever samples were lost.
+ */
+static void L3GD20_MeasurePeriod(uint16_t count) {
+	uint32_t elapsed = L3GD20_ReadTime - L3GD20_WindowStart;
+	int32_t period;
+
+	if (L3GD20_Lost) {
+		L3GD20_Lost = 0;
+		L3GD20_WindowStart = L3GD20_ReadTime;
+		L3GD20_WindowFrames = 0;
+		return;
+	}
+	L3GD20_WindowFrames += count;
+	if (elapsed < L3GD20_PERIOD_WINDOW)
+		return;
+	period = (int32_t)(elapsed / L3GD20_WindowFrames);
+	L3GD20_Stats.Period += (period - (int32_t)L3GD20_Stats.Period) / 4;
+	L3GD20_WindowStart = L3GD20_ReadTime;
+	L3GD20_WindowFrames = 0;
+}
+
+uint16_t L3GD20_Gyro_Finish(int16_t* samples, uint32_t* timestamps) {
+	static const uint8_t axes[3] = L3GD20_AXES;
+	static const int8_t signs[3] = L3GD20_SIGNS;
+	uint16_t count = L3GD20_Pending;
+	uint8_t* data = &rx_buffer[1];
+	int16_t raw[3];
+	uint16_t n;
+	uint8_t i;
+
+	if (count == 0)
+		return 0;
+	L3GD20_Pending = 0;
+
+	if (xSemaphoreTake(L3GD20_Done, L3GD20_DMA_TIMEOUT) != pdTRUE) {
+		DMA_Cmd(L3GD20_TX_DMA_STREAM, DISABLE);
+		DMA_Cmd(L3GD20_RX_DMA_STREAM, DISABLE);
+		count = 0;
+		L3GD20_Lost = 1;
+		L3GD20_Stats.Errors++;
+	}
+	SPI_I2S_DMACmd(L3GD20_SPI, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, DISABLE);
+	L3GD20_Deselect();
+	if (count == 0)
+		return 0;
+
+	/*
+	 * Little endian x y z, the newest sample was taken at most one
+	 * period before the FIFO level was read
+	 */
+	for (n = 0; n < count; n++, data += 6, samples += 3) {
+		for (i = 0; i < 3; i++)
+			raw[i] = (int16_t)(data[i * 2 + 1] << 8 | data[i * 2]);
+		for (i = 0; i < 3; i++)
+			samples[i] = (signs[i] < 0) ? -raw[axes[i]] : raw[axes[i]];
+		timestamps[n] = L3GD20_ReadTime - (uint32_t)(count - 1 - n) * L3GD20_Stats.Period;
+	}
+	L3GD20_Stats.Frames += count;
+	L3GD20_MeasurePeriod(count);
+	return count;
+}
+
+void L3GD20_Gyro_GetStats(L3GD20_Stats_t* stats) {
+	*stats = L3GD20_Stats;
+}
+
+void DMA2_Stream3_IRQHandler(void) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	if (DMA_GetITStatus(L3GD20_RX_DMA_STREAM, L3GD20_RX_DMA_IT_TC)) {
+		DMA_ClearITPendingBit(L3GD20_RX_DMA_STREAM, L3GD20_RX_DMA_IT_TC);
+		xSemaphoreGiveFromISR(L3GD20_Done, &xHigherPriorityTaskWoken);
+	}
+
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
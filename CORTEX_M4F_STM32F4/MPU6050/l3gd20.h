@@ -0,0 +1,115 @@
+#ifndef _MPU6050_L3GD20_H
+#define _MPU6050_L3GD20_H
+
+#include "misc.h"
+#include "stm32f4xx_gpio.h"
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_spi.h"
+#include "stm32f4xx_dma.h"
+
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+/*
+ * L3GD20 gyroscope of the STM32F429I-Discovery board, newer boards
+ * carry the I3G4250D which only differs in WHO_AM_I.
+ *   SPI5 SCK = PF7, MISO = PF8, MOSI = PF9, CS = PC1
+ *   RX on DMA2 stream 3, TX on DMA2 stream 4, both channel 2
+ * The LCD shares SPI5 but is not used by the remote.
+ */
+#define L3GD20_SPI				SPI5
+#define L3GD20_SPI_CLK			RCC_APB2Periph_SPI5
+#define L3GD20_SPI_PRESCALER	SPI_BaudRatePrescaler_16 // 5.6MHz, at most 10MHz
+#define L3GD20_SPI_GPIO			GPIOF
+#define L3GD20_SPI_GPIO_CLK		RCC_AHB1Periph_GPIOF
+#define L3GD20_CS_GPIO			GPIOC
+#define L3GD20_CS_GPIO_CLK		RCC_AHB1Periph_GPIOC
+#define L3GD20_CS_PIN			GPIO_Pin_1
+
+#define L3GD20_RX_DMA_STREAM	DMA2_Stream3
+#define L3GD20_TX_DMA_STREAM	DMA2_Stream4
+#define L3GD20_DMA_CHANNEL		DMA_Channel_2
+#define L3GD20_RX_DMA_IRQn		DMA2_Stream3_IRQn
+#define L3GD20_RX_DMA_IT_TC		DMA_IT_TCIF3
+#define L3GD20_RX_DMA_FLAGS		(DMA_FLAG_TCIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_FEIF3)
+#define L3GD20_TX_DMA_FLAGS		(DMA_FLAG_TCIF4 | DMA_FLAG_HTIF4 | DMA_FLAG_TEIF4 | DMA_FLAG_DMEIF4 | DMA_FLAG_FEIF4)
+#define L3GD20_IRQ_PRIORITY		6 // same as the I2C buses
+#define L3GD20_DMA_TIMEOUT		(5 / portTICK_PERIOD_MS)
+
+/* Longest wait for one byte while polling, in microseconds */
+#define L3GD20_SPI_TIMEOUT		100
+
+#define L3GD20_WHO_AM_I			0x0F
+#define L3GD20_CTRL_REG1		0x20
+#define L3GD20_CTRL_REG4		0x23
+#define L3GD20_CTRL_REG5		0x24
+#define L3GD20_OUT_X_L			0x28
+#define L3GD20_FIFO_CTRL		0x2E
+#define L3GD20_FIFO_SRC			0x2F
+
+#define L3GD20_ID				0xD4
+#define I3G4250D_ID				0xD3
+
+#define L3GD20_READ				0x80
+#define L3GD20_INCREMENT		0x40 // address auto increment, wraps at OUT_Z_H in FIFO mode
+
+/*
+ * 190Hz output data rate, 70Hz bandwidth, all axes on. Full scale is
+ * 2000 degrees/s so fast turns never clip, noise is weighted anyway.
+ */
+#define L3GD20_CTRL1_VALUE		0x7F
+#define L3GD20_CTRL4_VALUE		0x20
+#define L3GD20_MULT				0.07f // degrees/s per LSB at 2000 degrees/s
+#define L3GD20_PERIOD			5280 // nominal sample period in microseconds, 189.4Hz
+
+/* Stream mode FIFO, the oldest samples are overwritten when it is full */
+#define L3GD20_FIFO_SIZE		32
+#define L3GD20_FIFO_STREAM		0x40
+#define L3GD20_FIFO_ENABLE		0x40
+#define L3GD20_FIFO_OVERRUN		0x40
+#define L3GD20_FIFO_EMPTY		0x20
+#define L3GD20_FIFO_LEVEL		0x1F
+
+/* Sample period is measured over this time against MPU6050_Micros */
+#define L3GD20_PERIOD_WINDOW	1000000 // microseconds
+
+/*
+ * Board axes to MPU6050 axes: MPU6050 axis i is L3GD20_SIGNS[i] times
+ * L3GD20 axis L3GD20_AXES[i]. Set to how the sensor is mounted.
+ */
+#define L3GD20_AXES				{ 0, 1, 2 }
+#define L3GD20_SIGNS			{ 1, 1, 1 }
+
+typedef struct {
+	uint32_t Frames;        /*!< Samples read */
+	uint32_t Overruns;      /*!< FIFO was full and samples were lost */
+	uint32_t Errors;        /*!< Transfers that did not complete */
+	uint32_t Period;        /*!< Measured sample period in microseconds */
+} L3GD20_Stats_t;
+
+/**
+ * @brief  Initializes SPI5, its DMA streams and the gyroscope, polled so it works before the scheduler runs
+ * @retval 1 if the gyroscope answered, 0 otherwise
+ */
+uint8_t L3GD20_Gyro_Init(void);
+
+/**
+ * @brief  Reads how many samples wait in the FIFO and starts moving them by DMA
+ * @note   Call @ref L3GD20_Gyro_Finish afterwards, other buses can be read in between
+ * @retval Samples being read
+ */
+uint16_t L3GD20_Gyro_Start(void);
+
+/**
+ * @brief  Waits for the transfer started by @ref L3GD20_Gyro_Start
+ * @param  *samples: x y z per sample in MPU6050 axes, oldest first, room for @ref L3GD20_FIFO_SIZE
+ * @param  *timestamps: sample times in microseconds from @ref MPU6050_Micros
+ * @retval Samples read
+ */
+uint16_t L3GD20_Gyro_Finish(int16_t* samples, uint32_t* timestamps);
+
+void L3GD20_Gyro_GetStats(L3GD20_Stats_t* stats);
+
+void DMA2_Stream3_IRQHandler(void);
+
+#endif
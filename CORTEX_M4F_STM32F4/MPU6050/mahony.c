@@ -0,0 +1,109 @@
+#include "mahony.h"
+
+void initMahony(Mahony *M) {
+	/* We will set the variables like so, these can also be tuned by the user */
+	M->twoKp = 2.0f * 0.5f;
+	M->twoKi = 2.0f * 0.05f;
+
+	M->q0 = 1.0f; // Level, heading 0
+	M->q1 = 0.0f;
+	M->q2 = 0.0f;
+	M->q3 = 0.0f;
+
+	M->integralFBx = 0.0f; // Reset bias
+	M->integralFBy = 0.0f;
+	M->integralFBz = 0.0f;
+}
+
+void setAttitude(Mahony *M, float roll, float pitch, float yaw) {
+	// Euler angles in radians, ZYX order, to quaternion
+	float cr = cosf(roll * 0.5f), sr = sinf(roll * 0.5f);
+	float cp = cosf(pitch * 0.5f), sp = sinf(pitch * 0.5f);
+	float cy = cosf(yaw * 0.5f), sy = sinf(yaw * 0.5f);
+
+	M->q0 = cr * cp * cy + sr * sp * sy;
+	M->q1 = sr * cp * cy - cr * sp * sy;
+	M->q2 = cr * sp * cy + sr * cp * sy;
+	M->q3 = cr * cp * sy - sr * sp * cy;
+}
+
+void updateMahony(Mahony *M, float gx, float gy, float gz, float ax, float ay, float az, float dt) {
+	// Mahony complementary filter, IMU variant without magnetometer
+	// See: Sebastian Madgwick, MahonyAHRS.c - http://x-io.co.uk/open-source-imu-and-ahrs-algorithms/
+	// Gyroscope in rad/s, accelerometer in any unit, dt in seconds
+	float recipNorm;
+	float halfvx, halfvy, halfvz;
+	float halfex, halfey, halfez;
+	float qa, qb, qc;
+
+	// Accelerometer feedback only if the measurement is valid (avoids NaN)
+	if (!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f))) {
+		recipNorm = 1.0f / sqrtf(ax * ax + ay * ay + az * az);
+		ax *= recipNorm;
+		ay *= recipNorm;
+		az *= recipNorm;
+
+		// Estimated direction of gravity
+		halfvx = M->q1 * M->q3 - M->q0 * M->q2;
+		halfvy = M->q0 * M->q1 + M->q2 * M->q3;
+		halfvz = M->q0 * M->q0 - 0.5f + M->q3 * M->q3;
+
+		// Error is cross product between estimated and measured direction of gravity
+		halfex = (ay * halfvz - az * halfvy);
+		halfey = (az * halfvx - ax * halfvz);
+		halfez = (ax * halfvy - ay * halfvx);
+
+		// Integral feedback, estimates the gyro bias
+		if (M->twoKi > 0.0f) {
+			M->integralFBx += M->twoKi * halfex * dt;
+			M->integralFBy += M->twoKi * halfey * dt;
+			M->integralFBz += M->twoKi * halfez * dt;
+			gx += M->integralFBx;
+			gy += M->integralFBy;
+			gz += M->integralFBz;
+		}
+
+		// Proportional feedback
+		gx += M->twoKp * halfex;
+		gy += M->twoKp * halfey;
+		gz += M->twoKp * halfez;
+	}
+
+	// Integrate rate of change of quaternion
+	gx *= (0.5f * dt);
+	gy *= (0.5f * dt);
+	gz *= (0.5f * dt);
+	qa = M->q0;
+	qb = M->q1;
+	qc = M->q2;
+	M->q0 += (-qb * gx - qc * gy - M->q3 * gz);
+	M->q1 += (qa * gx + qc * gz - M->q3 * gy);
+	M->q2 += (qa * gy - qb * gz + M->q3 * gx);
+	M->q3 += (qa * gz + qb * gy - qc * gx);
+
+	// Normalise quaternion
+	recipNorm = 1.0f / sqrtf(M->q0 * M->q0 + M->q1 * M->q1 + M->q2 * M->q2 + M->q3 * M->q3);
+	M->q0 *= recipNorm;
+	M->q1 *= recipNorm;
+	M->q2 *= recipNorm;
+	M->q3 *= recipNorm;
+}
+
+float getRoll(Mahony *M) {
+	return atan2f(M->q0 * M->q1 + M->q2 * M->q3, 0.5f - M->q1 * M->q1 - M->q2 * M->q2);
+}
+
+float getPitch(Mahony *M) {
+	float sinp = 2.0f * (M->q0 * M->q2 - M->q1 * M->q3);
+
+	// Clamp, rounding can push it just outside [-1, 1]
+	if (sinp > 1.0f)
+		sinp = 1.0f;
+	else if (sinp < -1.0f)
+		sinp = -1.0f;
+	return asinf(sinp);
+}
+
+float getYaw(Mahony *M) {
+	return atan2f(M->q0 * M->q3 + M->q1 * M->q2, 0.5f - M->q2 * M->q2 - M->q3 * M->q3);
+}
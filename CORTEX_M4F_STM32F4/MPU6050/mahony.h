@@ -0,0 +1,22 @@
+#ifndef _MPU6050_MAHONY_H
+#define _MPU6050_MAHONY_H
+
+#include <math.h>
+
+typedef struct {
+	/* Private */
+	float twoKp; // 2 * proportional gain, how fast the accelerometer corrects the gyro
+	float twoKi; // 2 * integral gain, removes gyro bias
+
+	float q0, q1, q2, q3; // Attitude quaternion, body frame relative to earth frame
+	float integralFBx, integralFBy, integralFBz; // Integral error, estimated gyro bias in rad/s
+} Mahony;
+
+void initMahony(Mahony *M);
+void setAttitude(Mahony *M, float roll, float pitch, float yaw);
+void updateMahony(Mahony *M, float gx, float gy, float gz, float ax, float ay, float az, float dt);
+float getRoll(Mahony *M);
+float getPitch(Mahony *M);
+float getYaw(Mahony *M);
+
+#endif
@@ -0,0 +1,227 @@
+#include "mahony_q.h"
+#include "mahony.h"
+
+#ifdef STM32F429_439xx
+#include "stm32f4xx.h"
+
+/* Dual 16-bit multiply subtract exchanged, lo(a) * hi(b) - hi(a) * lo(b) */
+#define SMUSDX(a, b)	((int32_t)__SMUSDX(a, b))
+#define CLZ(x)			__CLZ(x)
+#else
+static inline int32_t SMUSDX(uint32_t a, uint32_t b) {
+	return (int16_t)a * (int16_t)(b >> 16) - (int16_t)(a >> 16) * (int16_t)b;
+}
+#define CLZ(x)			__builtin_clz(x)
+#endif
+
+#define PACK16(lo, hi)	((uint32_t)(uint16_t)(lo) | (uint32_t)(hi) << 16)
+
+#define Q30_ONE			(1 << 30)
+#define Q15_PI			102944  // pi in Q15
+#define Q15_HALF_PI		51472
+#define RAD_TO_DEG_Q16	3754937 // 180 / pi in Q16
+#define USEC_TO_Q31		140737488u // 2^47 / 1e6, dt_us * this >> 16 is seconds in Q31
+#define MAX_HALF_ANGLE	Q30_ONE
+
+static uint32_t isqrt32(uint32_t x) {
+	uint32_t root = 0, bit = 1u << 30;
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit != 0) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+static int16_t sat16(int32_t x) {
+	if (x > 32767)
+		return 32767;
+	if (x < -32768)
+		return -32768;
+	return (int16_t)x;
+}
+
+static int32_t mulq30(int32_t a, int32_t b) {
+	return (int32_t)(((int64_t)a * b) >> 30);
+}
+
+/*
+ * Four quadrant arctangent in degrees Q16, any scale of y and x.
+ * Same minimax polynomial as atan1 in shell.c evaluated in Q15.
+ */
+static int32_t atan2_q16(int32_t y, int32_t x) {
+	uint32_t ux = x < 0 ? -(uint32_t)x : (uint32_t)x;
+	uint32_t uy = y < 0 ? -(uint32_t)y : (uint32_t)y;
+	uint32_t mx = ux > uy ? ux : uy;
+	uint32_t mn = ux > uy ? uy : ux;
+	int32_t bits, r, r2, p;
+
+	if (mx == 0)
+		return 0;
+
+	/* Scale so the larger one has 16 significant bits */
+	bits = 32 - CLZ(mx);
+	if (bits > 16) {
+		mx >>= bits - 16;
+		mn >>= bits - 16;
+	} else {
+		mx <<= 16 - bits;
+		mn <<= 16 - bits;
+	}
+
+	r = (int32_t)((mn << 15) / mx);
+	r2 = (r * r) >> 15;
+	p = 683;
+	p = -2790 + ((p * r2) >> 15);
+	p = 5903 + ((p * r2) >> 15);
+	p = -10823 + ((p * r2) >> 15);
+	p = 32763 + ((p * r2) >> 15);
+	p = (p * r) >> 15;
+
+	if (uy > ux)
+		p = Q15_HALF_PI - p;
+	if (x < 0)
+		p = Q15_PI - p;
+	if (y < 0)
+		p = -p;
+
+	return (int32_t)(((int64_t)p * RAD_TO_DEG_Q16) >> 15);
+}
+
+void initMahonyQ(MahonyQ *M) {
+	/* Same gains as initMahony */
+	M->twoKp = 2 * 32768;     // 2 * 0.5
+	M->twoKi = 2 * 3277;      // 2 * 0.05
+
+	M->q0 = Q30_ONE;
+	M->q1 = 0;
+	M->q2 = 0;
+	M->q3 = 0;
+
+	M->integralFBx = 0;
+	M->integralFBy = 0;
+	M->integralFBz = 0;
+}
+
+void setAttitudeQ(MahonyQ *M, float roll, float pitch, float yaw) {
+	/* Start up only, reuse the float conversion */
+	Mahony F;
+
+	initMahony(&F);
+	setAttitude(&F, roll, pitch, yaw);
+	M->q0 = (int32_t)(F.q0 * Q30_ONE);
+	M->q1 = (int32_t)(F.q1 * Q30_ONE);
+	M->q2 = (int32_t)(F.q2 * Q30_ONE);
+	M->q3 = (int32_t)(F.q3 * Q30_ONE);
+}
+
+void updateMahonyQ(MahonyQ *M, int32_t gx, int32_t gy, int32_t gz,
+		int32_t ax, int32_t ay, int32_t az, uint32_t dt_us) {
+	// Gyroscope in rad/s Q16, accelerometer raw, see updateMahony for the algorithm
+	int32_t dt = (int32_t)(((uint64_t)dt_us * USEC_TO_Q31) >> 16); // seconds, Q31
+	int32_t halfex, halfey, halfez;
+	int32_t qa, qb, qc, qd;
+	int64_t n2;
+	int32_t r;
+	uint8_t i, iterations;
+
+	if (!(ax == 0 && ay == 0 && az == 0)) {
+		uint32_t norm = isqrt32((uint32_t)(ax * ax) + (uint32_t)(ay * ay) + (uint32_t)(az * az));
+		int16_t nx, ny, nz, vx, vy, vz;
+
+		if (norm == 0)
+			norm = 1;
+
+		/* Measured gravity, unit vector in Q15 */
+		nx = sat16((ax * 32768) / (int32_t)norm);
+		ny = sat16((ay * 32768) / (int32_t)norm);
+		nz = sat16((az * 32768) / (int32_t)norm);
+
+		/* Estimated gravity, half vector in Q15 */
+		vx = (int16_t)(((int64_t)M->q1 * M->q3 - (int64_t)M->q0 * M->q2) >> 45);
+		vy = (int16_t)(((int64_t)M->q0 * M->q1 + (int64_t)M->q2 * M->q3) >> 45);
+		vz = (int16_t)((((int64_t)M->q0 * M->q0 + (int64_t)M->q3 * M->q3) >> 45) - 16384);
+
+		/* Cross product, each term is one dual multiply, Q30 */
+		halfex = SMUSDX(PACK16(ny, nz), PACK16(vy, vz));
+		halfey = SMUSDX(PACK16(nz, nx), PACK16(vz, vx));
+		halfez = SMUSDX(PACK16(nx, ny), PACK16(vx, vy));
+
+		// Integral feedback, estimates the gyro bias
+		if (M->twoKi > 0) {
+			M->integralFBx += (int32_t)((((int64_t)halfex * M->twoKi >> 16) * dt) >> 31);
+			M->integralFBy += (int32_t)((((int64_t)halfey * M->twoKi >> 16) * dt) >> 31);
+			M->integralFBz += (int32_t)((((int64_t)halfez * M->twoKi >> 16) * dt) >> 31);
+			gx += M->integralFBx >> 14;
+			gy += M->integralFBy >> 14;
+			gz += M->integralFBz >> 14;
+		}
+
+		// Proportional feedback
+		gx += (int32_t)(((int64_t)halfex * M->twoKp) >> 30);
+		gy += (int32_t)(((int64_t)halfey * M->twoKp) >> 30);
+		gz += (int32_t)(((int64_t)halfez * M->twoKp) >> 30);
+	}
+
+	// Half angle turned during dt, Q30
+	gx = (int32_t)(((int64_t)gx * dt) >> 18);
+	gy = (int32_t)(((int64_t)gy * dt) >> 18);
+	gz = (int32_t)(((int64_t)gz * dt) >> 18);
+	gx = gx > MAX_HALF_ANGLE ? MAX_HALF_ANGLE : (gx < -MAX_HALF_ANGLE ? -MAX_HALF_ANGLE : gx);
+	gy = gy > MAX_HALF_ANGLE ? MAX_HALF_ANGLE : (gy < -MAX_HALF_ANGLE ? -MAX_HALF_ANGLE : gy);
+	gz = gz > MAX_HALF_ANGLE ? MAX_HALF_ANGLE : (gz < -MAX_HALF_ANGLE ? -MAX_HALF_ANGLE : gz);
+
+	qa = M->q0;
+	qb = M->q1;
+	qc = M->q2;
+	qd = M->q3;
+	M->q0 += (int32_t)((-(int64_t)qb * gx - (int64_t)qc * gy - (int64_t)qd * gz) >> 30);
+	M->q1 += (int32_t)(((int64_t)qa * gx + (int64_t)qc * gz - (int64_t)qd * gy) >> 30);
+	M->q2 += (int32_t)(((int64_t)qa * gy - (int64_t)qb * gz + (int64_t)qd * gx) >> 30);
+	M->q3 += (int32_t)(((int64_t)qa * gz + (int64_t)qb * gy - (int64_t)qc * gx) >> 30);
+
+	// Normalise quaternion, Newton steps on 1 / sqrt(n2) starting from 1
+	n2 = ((int64_t)M->q0 * M->q0 + (int64_t)M->q1 * M->q1
+			+ (int64_t)M->q2 * M->q2 + (int64_t)M->q3 * M->q3) >> 30;
+	iterations = (n2 > Q30_ONE + (Q30_ONE >> 4) || n2 < Q30_ONE - (Q30_ONE >> 4)) ? 6 : 1;
+	r = Q30_ONE;
+	for (i = 0; i < iterations; i++) {
+		int64_t t = (3 * (int64_t)Q30_ONE - ((n2 * mulq30(r, r)) >> 30)) >> 1;
+		r = (int32_t)(((int64_t)r * t) >> 30);
+	}
+	M->q0 = mulq30(M->q0, r);
+	M->q1 = mulq30(M->q1, r);
+	M->q2 = mulq30(M->q2, r);
+	M->q3 = mulq30(M->q3, r);
+}
+
+int32_t getRollQ(MahonyQ *M) {
+	return atan2_q16(mulq30(M->q0, M->q1) + mulq30(M->q2, M->q3),
+			(Q30_ONE >> 1) - mulq30(M->q1, M->q1) - mulq30(M->q2, M->q2));
+}
+
+int32_t getPitchQ(MahonyQ *M) {
+	int32_t sinp = 2 * (mulq30(M->q0, M->q2) - mulq30(M->q1, M->q3));
+	int32_t cos2;
+
+	// Clamp, rounding can push it just outside [-1, 1]
+	if (sinp > Q30_ONE)
+		sinp = Q30_ONE;
+	else if (sinp < -Q30_ONE)
+		sinp = -Q30_ONE;
+
+	cos2 = Q30_ONE - mulq30(sinp, sinp);
+	return atan2_q16(sinp >> 15, (int32_t)isqrt32((uint32_t)(cos2 < 0 ? 0 : cos2)));
+}
+
+int32_t getYawQ(MahonyQ *M) {
+	return atan2_q16(mulq30(M->q0, M->q3) + mulq30(M->q1, M->q2),
+			(Q30_ONE >> 1) - mulq30(M->q2, M->q2) - mulq30(M->q3, M->q3));
+}
@@ -1,267 +1,1384 @@
 #include "mpu6050.h"
 #include "kalman.h"
+#include "gesture.h"
+#include "filter.h"
+#include "calib.h"
+#include "fusion.h"
+#include "dtw.h"
+#include "control.h"
+#include "protocol.h"
+#include "l3gd20.h"
 #include "i2c.h"
 #include "shell.h"
 #include "uart.h"
 
 //#define DEBUG
 
+/*
+ * Print every raw sample as "timestamp ax ay az gx gy gz",
+ * the trace format replayed by the host simulation in sim/
+ */
+//#define TRACE
+
+/*
+ * Print average CPU cycles spent in angle estimation once a second,
+ * build with FLOAT_ABI=softfp and FLOAT_ABI=hard to compare profiles.
+ * The former pair of Kalman filters runs alongside for comparison.
+ */
+//#define PROFILE
+
+/*
+ * Run raw samples through the biquad pre-filter (filter.h) before
+ * attitude estimation, a whole FIFO burst at a time in FIFO mode
+ */
+#define PREFILTER
+
+/*
+ * Match motion gestures against templates recorded with the "record"
+ * command (dtw.h), alongside the tilt gestures
+ */
+#define DTW_GESTURES
+
+/*
+ * Stream proportional setpoints (control.h) as PROTOCOL_CONTROL frames
+ * instead of gestures while the "control" command turned it on
+ */
+#define CONTROL_OUTPUT
+
+#ifdef TRACE
+#undef PREFILTER // traces are recorded raw, the simulation filters them
+#undef DTW_GESTURES
+#undef CONTROL_OUTPUT
+#endif
+
+#include <string.h>
+
 #define Square(x) ((x)*(x))
 #define Abs(x) ((x < 0) ? -x : x )
 
-static TM_MPU6050_t MPU6050_Data;
+/* Sensors sampled by the sensor task, the first one is the primary */
+static TM_MPU6050_t* MPU6050_Devices[MPU6050_MAX_DEVICES];
+static uint8_t MPU6050_DeviceCount = 0;
 xTaskHandle xSensorHandle;
 
-TickType_t xLastWakeTime;
-TickType_t const xFrequency = 100 / portTICK_PERIOD_MS;
-float const dt = 0.3f;
+static SemaphoreHandle_t MPU6050_DataReady;
+static volatile uint32_t MPU6050_DataReadyTime;
+
+/*
+ * Configuration changes requested by the setters, the sensor task
+ * applies them between samples so data and multipliers always match
+ */
+#define MPU6050_PENDING_RATE	0x01
+#define MPU6050_PENDING_DLPF	0x02
+#define MPU6050_PENDING_ACCE	0x04
+#define MPU6050_PENDING_GYRO	0x08
+#define MPU6050_PENDING_CALIB	0x10
+
+/* Primary sensor samples go to calib_add instead of gesture recognition */
+static uint8_t MPU6050_Calibrating = 0;
+
+/*
+ * Flash writes requested by the sensor task, a low priority task carries
+ * them out since erasing a sector blocks for hundreds of milliseconds
+ */
+#define MPU6050_SAVE_CALIB		0x01 // learned temperature bias, silent
+#define MPU6050_SAVE_CALIBRATED	0x02
+#define MPU6050_SAVE_RECORDED	0x04
+#define MPU6050_SAVE_FORGOTTEN	0x08
+
+static SemaphoreHandle_t MPU6050_SaveReady;
+static uint8_t MPU6050_SaveRequests = 0;
+static calib_offsets_t MPU6050_SaveOffsets;
 
+#ifdef MPU6050_L3GD20_FUSION
+static uint8_t MPU6050_L3GD20 = 0; // L3GD20 answered
+static int16_t MPU6050_L3GD20_Samples[L3GD20_FIFO_SIZE * 3];
+static uint32_t MPU6050_L3GD20_Times[L3GD20_FIFO_SIZE];
+#endif
+
+#ifdef PROFILE
 Kalman kalmanX; // Create the Kalman instances
 Kalman kalmanY;
 
-/* IMU Data */
-float accX, accY, accZ;
-float gyroX, gyroY, gyroZ;
-
 float kalAngleX, kalAngleY; // Calculated angle using a Kalman filter
+#endif
 
-void MPU6050Task(void) {
-	char uart_out[32];
-	uint8_t controller_command = 0;
-	uint8_t pre_command = 0;
-	uint8_t count = 0;
+#ifdef MPU6050_FIFO_MODE
+TickType_t xLastWakeTime;
+#endif
 
-	MPU6050_Task_Suspend();
-	vTaskDelayUntil(&xLastWakeTime, xFrequency); // wait while sensor is ready
+#ifdef PROFILE
+static uint32_t profile_cycles = 0;
+static uint32_t profile_kalman_cycles = 0;
+static uint16_t profile_samples = 0;
+#endif
 
-	initKalman(&kalmanX);
-	initKalman(&kalmanY);
-	MPU6050_ReadAccelerometer();
+/* Gesture thresholds are in raw units of the 4G range, wider ranges clip */
+static int16_t MPU6050_Acce4G(int16_t value, TM_MPU6050_Accelerometer_t range) {
+	int32_t scaled;
 
-	accX = MPU6050_Data.Accelerometer_X;
-	accY = MPU6050_Data.Accelerometer_Y;
-	accZ = MPU6050_Data.Accelerometer_Z;
+	if (range == TM_MPU6050_Accelerometer_2G)
+		return value >> 1;
+	scaled = (int32_t)value * (1 << (range - TM_MPU6050_Accelerometer_4G));
+	if (scaled > 32767)
+		return 32767;
+	if (scaled < -32768)
+		return -32768;
+	return (int16_t)scaled;
+}
 
-	float roll = atan2(-accY, -accZ) * RAD_TO_DEG;
-	float pitch = atan(-accX / sqrt1(Square(accY) + Square(accZ))) * RAD_TO_DEG;
+/* Offsets in raw units of the current range, again whenever it changes */
+static void MPU6050_UpdateBias(int16_t* bias, const float* offsets, float mult) {
+	uint8_t i;
 
-	setAngle(&kalmanX, roll); // Set starting angle
-	setAngle(&kalmanY, pitch);
+	for (i = 0; i < 3; i++)
+		bias[i] = (int16_t)lrintf(offsets[i] / mult);
+}
 
-	while (1) {
+/* Gyroscope bias at the current temperature */
+static void MPU6050_UpdateGyroBias(TM_MPU6050_t* DataStruct) {
+	float gyro[3];
+
+	calib_gyro_bias(&DataStruct->Offsets, DataStruct->Temperature, gyro);
+	MPU6050_UpdateBias(&DataStruct->Bias[3], gyro, DataStruct->Gyro_Mult);
+	DataStruct->BiasTemp = DataStruct->Temperature;
+}
+
+static void MPU6050_SetOffsets(TM_MPU6050_t* DataStruct, const calib_offsets_t* offsets) {
+	DataStruct->Offsets = *offsets;
+	MPU6050_UpdateBias(DataStruct->Bias, offsets->acce, DataStruct->Acce_Mult);
+	MPU6050_UpdateGyroBias(DataStruct);
+}
+
+/* Hand a flash write to the flash task, offsets may be NULL for templates */
+static void MPU6050_RequestSave(uint8_t request, const calib_offsets_t* offsets) {
+	taskENTER_CRITICAL();
+	if (offsets != NULL)
+		MPU6050_SaveOffsets = *offsets;
+	MPU6050_SaveRequests |= request;
+	taskEXIT_CRITICAL();
+	xSemaphoreGive(MPU6050_SaveReady);
+}
 
-		/* Read all data from sensor */
-		MPU6050_ReadAccGyo();
+static void MPU6050FlashTask(void *pvParameters) {
+	calib_offsets_t offsets;
+	uint8_t requests;
 
-		accX = MPU6050_Data.Accelerometer_X;
-		accY = MPU6050_Data.Accelerometer_Y;
-		accZ = MPU6050_Data.Accelerometer_Z;
-		gyroX = MPU6050_Data.Gyroscope_X;
-		gyroY = MPU6050_Data.Gyroscope_Y;
-		gyroZ = MPU6050_Data.Gyroscope_Z;
+	for (;;) {
+		xSemaphoreTake(MPU6050_SaveReady, portMAX_DELAY);
 
-		float roll = atan2(-accY, -accZ) * RAD_TO_DEG;
-		float pitch = atan(-accX / sqrt1(Square(accY) + Square(accZ))) * RAD_TO_DEG;
+		taskENTER_CRITICAL();
+		requests = MPU6050_SaveRequests;
+		MPU6050_SaveRequests = 0;
+		offsets = MPU6050_SaveOffsets;
+		taskEXIT_CRITICAL();
 
-		float gyroXrate = gyroX * MPU6050_Data.Gyro_Mult; // Convert to deg/s
-		float gyroYrate = gyroY * MPU6050_Data.Gyro_Mult; // Convert to deg/s
+		if (requests & MPU6050_SAVE_CALIBRATED)
+			USART1_puts(calib_save(&offsets) ? "\r\ncalibrated" : "\r\ncalibrated, not saved");
+		else if (requests & MPU6050_SAVE_CALIB)
+			calib_save(&offsets);
+#ifdef DTW_GESTURES
+		if (requests & (MPU6050_SAVE_RECORDED | MPU6050_SAVE_FORGOTTEN)) {
+			uint8_t ok = dtw_save();
 
-		// This fixes the transition problem when the accelerometer angle jumps between -180 and 180 degrees
-		if ((roll < -90 && kalAngleX > 90) || (roll > 90 && kalAngleX < -90)) {
-			setAngle(&kalmanX, roll);
-		} else {
-			kalAngleX = getAngle(&kalmanX, roll, gyroXrate, dt); // Calculate the angle using a Kalman filter
+			if (requests & MPU6050_SAVE_RECORDED)
+				USART1_puts(ok ? "\r\nrecorded" : "\r\nrecorded, not saved");
+			if (requests & MPU6050_SAVE_FORGOTTEN)
+				USART1_puts(ok ? "\r\nforgotten" : "\r\nforgotten, not saved");
 		}
+#endif
+	}
+}
 
-		if (Abs(kalAngleX) > 90)
-			gyroYrate = -gyroYrate; // Invert rate, so it fits the restriced accelerometer reading
-		kalAngleY = getAngle(&kalmanY, pitch, gyroYrate, dt);
+/*
+ * Learn gyroscope bias against temperature while the remote lies still,
+ * called with every raw sample gestures are recognized from
+ */
+static void MPU6050_TrackTemperature(TM_MPU6050_t* DataStruct, const int16_t* sample) {
+	switch (calib_temp_add(sample, DataStruct->Acce_Mult, DataStruct->Gyro_Mult,
+			DataStruct->Temperature, &DataStruct->Offsets)) {
+		case CALIB_TEMP_GROWN:
+			MPU6050_RequestSave(MPU6050_SAVE_CALIB, &DataStruct->Offsets);
+			MPU6050_UpdateGyroBias(DataStruct);
+			return;
+		case CALIB_TEMP_UPDATED:
+			MPU6050_UpdateGyroBias(DataStruct);
+			return;
+		default:
+			break;
+	}
+	if (fabsf(DataStruct->Temperature - DataStruct->BiasTemp) > MPU6050_TEMP_STEP)
+		MPU6050_UpdateGyroBias(DataStruct);
+}
 
-#ifdef DEBUG
-		USART1_puts("\r\n");
-		shell_float2str(accZ, uart_out);
-		USART1_puts(uart_out);
-#else
-		if (accY < -6300) {
-			controller_command = 1;
-		} else if (accY > 6300) {
-			controller_command = 2;
-		} else if (accZ < 0 && kalAngleY > 47) {
-			controller_command = 3;
-		} else if (accZ < 0 && kalAngleY < -30) {
-			controller_command = 4;
-		} else if (accZ < 0 && kalAngleY > 25 && kalAngleY < 47) {
-			controller_command = 5;
-		} else {
-			controller_command = 6;
+/* Subtract bias from interleaved ax ay az gx gy gz samples */
+static void MPU6050_RemoveBias(TM_MPU6050_t* DataStruct, int16_t* samples, uint16_t count) {
+	uint8_t i;
+
+	while (count--) {
+		for (i = 0; i < 6; i++) {
+			int32_t value = samples[i] - DataStruct->Bias[i];
+
+			if (value > 32767)
+				value = 32767;
+			else if (value < -32768)
+				value = -32768;
+			samples[i] = (int16_t)value;
 		}
+		samples += 6;
+	}
+}
 
-		// check hand gesture for a while
-		if (count == 5 && pre_command == controller_command) {
-			switch (controller_command) {
-			case 1:
-				USART1_puts("\r\nmove right");
-				break;
-			case 2:
-				USART1_puts("\r\nmove left");
-				break;
-			case 3:
-				USART1_puts("\r\nforward");
-				break;
-			case 4:
-				USART1_puts("\r\nDOWN");
-				break;
-			case 5:
-				USART1_puts("\r\nUP");
-				break;
-			case 6:
-				USART1_puts("\r\nsuspend");
-				break;
-			}
-		} else if (pre_command == controller_command) {
-			count++;
-		} else {
-			pre_command = controller_command;
-			count = 0;
+/*
+ * Read until there is a sample to seed from: the read succeeded and the
+ * accelerometer shows gravity, its registers read zero until the first
+ * conversion. Failed reads are retried with the next data ready.
+ */
+static void MPU6050_ReadSeed(TM_MPU6050_t* DataStruct) {
+	while (MPU6050_ReadAccGyo(DataStruct) != TM_MPU6050_Result_Ok
+			|| (DataStruct->Accelerometer_X == 0 && DataStruct->Accelerometer_Y == 0
+			&& DataStruct->Accelerometer_Z == 0)) {
+#ifdef MPU6050_FIFO_MODE
+		vTaskDelay(MPU6050_FIFO_PERIOD);
+#else
+		xSemaphoreTake(MPU6050_DataReady, MPU6050_INT_TIMEOUT);
+#endif
+	}
+}
+
+/* Start attitude estimation and pre-filter from the current accelerometer sample */
+static void MPU6050_Seed(TM_MPU6050_t* DataStruct) {
+	int16_t first[6] = { DataStruct->Accelerometer_X, DataStruct->Accelerometer_Y,
+			DataStruct->Accelerometer_Z, 0, 0, 0 };
+
+	MPU6050_RemoveBias(DataStruct, first, 1);
+	first[3] = first[4] = first[5] = 0;
+	gesture_init(DataStruct->Rate, MPU6050_Acce4G(first[0], DataStruct->Acce_Range),
+			MPU6050_Acce4G(first[1], DataStruct->Acce_Range),
+			MPU6050_Acce4G(first[2], DataStruct->Acce_Range), MPU6050_Micros());
+
+#ifdef PREFILTER
+	filter_init(DataStruct->Rate);
+	filter_prime(first);
+#endif
+#ifdef DTW_GESTURES
+	dtw_init(DataStruct->Rate);
+#endif
+#ifdef CONTROL_OUTPUT
+	control_init();
+#endif
+
+#ifdef PROFILE
+	initKalman(&kalmanX);
+	initKalman(&kalmanY);
+	setAngle(&kalmanX, GESTURE_DEG(angleX));
+	setAngle(&kalmanY, GESTURE_DEG(angleY));
+#endif
+}
+
+/* Feed the current raw sample to the running calibration */
+static void MPU6050_CalibrateSample(TM_MPU6050_t* DataStruct) {
+	int16_t sample[6] = {
+			DataStruct->Accelerometer_X, DataStruct->Accelerometer_Y, DataStruct->Accelerometer_Z,
+			DataStruct->Gyroscope_X, DataStruct->Gyroscope_Y, DataStruct->Gyroscope_Z };
+	calib_offsets_t offsets;
+
+	switch (calib_add(sample, DataStruct->Acce_Mult, DataStruct->Gyro_Mult)) {
+		case CALIB_DONE:
+			offsets = DataStruct->Offsets;
+			calib_result(&offsets, DataStruct->Temperature);
+			calib_temp_init(&offsets);
+			MPU6050_SetOffsets(DataStruct, &offsets);
+			MPU6050_Calibrating = 0;
+			MPU6050_RequestSave(MPU6050_SAVE_CALIBRATED, &offsets);
+			MPU6050_ReadSeed(DataStruct);
+			MPU6050_Seed(DataStruct);
+			break;
+		case CALIB_MOVED:
+			USART1_puts("\r\nkeep still");
+			break;
+		default:
+			break;
+	}
+}
+
+/* Next range for the largest magnitude seen, range itself to stay */
+static uint8_t MPU6050_NextRange(uint8_t range, int32_t peak, uint16_t* quiet, uint16_t count, uint16_t hold) {
+	if (peak >= MPU6050_RANGE_UP) {
+		*quiet = 0;
+		return (range < 3) ? range + 1 : range;
+	}
+	if (peak >= MPU6050_RANGE_DOWN || range == 0) {
+		*quiet = 0;
+		return range;
+	}
+	*quiet += count;
+	if (*quiet < hold)
+		return range;
+	*quiet = 0;
+	return range - 1;
+}
+
+/*
+ * Count raw samples per range and request a range switch, applied by
+ * @ref MPU6050_ApplyConfig like the setters unless one of those is pending
+ */
+static void MPU6050_CheckRange(TM_MPU6050_t* DataStruct, const int16_t* samples, uint16_t count) {
+	uint16_t hold = (uint32_t)DataStruct->Rate * MPU6050_RANGE_HOLD / 1000;
+	int32_t peak[2] = { 0, 0 }, value;
+	uint8_t acce, gyro, saturated;
+	uint16_t n;
+	uint8_t i;
+
+	for (n = 0; n < count; n++, samples += 6) {
+		saturated = 0;
+		for (i = 0; i < 6; i++) {
+			value = Abs((int32_t)samples[i]);
+			if (value > peak[i / 3])
+				peak[i / 3] = value;
+			if (value >= MPU6050_RANGE_UP)
+				saturated = 1;
 		}
+		DataStruct->Saturations += saturated;
+	}
+	DataStruct->Acce_RangeCount[DataStruct->Acce_Range] += count;
+	DataStruct->Gyro_RangeCount[DataStruct->Gyro_Range] += count;
+
+	/* Calibration needs one range throughout */
+	if (DataStruct == MPU6050_Devices[0] && MPU6050_Calibrating)
+		return;
+
+	acce = MPU6050_NextRange(DataStruct->Acce_Range, peak[0], &DataStruct->Acce_Quiet, count, hold);
+	gyro = MPU6050_NextRange(DataStruct->Gyro_Range, peak[1], &DataStruct->Gyro_Quiet, count, hold);
+
+	taskENTER_CRITICAL();
+	if ((DataStruct->AutoRange & MPU6050_AUTO_ACCE) && acce != DataStruct->Acce_Range
+			&& !(DataStruct->Pending & MPU6050_PENDING_ACCE)) {
+		DataStruct->PendingAcce = (TM_MPU6050_Accelerometer_t)acce;
+		DataStruct->Pending |= MPU6050_PENDING_ACCE;
+		DataStruct->RangeSwitches++;
+	}
+	if ((DataStruct->AutoRange & MPU6050_AUTO_GYRO) && gyro != DataStruct->Gyro_Range
+			&& !(DataStruct->Pending & MPU6050_PENDING_GYRO)) {
+		DataStruct->PendingGyro = (TM_MPU6050_Gyroscope_t)gyro;
+		DataStruct->Pending |= MPU6050_PENDING_GYRO;
+		DataStruct->RangeSwitches++;
+	}
+	taskEXIT_CRITICAL();
+}
+
+#ifdef MPU6050_FIFO_MODE
+/* Frames are one sample period apart, the newest one was just written */
+static uint32_t MPU6050_FIFO_FrameTime(TM_MPU6050_t* DataStruct, uint16_t index) {
+	return DataStruct->FIFO_Time
+			- (uint32_t)(DataStruct->FIFO_Frames - 1 - index) * (1000000 / DataStruct->Rate);
+}
+#endif
+
+#ifdef MPU6050_L3GD20_FUSION
+/* Start reading the L3GD20 FIFO, overlaps the I2C reads */
+static void MPU6050_StartL3GD20(void) {
+	if (MPU6050_L3GD20)
+		L3GD20_Gyro_Start();
+}
+
+/* Hand the samples of the running L3GD20 read to the fusion */
+static void MPU6050_PushL3GD20(void) {
+	uint16_t count, n;
+
+	if (!MPU6050_L3GD20)
+		return;
+	count = L3GD20_Gyro_Finish(MPU6050_L3GD20_Samples, MPU6050_L3GD20_Times);
+	for (n = 0; n < count; n++)
+		fusion_push(&MPU6050_L3GD20_Samples[n * 3], MPU6050_L3GD20_Times[n]);
+}
+#endif
+
+#ifndef MPU6050_FIFO_MODE
+/* Remove bias, fuse the second gyroscope and pre-filter one sample */
+static void MPU6050_CorrectSample(TM_MPU6050_t* DataStruct) {
+	int16_t sample[6] = {
+			DataStruct->Accelerometer_X, DataStruct->Accelerometer_Y, DataStruct->Accelerometer_Z,
+			DataStruct->Gyroscope_X, DataStruct->Gyroscope_Y, DataStruct->Gyroscope_Z };
+
+	MPU6050_TrackTemperature(DataStruct, sample);
+	MPU6050_RemoveBias(DataStruct, sample, 1);
+#ifdef MPU6050_L3GD20_FUSION
+	fusion_apply(&sample[3], DataStruct->Timestamp);
+#endif
+#ifdef PREFILTER
+	filter_block(sample, 1);
 #endif
 
-		vTaskDelayUntil(&xLastWakeTime, xFrequency);
+	DataStruct->Accelerometer_X = sample[0];
+	DataStruct->Accelerometer_Y = sample[1];
+	DataStruct->Accelerometer_Z = sample[2];
+	DataStruct->Gyroscope_X = sample[3];
+	DataStruct->Gyroscope_Y = sample[4];
+	DataStruct->Gyroscope_Z = sample[5];
+}
+#endif
+
+#ifdef DTW_GESTURES
+/* Report a carried out template request, the flash task keeps the templates */
+static void MPU6050_TemplateEvent(uint8_t event) {
+	switch (event) {
+		case DTW_EVENT_RECORDED:
+			MPU6050_RequestSave(MPU6050_SAVE_RECORDED, NULL);
+			break;
+		case DTW_EVENT_FORGOTTEN:
+			MPU6050_RequestSave(MPU6050_SAVE_FORGOTTEN, NULL);
+			break;
+		case DTW_EVENT_SHORT:
+			USART1_puts("\r\ntoo short");
+			break;
+		case DTW_EVENT_NO_MOTION:
+			USART1_puts("\r\nno motion");
+			break;
+		case DTW_EVENT_FULL:
+			USART1_puts("\r\nno free template");
+			break;
+		default:
+			break;
 	}
 }
+#endif
+
+static void MPU6050_ProcessSample(TM_MPU6050_t* DataStruct) {
+	TM_MPU6050_Accelerometer_t range = DataStruct->Acce_Range;
+#ifdef PROFILE
+	uint32_t cycles = DWT->CYCCNT;
+#endif
 
-TM_MPU6050_Result_t MPU6050_Init(TM_MPU6050_Accelerometer_t AccelerometerSensitivity, TM_MPU6050_Gyroscope_t GyroscopeSensitivity) {
+	gesture_fuse(MPU6050_Acce4G(DataStruct->Accelerometer_X, range),
+			MPU6050_Acce4G(DataStruct->Accelerometer_Y, range),
+			MPU6050_Acce4G(DataStruct->Accelerometer_Z, range),
+			DataStruct->Gyroscope_X, DataStruct->Gyroscope_Y, DataStruct->Gyroscope_Z,
+			DataStruct->Gyro_Mult, DataStruct->Timestamp);
 
-	uint8_t temp;
+#ifdef PROFILE
+	profile_cycles += DWT->CYCCNT - cycles;
+	cycles = DWT->CYCCNT;
 
-	I2C_MPU6050_Init(MPU6050_I2C, MPU6050_I2C_CLOCK);
-	
-	/* Check if device is connected */
-	if (!MPU6050_I2C_IsDeviceConnected(MPU6050_I2C_ADDR)) {
-		/* Return error */
-		return TM_MPU6050_Result_DeviceNotConnected;
+	float roll = atan2f(-(float)accY, -(float)accZ) * RAD_TO_DEG;
+	float pitch = atan1(-accX / sqrt1(Square((float)accY) + Square((float)accZ))) * RAD_TO_DEG;
+
+	float gyroXrate = gyroX * DataStruct->Gyro_Mult; // Convert to deg/s
+	float gyroYrate = gyroY * DataStruct->Gyro_Mult; // Convert to deg/s
+
+	// This fixes the transition problem when the accelerometer angle jumps between -180 and 180 degrees
+	if ((roll < -90 && kalAngleX > 90) || (roll > 90 && kalAngleX < -90)) {
+		setAngle(&kalmanX, roll);
+	} else {
+		kalAngleX = getAngle(&kalmanX, roll, gyroXrate, GESTURE_DT); // Calculate the angle using a Kalman filter
 	}
-	
-	/* Check who I am */
-	if (I2C_Read(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_WHO_AM_I) != MPU6050_I_AM) {
-		/* Return error */
-		return TM_MPU6050_Result_DeviceInvalid;
+
+	if (Abs(kalAngleX) > 90)
+		gyroYrate = -gyroYrate; // Invert rate, so it fits the restriced accelerometer reading
+	kalAngleY = getAngle(&kalmanY, pitch, gyroYrate, GESTURE_DT);
+
+	profile_kalman_cycles += DWT->CYCCNT - cycles;
+	if (++profile_samples == DataStruct->Rate) {
+		char profile_out[12];
+
+		USART1_puts("\r\ncycles/sample: ");
+		shell_utoa(profile_cycles / profile_samples, profile_out);
+		USART1_puts(profile_out);
+		USART1_puts(" kalman: ");
+		shell_utoa(profile_kalman_cycles / profile_samples, profile_out);
+		USART1_puts(profile_out);
+		profile_cycles = 0;
+		profile_kalman_cycles = 0;
+		profile_samples = 0;
 	}
-	
-	/* Wakeup MPU6050, PLL with X axis gyroscope reference*/
-	I2C_Write(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_PWR_MGMT_1, 0x01);
+#endif
+
+#if defined(DEBUG)
+	char uart_out[32];
+
+	USART1_puts("\r\n");
+	shell_float2str(accZ, uart_out);
+	USART1_puts(uart_out);
+#elif defined(TRACE)
+	char uart_out[12];
+	int16_t raw[6] = {
+			DataStruct->Accelerometer_X, DataStruct->Accelerometer_Y, DataStruct->Accelerometer_Z,
+			DataStruct->Gyroscope_X, DataStruct->Gyroscope_Y, DataStruct->Gyroscope_Z };
+	uint8_t i;
+
+	USART1_puts("\r\n");
+	shell_utoa(DataStruct->Timestamp, uart_out);
+	USART1_puts(uart_out);
+	for (i = 0; i < 6; i++) {
+		USART1_puts(" ");
+		shell_itoa(raw[i], uart_out);
+		USART1_puts(uart_out);
+	}
+#else
+	uint8_t command = gesture_classify();
+#ifdef DTW_GESTURES
+	int16_t gyro[3] = { DataStruct->Gyroscope_X, DataStruct->Gyroscope_Y, DataStruct->Gyroscope_Z };
+	uint8_t motion = dtw_push(gyro, DataStruct->Gyro_Mult);
+
+	/* A motion gesture wins over the tilt of the same sample, it is confirmed already */
+	if (motion >= DTW_EVENT_RECORDED)
+		MPU6050_TemplateEvent(motion);
+	else if (motion != GESTURE_NONE)
+		command = gesture_fire(motion);
+#endif
+	uint8_t frame[PROTOCOL_MAX_FRAME];
+#ifdef CONTROL_OUTPUT
+	int16_t setpoints[CONTROL_AXES];
+	uint8_t payload[CONTROL_PAYLOAD_SIZE];
+
+	if (control_update(DataStruct->Gyro_Mult, DataStruct->Timestamp, setpoints))
+		USART1_write(frame, protocol_frame(PROTOCOL_CONTROL, DataStruct->Timestamp, payload,
+				control_pack(setpoints, payload), frame));
+	if (control_enabled())
+		command = GESTURE_NONE; // setpoints replace gestures
+#endif
+
+	if (command == GESTURE_NONE)
+		return;
+	if (protocol_enabled()) {
+		USART1_write(frame, protocol_frame(PROTOCOL_GESTURE, DataStruct->Timestamp, &command, 1, frame));
+	} else {
+		USART1_puts("\r\n");
+		USART1_puts((char *)gesture_name(command));
+	}
+#endif
+}
+
+/* Lowest rate SMPLRT_DIV reaches from the gyroscope output of a DLPF setting */
+static uint16_t MPU6050_MinDataRate(TM_MPU6050_DLPF_t dlpf) {
+	uint16_t base = (dlpf == TM_MPU6050_DLPF_260Hz) ? 8000 : 1000;
+
+	return (base / 256 > MPU6050_DATA_RATE_MIN) ? base / 256 : MPU6050_DATA_RATE_MIN;
+}
+
+static I2C_Result_t MPU6050_WriteDataRate(TM_MPU6050_t* DataStruct, uint16_t rate) {
+	uint16_t base = (DataStruct->DLPF == TM_MPU6050_DLPF_260Hz) ? 8000 : 1000;
+	uint16_t div = base / rate;
+
+	/* Sample rate = gyroscope output / (1 + SMPLRT_DIV) */
+	if (div < 1)
+		div = 1;
+	else if (div > 256)
+		div = 256;
+	DataStruct->Rate = base / div;
+	return I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_SMPLRT_DIV, div - 1);
+}
+
+static I2C_Result_t MPU6050_WriteDLPF(TM_MPU6050_t* DataStruct, TM_MPU6050_DLPF_t dlpf) {
+	uint8_t temp;
+
+	temp = I2C_Read(DataStruct->I2Cx, DataStruct->Address, MPU6050_CONFIG);
+	temp = (temp & 0xF8) | (uint8_t)dlpf;
+	DataStruct->DLPF = dlpf;
+	return I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_CONFIG, temp);
+}
+
+static I2C_Result_t MPU6050_WriteAccelerometer(TM_MPU6050_t* DataStruct, TM_MPU6050_Accelerometer_t AccelerometerSensitivity) {
+	uint8_t temp;
+	I2C_Result_t result;
 
-	/* Gyroscope sample output rate = 8kH / (1+ 7) */
-	I2C_Write(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_SMPLRT_DIV, 0x07);
-	
 	/* Config accelerometer */
-	temp = I2C_Read(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_ACCEL_CONFIG);
+	temp = I2C_Read(DataStruct->I2Cx, DataStruct->Address, MPU6050_ACCEL_CONFIG);
 	temp = (temp & 0xE7) | (uint8_t)AccelerometerSensitivity << 3;
-	I2C_Write(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_ACCEL_CONFIG, temp);
-	
-	/* Config gyroscope */
-	temp = I2C_Read(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_GYRO_CONFIG);
-	temp = (temp & 0xE7) | (uint8_t)GyroscopeSensitivity << 3;
-	I2C_Write(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_GYRO_CONFIG, temp);
-	
-	/* Set sensitivities for multiplying gyro and accelerometer data */
+	result = I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_ACCEL_CONFIG, temp);
+	DataStruct->Acce_Range = AccelerometerSensitivity;
+
+	/* Set sensitivity for multiplying accelerometer data */
 	switch (AccelerometerSensitivity) {
 		case TM_MPU6050_Accelerometer_2G:
-			MPU6050_Data.Acce_Mult = (float)1 / MPU6050_ACCE_SENS_2;
+			DataStruct->Acce_Mult = (float)1 / MPU6050_ACCE_SENS_2;
 			break;
 		case TM_MPU6050_Accelerometer_4G:
-			MPU6050_Data.Acce_Mult = (float)1 / MPU6050_ACCE_SENS_4;
+			DataStruct->Acce_Mult = (float)1 / MPU6050_ACCE_SENS_4;
 			break;
 		case TM_MPU6050_Accelerometer_8G:
-			MPU6050_Data.Acce_Mult = (float)1 / MPU6050_ACCE_SENS_8;
+			DataStruct->Acce_Mult = (float)1 / MPU6050_ACCE_SENS_8;
 			break;
 		case TM_MPU6050_Accelerometer_16G:
-			MPU6050_Data.Acce_Mult = (float)1 / MPU6050_ACCE_SENS_16;
+			DataStruct->Acce_Mult = (float)1 / MPU6050_ACCE_SENS_16;
 			break;
 		default:
 			break;
 	}
-	
+	MPU6050_UpdateBias(DataStruct->Bias, DataStruct->Offsets.acce, DataStruct->Acce_Mult);
+	return result;
+}
+
+static I2C_Result_t MPU6050_WriteGyroscope(TM_MPU6050_t* DataStruct, TM_MPU6050_Gyroscope_t GyroscopeSensitivity) {
+	uint8_t temp;
+	I2C_Result_t result;
+
+	/* Config gyroscope */
+	temp = I2C_Read(DataStruct->I2Cx, DataStruct->Address, MPU6050_GYRO_CONFIG);
+	temp = (temp & 0xE7) | (uint8_t)GyroscopeSensitivity << 3;
+	result = I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_GYRO_CONFIG, temp);
+	DataStruct->Gyro_Range = GyroscopeSensitivity;
+
+	/* Set sensitivity for multiplying gyro data */
 	switch (GyroscopeSensitivity) {
 		case TM_MPU6050_Gyroscope_250s:
-			MPU6050_Data.Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_250;
+			DataStruct->Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_250;
 			break;
 		case TM_MPU6050_Gyroscope_500s:
-			MPU6050_Data.Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_500;
+			DataStruct->Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_500;
 			break;
 		case TM_MPU6050_Gyroscope_1000s:
-			MPU6050_Data.Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_1000;
+			DataStruct->Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_1000;
 			break;
 		case TM_MPU6050_Gyroscope_2000s:
-			MPU6050_Data.Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_2000;
+			DataStruct->Gyro_Mult = (float)1 / MPU6050_GYRO_SENS_2000;
 			break;
 		default:
 			break;
 	}
+	MPU6050_UpdateGyroBias(DataStruct);
+	return result;
+}
+
+/* Write the whole configuration, at init and after the sensor may have lost it */
+static TM_MPU6050_Result_t MPU6050_Configure(TM_MPU6050_t* DataStruct) {
+	I2C_TypeDef* I2Cx = DataStruct->I2Cx;
+	uint8_t address = DataStruct->Address;
+	uint8_t who = 0;
+	uint8_t error;
+
+	/* Check who I am */
+	if (I2C_ReadMulti(I2Cx, address, MPU6050_WHO_AM_I, &who, 1) != I2C_Result_Ok)
+		return TM_MPU6050_Result_Error;
+	if (who != MPU6050_I_AM)
+		return TM_MPU6050_Result_DeviceInvalid;
+
+	/* Wakeup MPU6050, PLL with X axis gyroscope reference*/
+	error = I2C_Write(I2Cx, address, MPU6050_PWR_MGMT_1, 0x01);
+
+	/* DLPF first, it selects the gyroscope output rate the data rate divides */
+	error |= MPU6050_WriteDLPF(DataStruct, DataStruct->DLPF);
+	error |= MPU6050_WriteDataRate(DataStruct, DataStruct->Rate);
+
+	error |= MPU6050_WriteAccelerometer(DataStruct, DataStruct->Acce_Range);
+	error |= MPU6050_WriteGyroscope(DataStruct, DataStruct->Gyro_Range);
+
+#ifdef MPU6050_FIFO_MODE
+	/* Sensor buffers accelerometer and gyroscope frames */
+	error |= I2C_Write(I2Cx, address, MPU6050_INT_ENABLE, 0x00);
+	error |= I2C_Write(I2Cx, address, MPU6050_FIFO_EN, 0x78);
+	MPU6050_FIFO_Reset(DataStruct);
+#else
+	if (DataStruct == MPU6050_Devices[0]) {
+		/* Data ready interrupt, pulse on INT pin, status cleared by any read */
+		error |= I2C_Write(I2Cx, address, MPU6050_INT_PIN_CFG, 0x10);
+		error |= I2C_Write(I2Cx, address, MPU6050_INT_ENABLE, 0x01);
+	} else {
+		/* Sampled together with the primary sensor */
+		error |= I2C_Write(I2Cx, address, MPU6050_INT_ENABLE, 0x00);
+	}
+#endif
+
+	return error ? TM_MPU6050_Result_Error : TM_MPU6050_Result_Ok;
+}
+
+/*
+ * A read failed, the bus manager has already reset a hung bus.
+ * Configure the sensor again in case it was reset as well.
+ */
+static void MPU6050_Recover(TM_MPU6050_t* DataStruct) {
+	if (!DataStruct->Failed) {
+		DataStruct->Failed = 1;
+		DataStruct->FailTime = MPU6050_Micros();
+	}
+	DataStruct->Errors++;
+	MPU6050_Configure(DataStruct);
+}
+
+/* First good read after a failure */
+static void MPU6050_Recovered(TM_MPU6050_t* DataStruct) {
+	uint32_t elapsed = MPU6050_Micros() - DataStruct->FailTime;
+
+	DataStruct->Failed = 0;
+	DataStruct->Recoveries++;
+	DataStruct->RecoveryTime = elapsed;
+	if (elapsed > DataStruct->RecoveryTimeMax)
+		DataStruct->RecoveryTimeMax = elapsed;
+}
+
+/*
+ * Apply requested configuration changes, called by the sensor task between samples.
+ * Returns non-zero if the sensor was reconfigured.
+ */
+static uint8_t MPU6050_ApplyConfig(TM_MPU6050_t* DataStruct) {
+	uint8_t pending;
+	uint16_t rate;
+	TM_MPU6050_DLPF_t dlpf;
+	TM_MPU6050_Accelerometer_t acce;
+	TM_MPU6050_Gyroscope_t gyro;
+#ifdef PREFILTER
+	float acce_mult = DataStruct->Acce_Mult;
+	float gyro_mult = DataStruct->Gyro_Mult;
+#endif
+
+	if (DataStruct->Pending == 0)
+		return 0;
+
+	taskENTER_CRITICAL();
+	pending = DataStruct->Pending;
+	DataStruct->Pending = 0;
+	rate = DataStruct->PendingRate;
+	dlpf = DataStruct->PendingDLPF;
+	acce = DataStruct->PendingAcce;
+	gyro = DataStruct->PendingGyro;
+	taskEXIT_CRITICAL();
+
+	if (pending & MPU6050_PENDING_DLPF) {
+		MPU6050_WriteDLPF(DataStruct, dlpf);
+
+		/* Gyroscope output rate may have changed, keep the data rate */
+		if (!(pending & MPU6050_PENDING_RATE)) {
+			pending |= MPU6050_PENDING_RATE;
+			rate = DataStruct->Rate;
+		}
+	}
+	if (pending & MPU6050_PENDING_RATE) {
+		MPU6050_WriteDataRate(DataStruct, rate);
+
+		/* Only the primary sensor feeds the gesture pipeline */
+		if (DataStruct == MPU6050_Devices[0]) {
+			gesture_set_rate(DataStruct->Rate);
+#ifdef DTW_GESTURES
+			dtw_set_rate(DataStruct->Rate);
+#endif
+#ifdef PREFILTER
+			int16_t last[6] = {
+					DataStruct->Accelerometer_X, DataStruct->Accelerometer_Y, DataStruct->Accelerometer_Z,
+					DataStruct->Gyroscope_X, DataStruct->Gyroscope_Y, DataStruct->Gyroscope_Z };
+
+			filter_init(DataStruct->Rate);
+			filter_prime(last);
+#endif
+		}
+	}
+	if (pending & MPU6050_PENDING_ACCE)
+		MPU6050_WriteAccelerometer(DataStruct, acce);
+	if (pending & MPU6050_PENDING_GYRO)
+		MPU6050_WriteGyroscope(DataStruct, gyro);
+#ifdef MPU6050_L3GD20_FUSION
+	if (DataStruct == MPU6050_Devices[0] && (pending & MPU6050_PENDING_GYRO))
+		fusion_set_scale(DataStruct->Gyro_Mult, L3GD20_MULT);
+#endif
+
+#ifdef PREFILTER
+	/* Filter state is in raw units of the old ranges */
+	if (DataStruct == MPU6050_Devices[0] && (pending & (MPU6050_PENDING_ACCE | MPU6050_PENDING_GYRO))) {
+		float acce_scale = acce_mult / DataStruct->Acce_Mult;
+		float gyro_scale = gyro_mult / DataStruct->Gyro_Mult;
+		int16_t last[6] = {
+				(int16_t)(DataStruct->Accelerometer_X * acce_scale),
+				(int16_t)(DataStruct->Accelerometer_Y * acce_scale),
+				(int16_t)(DataStruct->Accelerometer_Z * acce_scale),
+				(int16_t)(DataStruct->Gyroscope_X * gyro_scale),
+				(int16_t)(DataStruct->Gyroscope_Y * gyro_scale),
+				(int16_t)(DataStruct->Gyroscope_Z * gyro_scale) };
+
+		filter_prime(last);
+	}
+#endif
+
+	/* Samples in the old setting do not count towards a calibration */
+	if (DataStruct == MPU6050_Devices[0] && (MPU6050_Calibrating || (pending & MPU6050_PENDING_CALIB))) {
+		if (!MPU6050_Calibrating)
+			USART1_puts("\r\ncalibrating");
+		MPU6050_Calibrating = 1;
+		calib_start();
+	}
+
+#ifdef MPU6050_FIFO_MODE
+	/* Samples taken before the change are scaled for the old setting */
+	MPU6050_FIFO_Reset(DataStruct);
+#endif
+	return 1;
+}
+
+#ifndef MPU6050_FIFO_MODE
+/*
+ * Burst read every sensor. The bus managers run reads on different
+ * buses at the same time and reads on one bus back to back.
+ */
+static void MPU6050_ReadDevices(uint32_t timestamp) {
+	uint8_t i;
+
+	for (i = 0; i < MPU6050_DeviceCount; i++)
+		MPU6050_ReadAccGyo_Start(MPU6050_Devices[i]);
+#ifdef MPU6050_L3GD20_FUSION
+	MPU6050_StartL3GD20();
+#endif
+
+	for (i = 0; i < MPU6050_DeviceCount; i++) {
+		MPU6050_ReadAccGyo_Finish(MPU6050_Devices[i]);
+		MPU6050_Devices[i]->Timestamp = timestamp;
+	}
+#ifdef MPU6050_L3GD20_FUSION
+	MPU6050_PushL3GD20();
+#endif
+}
+#endif
+
+void MPU6050Task(void) {
+	TM_MPU6050_t* primary = MPU6050_Devices[0];
+	calib_offsets_t offsets;
+	uint8_t i, changed;
+
+	MPU6050_Task_Suspend();
+#ifdef MPU6050_FIFO_MODE
+	vTaskDelay(MPU6050_FIFO_PERIOD); // wait while sensor is ready
+#else
+	xSemaphoreTake(MPU6050_DataReady, MPU6050_INT_TIMEOUT); // wait while sensor is ready
+#endif
+
+#ifdef PROFILE
+	/* Enable DWT cycle counter */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+
+	/* Offsets of an earlier calibration make the remote usable right away */
+	MPU6050_ReadSeed(primary);
+	if (calib_load(&offsets)) {
+		calib_temp_init(&offsets);
+		MPU6050_SetOffsets(primary, &offsets);
+	} else {
+		MPU6050_Calibrate(primary);
+	}
+	MPU6050_Seed(primary);
+	protocol_init();
+#ifdef DTW_GESTURES
+	dtw_load();
+#endif
+#ifdef MPU6050_L3GD20_FUSION
+	fusion_init();
+	fusion_set_scale(primary->Gyro_Mult, L3GD20_MULT);
+#endif
+
+#ifdef MPU6050_FIFO_MODE
+	/* Samples queued while the task was suspended are stale */
+	for (i = 0; i < MPU6050_DeviceCount; i++)
+		MPU6050_FIFO_Reset(MPU6050_Devices[i]);
+	xLastWakeTime = xTaskGetTickCount();
+#endif
+
+	while (1) {
+		changed = 0;
+		for (i = 0; i < MPU6050_DeviceCount; i++)
+			changed |= MPU6050_ApplyConfig(MPU6050_Devices[i]);
+
+#ifdef MPU6050_FIFO_MODE
+		uint16_t frames, n;
+
+		/* Let the sensors collect a batch of samples */
+		vTaskDelayUntil(&xLastWakeTime, MPU6050_FIFO_PERIOD);
+
+		/* Drain all of them in one burst per sensor */
+#ifdef MPU6050_L3GD20_FUSION
+		MPU6050_StartL3GD20();
+		frames = MPU6050_ReadFIFO(primary);
+		MPU6050_PushL3GD20();
+#else
+		frames = MPU6050_ReadFIFO(primary);
+#endif
+		if (MPU6050_Calibrating) {
+			for (n = 0; n < frames && MPU6050_Calibrating; n++) {
+				MPU6050_FIFO_Frame(primary, n);
+				MPU6050_CalibrateSample(primary);
+			}
+			frames = 0; // the rest is stale after seeding
+		}
+		MPU6050_CheckRange(primary, primary->FIFO_Samples, frames);
+		for (n = 0; n < frames; n++)
+			MPU6050_TrackTemperature(primary, &primary->FIFO_Samples[n * 6]);
+		MPU6050_RemoveBias(primary, primary->FIFO_Samples, frames);
+#ifdef MPU6050_L3GD20_FUSION
+		for (n = 0; n < frames; n++)
+			fusion_apply(&primary->FIFO_Samples[n * 6 + 3], MPU6050_FIFO_FrameTime(primary, n));
+#endif
+#ifdef PREFILTER
+		filter_block(primary->FIFO_Samples, frames);
+#endif
+		for (n = 0; n < frames; n++) {
+			MPU6050_FIFO_Frame(primary, n);
+			MPU6050_ProcessSample(primary);
+		}
+
+		/* Other sensors keep their newest frame */
+		for (i = 1; i < MPU6050_DeviceCount; i++) {
+			frames = MPU6050_ReadFIFO(MPU6050_Devices[i]);
+			MPU6050_CheckRange(MPU6050_Devices[i], MPU6050_Devices[i]->FIFO_Samples, frames);
+			if (frames > 0)
+				MPU6050_FIFO_Frame(MPU6050_Devices[i], frames - 1);
+		}
+		(void)changed;
+#else
+		/* Samples taken before the change are scaled for the old setting */
+		if (changed)
+			xSemaphoreTake(MPU6050_DataReady, MPU6050_INT_TIMEOUT);
+
+		/* Wait for data ready interrupt, poll on timeout */
+		if (xSemaphoreTake(MPU6050_DataReady, MPU6050_INT_TIMEOUT) != pdTRUE)
+			MPU6050_DataReadyTime = MPU6050_Micros();
+
+		/* Read all data from the sensors */
+		MPU6050_ReadDevices(MPU6050_DataReadyTime);
+		for (i = 0; i < MPU6050_DeviceCount; i++) {
+			TM_MPU6050_t* sensor = MPU6050_Devices[i];
+			int16_t sample[6] = {
+					sensor->Accelerometer_X, sensor->Accelerometer_Y, sensor->Accelerometer_Z,
+					sensor->Gyroscope_X, sensor->Gyroscope_Y, sensor->Gyroscope_Z };
+
+			if (!sensor->Failed)
+				MPU6050_CheckRange(sensor, sample, 1);
+		}
+		if (primary->Failed)
+			continue;
+		if (MPU6050_Calibrating) {
+			MPU6050_CalibrateSample(primary);
+			continue;
+		}
+		MPU6050_CorrectSample(primary);
+		MPU6050_ProcessSample(primary);
+#endif
+	}
+}
+
+TM_MPU6050_t* MPU6050_GetDevice(uint8_t index) {
+	if (index >= MPU6050_DeviceCount)
+		return NULL;
+	return MPU6050_Devices[index];
+}
+
+/* Position in the device table, MPU6050_MAX_DEVICES if there is no room */
+static uint8_t MPU6050_Register(TM_MPU6050_t* DataStruct) {
+	uint8_t i;
+
+	for (i = 0; i < MPU6050_DeviceCount; i++)
+		if (MPU6050_Devices[i] == DataStruct)
+			return i;
+	if (MPU6050_DeviceCount == MPU6050_MAX_DEVICES)
+		return MPU6050_MAX_DEVICES;
+	MPU6050_Devices[MPU6050_DeviceCount] = DataStruct;
+	return MPU6050_DeviceCount++;
+}
+
+/* A sensor that did not come up, the sensor task must not read it */
+static void MPU6050_Unregister(TM_MPU6050_t* DataStruct) {
+	uint8_t i;
+
+	for (i = 0; i < MPU6050_DeviceCount; i++)
+		if (MPU6050_Devices[i] == DataStruct)
+			break;
+	if (i == MPU6050_DeviceCount)
+		return;
+	for (MPU6050_DeviceCount--; i < MPU6050_DeviceCount; i++)
+		MPU6050_Devices[i] = MPU6050_Devices[i + 1];
+}
+
+TM_MPU6050_Result_t MPU6050_Init(TM_MPU6050_t* DataStruct, I2C_TypeDef* I2Cx, TM_MPU6050_Device_t DeviceNumber,
+		TM_MPU6050_Accelerometer_t AccelerometerSensitivity, TM_MPU6050_Gyroscope_t GyroscopeSensitivity) {
+	uint8_t index = MPU6050_Register(DataStruct);
+	TM_MPU6050_Result_t result;
+
+	if (index == MPU6050_MAX_DEVICES)
+		return TM_MPU6050_Result_Invalid;
+
+	/* Default configuration, the sensor task follows later changes */
+	DataStruct->I2Cx = I2Cx;
+	DataStruct->Address = MPU6050_I2C_ADDR | (uint8_t)DeviceNumber;
+	DataStruct->Rate = MPU6050_DATA_RATE;
+	DataStruct->DLPF = TM_MPU6050_DLPF_260Hz;
+	DataStruct->Acce_Range = AccelerometerSensitivity;
+	DataStruct->Gyro_Range = GyroscopeSensitivity;
+	DataStruct->Pending = 0;
+	DataStruct->Failed = 0;
+#ifdef TRACE
+	DataStruct->AutoRange = 0; // traces are replayed in one range
+#else
+	DataStruct->AutoRange = MPU6050_AUTO_RANGE;
+#endif
+	memset(&DataStruct->Offsets, 0, sizeof(DataStruct->Offsets));
+	if (DataStruct->Done == NULL)
+		DataStruct->Done = xSemaphoreCreateBinary();
+#ifdef MPU6050_FIFO_MODE
+	DataStruct->FIFO_Overflows = 0;
+#endif
+
+	MPU6050_TIM5_Init();
+	I2C_MPU6050_Init(I2Cx, MPU6050_I2C_CLOCK);
+	I2C_MPU6050_DMA_Init(I2Cx);
 	
+	/* Check if device is connected */
+	if (!MPU6050_I2C_IsDeviceConnected(I2Cx, DataStruct->Address)) {
+		/* Return error */
+		MPU6050_Unregister(DataStruct);
+		return TM_MPU6050_Result_DeviceNotConnected;
+	}
+	
+	/* Registered first, configuring tells the primary sensor by its index */
+	result = MPU6050_Configure(DataStruct);
+	if (result != TM_MPU6050_Result_Ok) {
+		MPU6050_Unregister(DataStruct);
+		return result;
+	}
+
+#ifndef MPU6050_FIFO_MODE
+	if (index == 0)
+		MPU6050_INT_Init();
+#endif
+#ifdef MPU6050_L3GD20_FUSION
+	/* The MPU6050 works alone without it */
+	if (index == 0 && !MPU6050_L3GD20) {
+		MPU6050_L3GD20 = L3GD20_Gyro_Init();
+		if (!MPU6050_L3GD20)
+			USART1_puts("\r\nL3GD20 is NOT READY!");
+	}
+#endif
+
 	/* Return OK */
 	return TM_MPU6050_Result_Ok;
 }
 
-TM_MPU6050_Result_t MPU6050_ReadAccelerometer() {
+void MPU6050_INT_Init() {
+	GPIO_InitTypeDef GPIO_InitStructure;
+	EXTI_InitTypeDef EXTI_InitStructure;
+	NVIC_InitTypeDef NVIC_InitStructure;
+
+	if (MPU6050_DataReady == NULL)
+		MPU6050_DataReady = xSemaphoreCreateBinary();
+
+	RCC_AHB1PeriphClockCmd(MPU6050_INT_GPIO_CLK, ENABLE);
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+
+	GPIO_InitStructure.GPIO_Pin = MPU6050_INT_PIN;
+	GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN;
+	GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+	GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_DOWN;
+	GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+	GPIO_Init(MPU6050_INT_GPIO, &GPIO_InitStructure);
+
+	/* Connect EXTI line to the MPU6050 INT pin */
+	SYSCFG_EXTILineConfig(MPU6050_INT_PORT_SOURCE, MPU6050_INT_PIN_SOURCE);
+
+	EXTI_InitStructure.EXTI_Line = MPU6050_INT_EXTI_LINE;
+	EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising;
+	EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+	EXTI_Init(&EXTI_InitStructure);
+
+	NVIC_InitStructure.NVIC_IRQChannel = MPU6050_INT_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = MPU6050_INT_PRIORITY;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+}
+
+void EXTI4_IRQHandler(void) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	if (EXTI_GetITStatus(MPU6050_INT_EXTI_LINE) != RESET) {
+		/* clear interrupt flag */
+		EXTI_ClearITPendingBit(MPU6050_INT_EXTI_LINE);
+		MPU6050_DataReadyTime = MPU6050_Micros();
+
+		/* New sample is ready, release sensor task */
+		xSemaphoreGiveFromISR(MPU6050_DataReady, &xHigherPriorityTaskWoken);
+	}
+
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
+
+void MPU6050_TIM5_Init() {
+	RCC_ClocksTypeDef RCC_Clocks;
+	TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+	uint32_t timer_clock;
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
+
+	/* APB1 timers run at twice PCLK1 when APB1 is divided */
+	RCC_GetClocksFreq(&RCC_Clocks);
+	timer_clock = RCC_Clocks.PCLK1_Frequency;
+	if (RCC_Clocks.PCLK1_Frequency != RCC_Clocks.HCLK_Frequency)
+		timer_clock *= 2;
+
+	/* 1MHz tick, free running over the full 32-bit range */
+	TIM_TimeBaseStructure.TIM_Prescaler = timer_clock / 1000000 - 1;
+	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseStructure.TIM_Period = 0xFFFFFFFF;
+	TIM_TimeBaseStructure.TIM_ClockDivision = TIM_CKD_DIV1;
+	TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
+	TIM_TimeBaseInit(TIM5, &TIM_TimeBaseStructure);
+
+	TIM_Cmd(TIM5, ENABLE);
+}
+
+uint32_t MPU6050_Micros() {
+	return TIM5->CNT;
+}
+
+TM_MPU6050_Result_t MPU6050_ReadAccelerometer(TM_MPU6050_t* DataStruct) {
 	uint8_t data[6];
 	
 	/* Read accelerometer data */
-	I2C_ReadMulti(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_ACCEL_XOUT_H, data, 6);
+	if (I2C_ReadMulti(DataStruct->I2Cx, DataStruct->Address, MPU6050_ACCEL_XOUT_H, data, 6)) {
+		/* Return error */
+		return TM_MPU6050_Result_Error;
+	}
 	
 	/* Format */
-	MPU6050_Data.Accelerometer_X = (int16_t)(data[0] << 8 | data[1]);
-	MPU6050_Data.Accelerometer_Y = (int16_t)(data[2] << 8 | data[3]);
-	MPU6050_Data.Accelerometer_Z = (int16_t)(data[4] << 8 | data[5]);
+	DataStruct->Accelerometer_X = (int16_t)(data[0] << 8 | data[1]);
+	DataStruct->Accelerometer_Y = (int16_t)(data[2] << 8 | data[3]);
+	DataStruct->Accelerometer_Z = (int16_t)(data[4] << 8 | data[5]);
 	
 	/* Return OK */
 	return TM_MPU6050_Result_Ok;
 }
 
-TM_MPU6050_Result_t MPU6050_ReadGyroscope() {
+TM_MPU6050_Result_t MPU6050_ReadGyroscope(TM_MPU6050_t* DataStruct) {
 	uint8_t data[6];
 	
 	/* Read gyroscope data */
-	I2C_ReadMulti(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_GYRO_XOUT_H, data, 6);
+	if (I2C_ReadMulti(DataStruct->I2Cx, DataStruct->Address, MPU6050_GYRO_XOUT_H, data, 6)) {
+		/* Return error */
+		return TM_MPU6050_Result_Error;
+	}
 	
 	/* Format */
-	MPU6050_Data.Gyroscope_X = (int16_t)(data[0] << 8 | data[1]);
-	MPU6050_Data.Gyroscope_Y = (int16_t)(data[2] << 8 | data[3]);
-	MPU6050_Data.Gyroscope_Z = (int16_t)(data[4] << 8 | data[5]);
+	DataStruct->Gyroscope_X = (int16_t)(data[0] << 8 | data[1]);
+	DataStruct->Gyroscope_Y = (int16_t)(data[2] << 8 | data[3]);
+	DataStruct->Gyroscope_Z = (int16_t)(data[4] << 8 | data[5]);
 
 	/* Return OK */
 	return TM_MPU6050_Result_Ok;
 }
 
-TM_MPU6050_Result_t MPU6050_ReadAccGyo() {
-	uint8_t data[14];
-	
+TM_MPU6050_Result_t MPU6050_ReadAccGyo(TM_MPU6050_t* DataStruct) {
+	MPU6050_ReadAccGyo_Start(DataStruct);
+	return MPU6050_ReadAccGyo_Finish(DataStruct);
+}
+
+TM_MPU6050_Result_t MPU6050_ReadAccGyo_Start(TM_MPU6050_t* DataStruct) {
+	I2C_Transaction_t* t = &DataStruct->Transaction;
+
 	/* Read full raw data, 14bytes */
-	I2C_ReadMulti(MPU6050_I2C, MPU6050_I2C_ADDR, MPU6050_ACCEL_XOUT_H, data, 14);
+	t->type = I2C_TRANSACTION_READ;
+	t->address = DataStruct->Address;
+	t->reg = MPU6050_ACCEL_XOUT_H;
+	t->data = DataStruct->Buffer;
+	t->count = 14;
+	t->callback = NULL;
+	t->done = DataStruct->Done;
+	I2C_Submit(DataStruct->I2Cx, t);
+	return TM_MPU6050_Result_Ok;
+}
+
+TM_MPU6050_Result_t MPU6050_ReadAccGyo_Finish(TM_MPU6050_t* DataStruct) {
+	int16_t raw[7];
+
+	if (I2C_Wait(&DataStruct->Transaction)) {
+		MPU6050_Recover(DataStruct);
+		/* Return error */
+		return TM_MPU6050_Result_Error;
+	}
+	if (DataStruct->Failed)
+		MPU6050_Recovered(DataStruct);
+	shell_unpack16(DataStruct->Buffer, raw, 7);
 	
 	/* Format accelerometer data */
-	MPU6050_Data.Accelerometer_X = (int16_t)(data[0] << 8 | data[1]);
-	MPU6050_Data.Accelerometer_Y = (int16_t)(data[2] << 8 | data[3]);
-	MPU6050_Data.Accelerometer_Z = (int16_t)(data[4] << 8 | data[5]);
+	DataStruct->Accelerometer_X = raw[0];
+	DataStruct->Accelerometer_Y = raw[1];
+	DataStruct->Accelerometer_Z = raw[2];
+
+	DataStruct->Temperature = raw[3] / MPU6050_TEMP_SENS + MPU6050_TEMP_OFFSET;
 
 	/* Format gyroscope data */
-	MPU6050_Data.Gyroscope_X = (int16_t)(data[8] << 8 | data[9]);
-	MPU6050_Data.Gyroscope_Y = (int16_t)(data[10] << 8 | data[11]);
-	MPU6050_Data.Gyroscope_Z = (int16_t)(data[12] << 8 | data[13]);
+	DataStruct->Gyroscope_X = raw[4];
+	DataStruct->Gyroscope_Y = raw[5];
+	DataStruct->Gyroscope_Z = raw[6];
 
 	/* Return OK */
 	return TM_MPU6050_Result_Ok;
 }
 
-uint8_t MPU6050_I2C_IsDeviceConnected(uint8_t address) {
+#ifdef MPU6050_FIFO_MODE
+void MPU6050_FIFO_Reset(TM_MPU6050_t* DataStruct) {
+	/* Stop, flush and restart the FIFO so frames are aligned again */
+	I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_USER_CTRL, 0x00);
+	I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_USER_CTRL, 0x04);
+	I2C_Write(DataStruct->I2Cx, DataStruct->Address, MPU6050_USER_CTRL, 0x40);
+}
+
+uint16_t MPU6050_ReadFIFO(TM_MPU6050_t* DataStruct) {
+	uint8_t data[2];
+	uint16_t fifo_count, frames;
+
+	/* Read number of bytes in FIFO */
+	if (I2C_ReadMulti(DataStruct->I2Cx, DataStruct->Address, MPU6050_FIFO_COUNTH, data, 2)) {
+		MPU6050_Recover(DataStruct);
+		return 0;
+	}
+	if (DataStruct->Failed)
+		MPU6050_Recovered(DataStruct);
+	fifo_count = (uint16_t)(data[0] << 8 | data[1]);
+	DataStruct->FIFO_Time = MPU6050_Micros();
+
+	/* Frames do not carry temperature, one reading covers the batch */
+	if (I2C_ReadMulti(DataStruct->I2Cx, DataStruct->Address, MPU6050_TEMP_OUT_H, data, 2) == I2C_Result_Ok)
+		DataStruct->Temperature = (int16_t)(data[0] << 8 | data[1]) / MPU6050_TEMP_SENS + MPU6050_TEMP_OFFSET;
+
+	/*
+	 * 1024 is not a multiple of the frame size, after an overflow
+	 * the FIFO is full and the oldest frame is torn apart.
+	 */
+	if (fifo_count % MPU6050_FIFO_FRAME_SIZE != 0
+			|| fifo_count > MPU6050_FIFO_SIZE - MPU6050_FIFO_SIZE % MPU6050_FIFO_FRAME_SIZE) {
+		DataStruct->FIFO_Overflows++;
+		MPU6050_FIFO_Reset(DataStruct);
+		return 0;
+	}
+
+	frames = fifo_count / MPU6050_FIFO_FRAME_SIZE;
+	DataStruct->FIFO_Frames = frames;
+	if (frames > MPU6050_FIFO_MAX_FRAMES)
+		frames = MPU6050_FIFO_MAX_FRAMES; // rest is read next time
+	if (frames == 0)
+		return 0;
+
+	/* Read all frames in one transfer */
+	if (I2C_ReadMulti(DataStruct->I2Cx, DataStruct->Address, MPU6050_FIFO_R_W,
+			DataStruct->FIFO_Buffer, frames * MPU6050_FIFO_FRAME_SIZE)) {
+		MPU6050_Recover(DataStruct);
+		return 0;
+	}
+	shell_unpack16(DataStruct->FIFO_Buffer, DataStruct->FIFO_Samples, frames * 6);
+
+	return frames;
+}
+
+void MPU6050_FIFO_Frame(TM_MPU6050_t* DataStruct, uint16_t index) {
+	int16_t *sample = &DataStruct->FIFO_Samples[index * 6];
+
+	/* Format accelerometer data */
+	DataStruct->Accelerometer_X = sample[0];
+	DataStruct->Accelerometer_Y = sample[1];
+	DataStruct->Accelerometer_Z = sample[2];
+
+	/* Format gyroscope data */
+	DataStruct->Gyroscope_X = sample[3];
+	DataStruct->Gyroscope_Y = sample[4];
+	DataStruct->Gyroscope_Z = sample[5];
+
+	DataStruct->Timestamp = MPU6050_FIFO_FrameTime(DataStruct, index);
+}
+
+uint32_t MPU6050_FIFO_GetOverflows(TM_MPU6050_t* DataStruct) {
+	return DataStruct->FIFO_Overflows;
+}
+#endif
+
+TM_MPU6050_Result_t MPU6050_SetDataRate(TM_MPU6050_t* DataStruct, uint16_t rate) {
+	TM_MPU6050_Result_t result = TM_MPU6050_Result_Invalid;
+	TM_MPU6050_DLPF_t dlpf;
+
+	taskENTER_CRITICAL();
+	/* Checked against the DLPF the rate will be applied with */
+	dlpf = (DataStruct->Pending & MPU6050_PENDING_DLPF) ? DataStruct->PendingDLPF : DataStruct->DLPF;
+	if (rate >= MPU6050_MinDataRate(dlpf) && rate <= MPU6050_DATA_RATE_MAX) {
+		DataStruct->PendingRate = rate;
+		DataStruct->Pending |= MPU6050_PENDING_RATE;
+		result = TM_MPU6050_Result_Ok;
+	}
+	taskEXIT_CRITICAL();
+	return result;
+}
+
+TM_MPU6050_Result_t MPU6050_Calibrate(TM_MPU6050_t* DataStruct) {
+	if (DataStruct == NULL || DataStruct != MPU6050_Devices[0])
+		return TM_MPU6050_Result_Invalid;
+
+	taskENTER_CRITICAL();
+	DataStruct->Pending |= MPU6050_PENDING_CALIB;
+	taskEXIT_CRITICAL();
+	return TM_MPU6050_Result_Ok;
+}
+
+TM_MPU6050_Result_t MPU6050_SetDLPF(TM_MPU6050_t* DataStruct, TM_MPU6050_DLPF_t dlpf) {
+	TM_MPU6050_Result_t result = TM_MPU6050_Result_Invalid;
+	uint16_t rate;
+
+	if (dlpf > TM_MPU6050_DLPF_5Hz)
+		return result;
+
+	taskENTER_CRITICAL();
+	/* The data rate is kept, it has to stay reachable */
+	rate = (DataStruct->Pending & MPU6050_PENDING_RATE) ? DataStruct->PendingRate : DataStruct->Rate;
+	if (rate >= MPU6050_MinDataRate(dlpf)) {
+		DataStruct->PendingDLPF = dlpf;
+		DataStruct->Pending |= MPU6050_PENDING_DLPF;
+		result = TM_MPU6050_Result_Ok;
+	}
+	taskEXIT_CRITICAL();
+	return result;
+}
+
+TM_MPU6050_Result_t MPU6050_SetAccelerometer(TM_MPU6050_t* DataStruct, TM_MPU6050_Accelerometer_t AccelerometerSensitivity) {
+	if (AccelerometerSensitivity > TM_MPU6050_Accelerometer_16G)
+		return TM_MPU6050_Result_Invalid;
+
+	taskENTER_CRITICAL();
+	DataStruct->PendingAcce = AccelerometerSensitivity;
+	DataStruct->Pending |= MPU6050_PENDING_ACCE;
+	DataStruct->AutoRange &= ~MPU6050_AUTO_ACCE;
+	taskEXIT_CRITICAL();
+	return TM_MPU6050_Result_Ok;
+}
+
+TM_MPU6050_Result_t MPU6050_SetGyroscope(TM_MPU6050_t* DataStruct, TM_MPU6050_Gyroscope_t GyroscopeSensitivity) {
+	if (GyroscopeSensitivity > TM_MPU6050_Gyroscope_2000s)
+		return TM_MPU6050_Result_Invalid;
+
+	taskENTER_CRITICAL();
+	DataStruct->PendingGyro = GyroscopeSensitivity;
+	DataStruct->Pending |= MPU6050_PENDING_GYRO;
+	DataStruct->AutoRange &= ~MPU6050_AUTO_GYRO;
+	taskEXIT_CRITICAL();
+	return TM_MPU6050_Result_Ok;
+}
+
+TM_MPU6050_Result_t MPU6050_SetAutoRange(TM_MPU6050_t* DataStruct, uint8_t flags) {
+	if (flags & ~MPU6050_AUTO_RANGE)
+		return TM_MPU6050_Result_Invalid;
+
+	taskENTER_CRITICAL();
+	DataStruct->AutoRange = flags;
+	DataStruct->Acce_Quiet = 0;
+	DataStruct->Gyro_Quiet = 0;
+	taskEXIT_CRITICAL();
+	return TM_MPU6050_Result_Ok;
+}
+
+uint16_t MPU6050_GetDataRate(TM_MPU6050_t* DataStruct) {
+	return DataStruct->Rate;
+}
+
+uint8_t MPU6050_I2C_IsDeviceConnected(I2C_TypeDef* I2Cx, uint8_t address) {
 	uint8_t connected = 0;
 	/* Try to start, function will return 0 in case device will send ACK */
-	if (!I2C_Start(MPU6050_I2C, address, I2C_Direction_Transmitter, I2C_Ack_Enable)) {
+	if (!I2C_Start(I2Cx, address, I2C_Direction_Transmitter, I2C_Ack_Enable)) {
 		connected = 1;
 	}
 
 	/* STOP I2C */
-	I2C_Stop(MPU6050_I2C);
+	I2C_Stop(I2Cx);
 
 	/* Return status */
 	return connected;
@@ -276,7 +1393,21 @@ void MPU6050_Task_Suspend() {
 }
 
 uint8_t MPU6050_Task_Creat() {
-	BaseType_t ret = xTaskCreate(MPU6050Task,
+	BaseType_t ret;
+
+	MPU6050_SaveReady = xSemaphoreCreateBinary();
+	if (MPU6050_SaveReady == NULL)
+		return 0;
+	ret = xTaskCreate(MPU6050FlashTask,
+			"Flash",
+			256,
+			(void * ) NULL,
+			tskIDLE_PRIORITY + 1,
+			NULL);
+	if (ret != pdPASS)
+		return 0;
+
+	ret = xTaskCreate(MPU6050Task,
 			"MPU6050",
 			512,
 			(void * ) NULL,
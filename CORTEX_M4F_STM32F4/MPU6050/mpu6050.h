@@ -10,10 +10,16 @@ extern C {
 
 #include "FreeRTOS.h"
 #include "task.h"
+#include "semphr.h"
+#include "misc.h"
 #include "stm32f4xx_rcc.h"
 #include "stm32f4xx_gpio.h"
-
-#define RAD_TO_DEG 57.295779513082320876798154814105f
+#include "stm32f4xx_exti.h"
+#include "stm32f4xx_syscfg.h"
+#include "stm32f4xx_tim.h"
+#include "stm32f4xx_i2c.h"
+#include "i2c.h"
+#include "calib.h"
 
 #define wGyro 5
 
@@ -23,11 +29,66 @@ extern C {
 /* Default I2C clock */
 #define MPU6050_I2C_CLOCK			400000
 
-/* Default I2C address */
+/* Default I2C address, TM_MPU6050_Device_t is added to it */
 #define MPU6050_I2C_ADDR			0xD0
 
+/*
+ * Sensors the sensor task samples. The first one initialized drives
+ * gesture recognition and its INT pin paces all of them.
+ */
+#define MPU6050_MAX_DEVICES			2
+
+/*
+ * Second sensor for two-hand input or redundant sensing, on I2C1 with
+ * AD0 high, or on I2C3 to read both sensors at the same time
+ */
+//#define MPU6050_SECOND_SENSOR
+#define MPU6050_SECOND_I2C			I2C1
+#define MPU6050_SECOND_DEVICE		TM_MPU6050_Device_1
+
+/*
+ * Combine the gyroscope of the primary sensor with the L3GD20 on the
+ * Discovery board (l3gd20.h), read by SPI DMA while the I2C reads run.
+ * See fusion.h for how they are weighted.
+ */
+//#define MPU6050_L3GD20_FUSION
+
 #define MUP6050_ADDRESS 			0x68
 
+/*
+ * Default sample rate in Hz, gyroscope output divided by SMPLRT_DIV + 1.
+ * Gyroscope output is 8kHz with the DLPF off and 1kHz with it on, so
+ * with the DLPF off the divider of at most 256 gives 31Hz and more.
+ */
+#define MPU6050_DATA_RATE			100
+#define MPU6050_DATA_RATE_MIN		4
+#define MPU6050_DATA_RATE_MAX		1000
+
+/*
+ * Let the sensor buffer accelerometer and gyroscope frames in its FIFO
+ * and drain them every MPU6050_FIFO_PERIOD instead of reading on every
+ * data ready interrupt
+ */
+//#define MPU6050_FIFO_MODE
+
+#define MPU6050_FIFO_SIZE			1024
+#define MPU6050_FIFO_FRAME_SIZE		12
+#define MPU6050_FIFO_MAX_FRAMES		32
+#define MPU6050_FIFO_PERIOD			(20 / portTICK_PERIOD_MS)
+
+/* MPU6050 INT pin, active high data ready pulse */
+#define MPU6050_INT_GPIO			GPIOE
+#define MPU6050_INT_GPIO_CLK		RCC_AHB1Periph_GPIOE
+#define MPU6050_INT_PIN				GPIO_Pin_4
+#define MPU6050_INT_PORT_SOURCE		EXTI_PortSourceGPIOE
+#define MPU6050_INT_PIN_SOURCE		EXTI_PinSource4
+#define MPU6050_INT_EXTI_LINE		EXTI_Line4
+#define MPU6050_INT_IRQn			EXTI4_IRQn
+#define MPU6050_INT_PRIORITY		7
+
+/* Give up waiting for data ready and poll the sensor */
+#define MPU6050_INT_TIMEOUT			(100 / portTICK_PERIOD_MS)
+
 /* Who I am register value */
 #define MPU6050_I_AM				0x68
 
@@ -38,6 +99,7 @@ extern C {
 #define MPU6050_GYRO_CONFIG			0x1B
 #define MPU6050_ACCEL_CONFIG		0x1C
 #define MPU6050_MOTION_THRESH		0x1F
+#define MPU6050_FIFO_EN				0x23
 #define MPU6050_INT_PIN_CFG			0x37
 #define MPU6050_INT_ENABLE			0x38
 #define MPU6050_INT_STATUS			0x3A
@@ -78,6 +140,25 @@ extern C {
 #define MPU6050_ACCE_SENS_8			((float) 4096)
 #define MPU6050_ACCE_SENS_16		((float) 2048)
 
+/*
+ * Automatic range switching, a wider range as soon as an axis reaches
+ * MPU6050_RANGE_UP, the next finer one once all axes stayed below
+ * MPU6050_RANGE_DOWN for MPU6050_RANGE_HOLD milliseconds
+ */
+#define MPU6050_AUTO_ACCE			0x01
+#define MPU6050_AUTO_GYRO			0x02
+#define MPU6050_AUTO_RANGE			(MPU6050_AUTO_ACCE | MPU6050_AUTO_GYRO) // at init
+#define MPU6050_RANGE_UP			32000
+#define MPU6050_RANGE_DOWN			9800 // 60% of the finer range
+#define MPU6050_RANGE_HOLD			1000
+
+/* Temperature in °C is TEMP_OUT / 340 + 36.53 */
+#define MPU6050_TEMP_SENS			((float) 340)
+#define MPU6050_TEMP_OFFSET			((float) 36.53)
+
+/* Gyroscope bias follows the temperature in steps of this many °C */
+#define MPU6050_TEMP_STEP			((float) 0.1)
+
 /**
  * @}
  */
@@ -94,9 +175,19 @@ extern C {
 typedef enum {
 	TM_MPU6050_Result_Ok = 0x00,          /*!< Everything OK */
 	TM_MPU6050_Result_DeviceNotConnected, /*!< There is no device with valid slave address */
-	TM_MPU6050_Result_DeviceInvalid       /*!< Connected device with address is not MPU6050 */
+	TM_MPU6050_Result_DeviceInvalid,      /*!< Connected device with address is not MPU6050 */
+	TM_MPU6050_Result_Error,              /*!< I2C transfer failed or timed out */
+	TM_MPU6050_Result_Invalid             /*!< Parameter out of range */
 } TM_MPU6050_Result_t;
 
+/**
+ * @brief  Parameters for MPU6050 address, selected by the AD0 pin
+ */
+typedef enum {
+	TM_MPU6050_Device_0 = 0x00, /*!< AD0 pin is set to low, address 0xD0 */
+	TM_MPU6050_Device_1 = 0x02  /*!< AD0 pin is set to high, address 0xD2 */
+} TM_MPU6050_Device_t;
+
 /**
  * @brief  Parameters for accelerometer range
  */
@@ -117,13 +208,63 @@ typedef enum {
 	TM_MPU6050_Gyroscope_2000s = 0x03  /*!< Range is +- 2000 degrees/s */
 } TM_MPU6050_Gyroscope_t;
 
+/**
+ * @brief  Digital low-pass filter bandwidth of accelerometer and gyroscope, CONFIG register
+ */
+typedef enum {
+	TM_MPU6050_DLPF_260Hz = 0x00, /*!< Filter off, gyroscope output 8kHz */
+	TM_MPU6050_DLPF_184Hz = 0x01, /*!< 2ms delay, gyroscope output 1kHz from here on */
+	TM_MPU6050_DLPF_94Hz = 0x02,  /*!< 3ms delay */
+	TM_MPU6050_DLPF_44Hz = 0x03,  /*!< 5ms delay */
+	TM_MPU6050_DLPF_21Hz = 0x04,  /*!< 8ms delay */
+	TM_MPU6050_DLPF_10Hz = 0x05,  /*!< 14ms delay */
+	TM_MPU6050_DLPF_5Hz = 0x06    /*!< 19ms delay */
+} TM_MPU6050_DLPF_t;
+
 /**
  * @brief  Main MPU6050 structure
  */
 typedef struct {
 	/* Private */
+	I2C_TypeDef* I2Cx;       /*!< I2C peripheral the sensor is connected to */
+	uint8_t Address;         /*!< I2C address of the sensor */
 	float Gyro_Mult;         /*!< Gyroscope corrector from raw data to "degrees/s". Only for private use */
 	float Acce_Mult;         /*!< Accelerometer corrector from raw data to "g". Only for private use */
+	uint16_t Rate;           /*!< Output data rate in Hz */
+	TM_MPU6050_DLPF_t DLPF;  /*!< Digital low-pass filter bandwidth */
+	TM_MPU6050_Accelerometer_t Acce_Range; /*!< Accelerometer range, written again after a failure */
+	TM_MPU6050_Gyroscope_t Gyro_Range;     /*!< Gyroscope range, written again after a failure */
+	volatile uint8_t Pending;               /*!< Setter changes the sensor task has not applied yet */
+	uint16_t PendingRate;
+	TM_MPU6050_DLPF_t PendingDLPF;
+	TM_MPU6050_Accelerometer_t PendingAcce;
+	TM_MPU6050_Gyroscope_t PendingGyro;
+	calib_offsets_t Offsets; /*!< Bias found by calibration */
+	int16_t Bias[6];         /*!< Offsets in raw units of the current ranges, ax ay az gx gy gz */
+	float BiasTemp;          /*!< Temperature the gyroscope bias was evaluated at */
+	uint8_t AutoRange;       /*!< MPU6050_AUTO_ACCE and MPU6050_AUTO_GYRO, ranges follow the signal */
+	uint16_t Acce_Quiet;     /*!< Samples in a row that fit the next finer range */
+	uint16_t Gyro_Quiet;
+	uint32_t Acce_RangeCount[4]; /*!< Samples taken in each range */
+	uint32_t Gyro_RangeCount[4];
+	uint32_t Saturations;    /*!< Samples with an axis at the end of its range */
+	uint32_t RangeSwitches;
+	uint8_t Buffer[14];      /*!< DMA target of the sample burst read */
+	I2C_Transaction_t Transaction;          /*!< Sample burst read queued to the bus manager */
+	SemaphoreHandle_t Done;                 /*!< Given when the burst read completed */
+	uint8_t Failed;          /*!< Reads fail since FailTime, the sensor is being configured again */
+	uint32_t FailTime;
+	uint32_t Errors;         /*!< Failed reads */
+	uint32_t Recoveries;     /*!< Failures that ended with a good read */
+	uint32_t RecoveryTime;   /*!< Last failure to good read, in microseconds */
+	uint32_t RecoveryTimeMax;
+#ifdef MPU6050_FIFO_MODE
+	uint32_t FIFO_Overflows;
+	uint32_t FIFO_Time;      /*!< Time of the newest frame in FIFO */
+	uint16_t FIFO_Frames;    /*!< Frames in FIFO when it was read */
+	uint8_t FIFO_Buffer[MPU6050_FIFO_MAX_FRAMES * MPU6050_FIFO_FRAME_SIZE];
+	int16_t FIFO_Samples[MPU6050_FIFO_MAX_FRAMES * 6]; /*!< ax ay az gx gy gz */
+#endif
 	/* Public */
 	int16_t Accelerometer_X; /*!< Accelerometer value X axis */
 	int16_t Accelerometer_Y; /*!< Accelerometer value Y axis */
@@ -131,6 +272,8 @@ typedef struct {
 	int16_t Gyroscope_X;     /*!< Gyroscope value X axis */
 	int16_t Gyroscope_Y;     /*!< Gyroscope value Y axis */
 	int16_t Gyroscope_Z;     /*!< Gyroscope value Z axis */
+	float Temperature;       /*!< Die temperature in degrees C */
+	uint32_t Timestamp;      /*!< Sample time in microseconds from @ref MPU6050_Micros */
 } TM_MPU6050_t;
 
 /**
@@ -146,8 +289,9 @@ void MPU6050Task(void);
  */
 
 /**
- * @brief  Initializes MPU6050 and I2C peripheral
- * @param  *DataStruct: Pointer to empty @ref TM_MPU6050_t structure
+ * @brief  Initializes MPU6050 and I2C peripheral, registers the sensor with the sensor task
+ * @param  *DataStruct: Pointer to empty @ref TM_MPU6050_t structure, must stay valid while the task runs
+ * @param  *I2Cx: I2C1 or I2C3
  * @param   DeviceNumber: MPU6050 has one pin, AD0 which can be used to set address of device.
  *          This feature allows you to use 2 different sensors on the same board with same library.
  *          If you set AD0 pin to low, then this parameter should be TM_MPU6050_Device_0,
@@ -158,9 +302,18 @@ void MPU6050Task(void);
  * @param  GyroscopeSensitivity: Set gyroscope sensitivity. This parameter can be a value of @ref TM_MPU6050_Gyroscope_t enumeration
  * @retval Status:
  *            - TM_MPU6050_Result_t: Everything OK
+ *            - TM_MPU6050_Result_Invalid: MPU6050_MAX_DEVICES sensors are registered already
  *            - Other member: in other cases
  */
-TM_MPU6050_Result_t MPU6050_Init(TM_MPU6050_Accelerometer_t AccelerometerSensitivity, TM_MPU6050_Gyroscope_t GyroscopeSensitivity);
+TM_MPU6050_Result_t MPU6050_Init(TM_MPU6050_t* DataStruct, I2C_TypeDef* I2Cx, TM_MPU6050_Device_t DeviceNumber,
+		TM_MPU6050_Accelerometer_t AccelerometerSensitivity, TM_MPU6050_Gyroscope_t GyroscopeSensitivity);
+
+/**
+ * @brief  Sensor registered by @ref MPU6050_Init
+ * @param  index: Registration order, the primary sensor is 0
+ * @retval Pointer to @ref TM_MPU6050_t structure or NULL
+ */
+TM_MPU6050_t* MPU6050_GetDevice(uint8_t index);
 
 /**
  * @brief  Reads accelerometer data from sensor
@@ -169,7 +322,7 @@ TM_MPU6050_Result_t MPU6050_Init(TM_MPU6050_Accelerometer_t AccelerometerSensiti
  *            - TM_MPU6050_Result_Ok: everything is OK
  *            - Other: in other cases
  */
-TM_MPU6050_Result_t MPU6050_ReadAccelerometer();
+TM_MPU6050_Result_t MPU6050_ReadAccelerometer(TM_MPU6050_t* DataStruct);
 
 /**
  * @brief  Reads gyroscope data from sensor
@@ -178,7 +331,7 @@ TM_MPU6050_Result_t MPU6050_ReadAccelerometer();
  *            - TM_MPU6050_Result_Ok: everything is OK
  *            - Other: in other cases
  */
-TM_MPU6050_Result_t MPU6050_ReadGyroscope();
+TM_MPU6050_Result_t MPU6050_ReadGyroscope(TM_MPU6050_t* DataStruct);
 
 /**
  * @brief  Reads accelerometer, gyroscope and temperature data from sensor
@@ -187,7 +340,113 @@ TM_MPU6050_Result_t MPU6050_ReadGyroscope();
  *            - TM_MPU6050_Result_Ok: everything is OK
  *            - Other: in other cases
  */
-TM_MPU6050_Result_t MPU6050_ReadAccGyo();
+TM_MPU6050_Result_t MPU6050_ReadAccGyo(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Queues DMA burst read of accelerometer, gyroscope and temperature data.
+ *         Sensors on different buses are read at the same time, reads on one bus back to back.
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @retval TM_MPU6050_Result_Ok
+ */
+TM_MPU6050_Result_t MPU6050_ReadAccGyo_Start(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Waits for the read started by @ref MPU6050_ReadAccGyo_Start and stores the data
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure to store data to
+ * @retval Member of @ref TM_MPU6050_Result_t:
+ *            - TM_MPU6050_Result_Ok: everything is OK
+ *            - Other: in other cases, data is left unchanged
+ */
+TM_MPU6050_Result_t MPU6050_ReadAccGyo_Finish(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Changes output data rate without re-initializing the sensor.
+ *         Like the other setters the change is applied by the sensor task between samples.
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @param  rate: Sample rate in Hz, MPU6050_DATA_RATE_MIN to MPU6050_DATA_RATE_MAX,
+ *         at least 31 with the DLPF off (TM_MPU6050_DLPF_260Hz).
+ *         Rounded to what SMPLRT_DIV can divide the gyroscope output to.
+ * @retval TM_MPU6050_Result_Ok or TM_MPU6050_Result_Invalid if the DLPF can't reach the rate
+ */
+TM_MPU6050_Result_t MPU6050_SetDataRate(TM_MPU6050_t* DataStruct, uint16_t rate);
+
+/**
+ * @brief  Changes digital low-pass filter bandwidth, keeps the data rate
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @param  dlpf: Member of @ref TM_MPU6050_DLPF_t
+ * @retval TM_MPU6050_Result_Ok or TM_MPU6050_Result_Invalid if the data rate is out of reach
+ */
+TM_MPU6050_Result_t MPU6050_SetDLPF(TM_MPU6050_t* DataStruct, TM_MPU6050_DLPF_t dlpf);
+
+/**
+ * @brief  Changes accelerometer range, Acce_Mult follows with the first sample in the new range.
+ *         Turns automatic accelerometer range switching off.
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @param  AccelerometerSensitivity: Member of @ref TM_MPU6050_Accelerometer_t
+ * @retval TM_MPU6050_Result_Ok or TM_MPU6050_Result_Invalid
+ */
+TM_MPU6050_Result_t MPU6050_SetAccelerometer(TM_MPU6050_t* DataStruct, TM_MPU6050_Accelerometer_t AccelerometerSensitivity);
+
+/**
+ * @brief  Changes gyroscope range, Gyro_Mult follows with the first sample in the new range.
+ *         Turns automatic gyroscope range switching off.
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @param  GyroscopeSensitivity: Member of @ref TM_MPU6050_Gyroscope_t
+ * @retval TM_MPU6050_Result_Ok or TM_MPU6050_Result_Invalid
+ */
+TM_MPU6050_Result_t MPU6050_SetGyroscope(TM_MPU6050_t* DataStruct, TM_MPU6050_Gyroscope_t GyroscopeSensitivity);
+
+/**
+ * @brief  Turns automatic range switching on or off, ranges are held while calibrating
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @param  flags: MPU6050_AUTO_ACCE, MPU6050_AUTO_GYRO, both or 0
+ * @retval TM_MPU6050_Result_Ok or TM_MPU6050_Result_Invalid
+ */
+TM_MPU6050_Result_t MPU6050_SetAutoRange(TM_MPU6050_t* DataStruct, uint8_t flags);
+
+/**
+ * @brief  Averages the next samples while the remote lies still into new bias offsets and stores them in flash.
+ *         Gestures are not recognized until it is done, moving the remote starts it over.
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure of the primary sensor
+ * @retval TM_MPU6050_Result_Ok or TM_MPU6050_Result_Invalid for other sensors
+ */
+TM_MPU6050_Result_t MPU6050_Calibrate(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Current output data rate
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @retval Sample rate in Hz
+ */
+uint16_t MPU6050_GetDataRate(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Flushes sensor FIFO and restarts collecting accelerometer and gyroscope frames
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @retval None
+ */
+void MPU6050_FIFO_Reset(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Reads all complete frames from sensor FIFO in one burst, resets FIFO on overflow
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @retval Number of frames read, at most MPU6050_FIFO_MAX_FRAMES
+ */
+uint16_t MPU6050_ReadFIFO(TM_MPU6050_t* DataStruct);
+
+/**
+ * @brief  Copies one frame read by @ref MPU6050_ReadFIFO into sensor data
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @param  index: Frame number, oldest frame is 0
+ * @retval None
+ */
+void MPU6050_FIFO_Frame(TM_MPU6050_t* DataStruct, uint16_t index);
+
+/**
+ * @brief  Number of FIFO overflows since boot
+ * @param  *DataStruct: Pointer to @ref TM_MPU6050_t structure
+ * @retval Overflow count
+ */
+uint32_t MPU6050_FIFO_GetOverflows(TM_MPU6050_t* DataStruct);
 
 /**
  * @}
@@ -195,18 +454,30 @@ TM_MPU6050_Result_t MPU6050_ReadAccGyo();
 
 //void MPU6050_I2C_Init();
 
-uint8_t MPU6050_I2C_IsDeviceConnected(uint8_t address);
+void MPU6050_INT_Init();
 
+void EXTI4_IRQHandler(void);
+
+uint8_t MPU6050_I2C_IsDeviceConnected(I2C_TypeDef* I2Cx, uint8_t address);
+
+/**
+ * @brief  Starts TIM5 as free running 32-bit microsecond counter
+ * @retval None
+ */
 void MPU6050_TIM5_Init();
 
+/**
+ * @brief  Microseconds since @ref MPU6050_TIM5_Init, wraps after about 71 minutes
+ * @retval Current time in microseconds
+ */
+uint32_t MPU6050_Micros();
+
 void MPU6050_Task_Resume();
 
 void MPU6050_Task_Suspend();
 
 uint8_t MPU6050_Task_Creat();
 
-void MPU6050_TIM5_Init();
-
 //int16_t I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint16_t ack);
 //
 //uint8_t I2C_Stop(I2C_TypeDef* I2Cx);
@@ -0,0 +1,135 @@
+#include "protocol.h"
+
+#include <string.h>
+
+#ifdef STM32F429_439xx
+#include "stm32f4xx_rcc.h"
+#include "stm32f4xx_crc.h"
+#endif
+
+#define PROTOCOL_WORDS	((PROTOCOL_MAX_MESSAGE + 3) / 4)
+
+static volatile uint8_t enabled; // requested by the command task
+static uint8_t sequence;
+
+void protocol_init(void) {
+#ifdef STM32F429_439xx
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_CRC, ENABLE);
+#endif
+	sequence = 0;
+}
+
+/* Send gestures as frames instead of names */
+void protocol_enable(uint8_t enable) {
+	enabled = enable;
+}
+
+uint8_t protocol_enabled(void) {
+	return enabled;
+}
+
+/* CRC of the peripheral, only the sensor task uses it */
+uint32_t protocol_crc32(const uint32_t *words, uint8_t count) {
+#ifdef STM32F429_439xx
+	CRC_ResetDR();
+	return CRC_CalcBlockCRC((uint32_t *)words, count);
+#else
+	uint32_t crc = 0xFFFFFFFF;
+	uint8_t bit;
+
+	while (count--) {
+		crc ^= *words++;
+		for (bit = 0; bit < 32; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+	}
+	return crc;
+#endif
+}
+
+/* Header and payload in message, returns the CRC appended after them */
+static uint32_t protocol_check(uint32_t *message, uint8_t length) {
+	/* Pad to whole words */
+	memset((uint8_t *)message + length, 0, (4 - (length & 3)) & 3);
+	return protocol_crc32(message, (length + 3) / 4);
+}
+
+/*
+ * Build the frame of a message into frame, at most PROTOCOL_MAX_FRAME
+ * bytes, returns its length
+ */
+uint8_t protocol_frame(uint8_t type, uint32_t timestamp_us, const uint8_t *payload, uint8_t length,
+		uint8_t *frame) {
+	uint32_t words[PROTOCOL_WORDS];
+	uint8_t *message = (uint8_t *)words;
+	uint16_t ms = (uint16_t)(timestamp_us / 1000);
+	uint32_t crc;
+	uint8_t i, code = 1, out = 2, code_pos = 1;
+
+	message[0] = type;
+	message[1] = sequence++;
+	message[2] = (uint8_t)ms;
+	message[3] = (uint8_t)(ms >> 8);
+	memcpy(&message[PROTOCOL_HEADER_SIZE], payload, length);
+	length += PROTOCOL_HEADER_SIZE;
+	crc = protocol_check(words, length);
+	for (i = 0; i < PROTOCOL_CRC_SIZE; i++)
+		message[length++] = (uint8_t)(crc >> (8 * i));
+
+	/* COBS, each code byte tells how far the next zero is */
+	frame[0] = 0;
+	for (i = 0; i < length; i++) {
+		if (message[i] == 0) {
+			frame[code_pos] = code;
+			code_pos = out++;
+			code = 1;
+		} else {
+			frame[out++] = message[i];
+			code++;
+		}
+	}
+	frame[code_pos] = code;
+	frame[out++] = 0;
+	return out;
+}
+
+/*
+ * Decode the bytes between two zero bytes, returns 1 if they are a
+ * message with a valid CRC
+ */
+uint8_t protocol_decode(const uint8_t *data, uint8_t length, protocol_message_t *message) {
+	uint32_t words[PROTOCOL_WORDS];
+	uint8_t *decoded = (uint8_t *)words;
+	uint8_t i = 0, out = 0, code, n;
+	uint32_t crc;
+
+	while (i < length) {
+		code = data[i++];
+		if (code == 0 || i + code - 1 > length)
+			return 0;
+		for (n = 1; n < code; n++) {
+			if (out == PROTOCOL_MAX_MESSAGE)
+				return 0;
+			decoded[out++] = data[i++];
+		}
+		if (code < 0xFF && i < length) {
+			if (out == PROTOCOL_MAX_MESSAGE)
+				return 0;
+			decoded[out++] = 0;
+		}
+	}
+	if (out < PROTOCOL_HEADER_SIZE + PROTOCOL_CRC_SIZE)
+		return 0;
+
+	out -= PROTOCOL_CRC_SIZE;
+	crc = decoded[out] | (decoded[out + 1] << 8) | (decoded[out + 2] << 16)
+			| ((uint32_t)decoded[out + 3] << 24);
+	if (protocol_check(words, out) != crc)
+		return 0;
+
+	message->type = decoded[0];
+	message->sequence = decoded[1];
+	message->timestamp = decoded[2] | (decoded[3] << 8);
+	message->length = out - PROTOCOL_HEADER_SIZE;
+	memcpy(message->payload, &decoded[PROTOCOL_HEADER_SIZE], message->length);
+	return 1;
+}
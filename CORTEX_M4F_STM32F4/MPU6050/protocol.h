@@ -0,0 +1,49 @@
+#ifndef _MPU6050_PROTOCOL_H
+#define _MPU6050_PROTOCOL_H
+
+/*
+ * Binary frames for commands and setpoints on USART1.
+ *
+ * A message is type, sequence number, timestamp in ms (uint16 little
+ * endian), the payload and a CRC32 (little endian). The CRC is the one
+ * of the STM32 CRC peripheral (polynomial 0x04C11DB7, initial value
+ * 0xFFFFFFFF, no reflection, no final XOR). It runs over header and
+ * payload, zero padded to whole 32-bit little endian words. The message
+ * is COBS encoded, with a zero byte before and after it, so text printed
+ * in between never runs into a frame.
+ *
+ * The sequence number counts every frame sent. A receiver expecting
+ * sequence e and getting s has lost (int8_t)(s - e) frames if that is
+ * positive, a negative difference is a frame out of order.
+ */
+
+#include <stdint.h>
+
+/* Message types */
+#define PROTOCOL_GESTURE		0x01 // GESTURE_* command, 1 byte
+#define PROTOCOL_CONTROL		0x02 // roll, pitch and yaw setpoints, int16 each (control.h)
+
+#define PROTOCOL_HEADER_SIZE	4
+#define PROTOCOL_CRC_SIZE		4
+#define PROTOCOL_MAX_PAYLOAD	16
+#define PROTOCOL_MAX_MESSAGE	(PROTOCOL_HEADER_SIZE + PROTOCOL_MAX_PAYLOAD + PROTOCOL_CRC_SIZE)
+/* COBS adds one byte per 254, plus the two delimiters */
+#define PROTOCOL_MAX_FRAME		(PROTOCOL_MAX_MESSAGE + 1 + 2)
+
+typedef struct {
+	uint8_t type;
+	uint8_t sequence;
+	uint16_t timestamp; // ms
+	uint8_t length;
+	uint8_t payload[PROTOCOL_MAX_PAYLOAD];
+} protocol_message_t;
+
+void protocol_init(void);
+void protocol_enable(uint8_t enable);
+uint8_t protocol_enabled(void);
+uint8_t protocol_frame(uint8_t type, uint32_t timestamp_us, const uint8_t *payload, uint8_t length,
+		uint8_t *frame);
+uint8_t protocol_decode(const uint8_t *data, uint8_t length, protocol_message_t *message);
+uint32_t protocol_crc32(const uint32_t *words, uint8_t count);
+
+#endif
@@ -53,6 +53,22 @@ void shell_float2str(float f, char *str) {
 	reverse(str);
 }
 
+void shell_utoa(uint32_t n, char *str) {
+	int i = 0;
+	do {
+		str[i++] = n % 10 + '0';
+	} while((n /= 10) > 0);
+	str[i] = '\0';
+	reverse(str);
+}
+
+void shell_unpack16(const uint8_t *data, int16_t *out, uint16_t count) {
+	/* Big endian register pairs to signed 16-bit values */
+	uint16_t i;
+	for (i = 0; i < count; i++, data += 2)
+		out[i] = (int16_t)(data[0] << 8 | data[1]);
+}
+
 uint16_t shell_atoi(char *str) {
 	uint16_t num = 0;
 	while (*str != '\0') {
@@ -77,3 +93,18 @@ float sqrt1(const float x) {
 
 	return u.x;
 }
+
+float atan1(const float x) {
+	// Single precision arctangent in radians, max error about 1.2e-5 rad.
+	// Reduce to [0, 1] with atan(x) = pi/2 - atan(1/x) and use a minimax
+	// polynomial, no branches on the data path so it can be vectorized.
+	float a = fabsf(x);
+	float invert = a > 1.0f;
+	float r = invert ? 1.0f / a : a;
+	float r2 = r * r;
+	float p = r * (0.9998660f + r2 * (-0.3302995f + r2 * (0.1801410f
+			+ r2 * (-0.0851330f + r2 * 0.0208351f))));
+
+	p = invert * (1.5707963f - 2.0f * p) + p;
+	return x < 0 ? -p : p;
+}
@@ -4,12 +4,18 @@
 #include <stdint.h>
 #include <math.h>
 
+#define RAD_TO_DEG 57.295779513082320876798154814105f
+#define DEG_TO_RAD 0.017453292519943295769236907684886f
+
 uint16_t s_strlen(const char *str);
 void reverse(char *str);
 void shell_itoa(int16_t n, char *str);
 void shell_float2str(float f, char *str);
+void shell_utoa(uint32_t n, char *str);
+void shell_unpack16(const uint8_t *data, int16_t *out, uint16_t count);
 
 uint16_t shell_atoi(char *str);
 float sqrt1(const float x);
+float atan1(const float x);
 
 #endif
@@ -1,10 +1,42 @@
 #include "uart.h"
-//#include "shell.h"
-//#include "mpu6050.h"
+#include "shell.h"
+#include "mpu6050.h"
+#include "fusion.h"
+#include "dtw.h"
+#include "gesture.h"
+#include "control.h"
+#include "protocol.h"
+#include "l3gd20.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
 
 char buffer[MAX_UART_INPUT];
 uint8_t buffer_index = 0;
 
+/*
+ * Receive side, DMA writes rx_buffer circularly and the interrupts
+ * collect bytes from rx_read up to the DMA position into buffer.
+ */
+static char rx_buffer[UART_RX_BUFFER_SIZE];
+static uint16_t rx_read = 0;
+static uint8_t rx_overflow = 0; // current line is too long, drop it
+static volatile uint32_t rx_dropped = 0; // lines too long or queue full
+static QueueHandle_t xLineQueue = NULL;
+
+/*
+ * Transmit ring buffer. Producers only move tx_head, the DMA transfer
+ * complete interrupt only moves tx_tail. Every producer masks all
+ * interrupts with PRIMASK while it copies, so tasks and interrupts of
+ * any priority may enqueue without overwriting each other.
+ */
+static char tx_buffer[UART_TX_BUFFER_SIZE];
+static volatile uint16_t tx_head = 0;
+static volatile uint16_t tx_tail = 0;
+static volatile uint16_t tx_length = 0; // bytes in flight, 0 when DMA is idle
+static volatile uint32_t tx_dropped = 0;
+
 void uart1_peripheral_init() {
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA, ENABLE);
 	RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
@@ -34,34 +66,656 @@ void uart1_peripheral_init() {
 	USART_Init(USART1, &USART_InitStructure);
 	USART_Cmd(USART1, ENABLE);
 
-	/* enable uart interrupt while receiving char */
-	USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
-	NVIC_EnableIRQ(USART1_IRQn);
+	xLineQueue = xQueueCreate(UART_LINE_QUEUE_LENGTH, MAX_UART_INPUT);
+
+	/* transmit through DMA, memory address and length are set per chunk */
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+
+	DMA_InitTypeDef DMA_InitStructure;
+
+	DMA_Cmd(UART_TX_DMA_STREAM, DISABLE);
+	DMA_DeInit(UART_TX_DMA_STREAM);
+	DMA_InitStructure.DMA_Channel = UART_TX_DMA_CHANNEL;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)tx_buffer;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+	DMA_InitStructure.DMA_BufferSize = 1;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+	DMA_Init(UART_TX_DMA_STREAM, &DMA_InitStructure);
+	DMA_ITConfig(UART_TX_DMA_STREAM, DMA_IT_TC, ENABLE);
+	USART_DMACmd(USART1, USART_DMAReq_Tx, ENABLE);
+
+	/* receive through DMA into the circular buffer, runs forever */
+	DMA_Cmd(UART_RX_DMA_STREAM, DISABLE);
+	DMA_DeInit(UART_RX_DMA_STREAM);
+	DMA_InitStructure.DMA_Channel = UART_RX_DMA_CHANNEL;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&USART1->DR;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)rx_buffer;
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = UART_RX_BUFFER_SIZE;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+	DMA_Init(UART_RX_DMA_STREAM, &DMA_InitStructure);
+	DMA_ITConfig(UART_RX_DMA_STREAM, DMA_IT_HT | DMA_IT_TC, ENABLE);
+	USART_DMACmd(USART1, USART_DMAReq_Rx, ENABLE);
+	DMA_Cmd(UART_RX_DMA_STREAM, ENABLE);
+
+	NVIC_InitTypeDef NVIC_InitStructure;
+
+	NVIC_InitStructure.NVIC_IRQChannel = UART_TX_DMA_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = UART_IRQ_PRIORITY;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	NVIC_InitStructure.NVIC_IRQChannel = UART_RX_DMA_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+
+	/* IDLE line ends a burst of received chars */
+	USART_ITConfig(USART1, USART_IT_IDLE, ENABLE);
+	NVIC_InitStructure.NVIC_IRQChannel = USART1_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+}
+
+/*
+ * Start DMA on the next contiguous part of the ring buffer,
+ * must be called with PRIMASK set
+ */
+static void uart_tx_kick(void) {
+	uint16_t head = tx_head, tail = tx_tail;
+
+	if (tx_length != 0 || head == tail)
+		return;
+
+	tx_length = (head > tail) ? head - tail : UART_TX_BUFFER_SIZE - tail;
+
+	DMA_ClearFlag(UART_TX_DMA_STREAM, UART_TX_DMA_FLAGS);
+	DMA_MemoryTargetConfig(UART_TX_DMA_STREAM, (uint32_t)&tx_buffer[tail], DMA_Memory_0);
+	DMA_SetCurrDataCounter(UART_TX_DMA_STREAM, tx_length);
+	DMA_Cmd(UART_TX_DMA_STREAM, ENABLE);
+}
+
+/*
+ * Copy a binary frame into the ring buffer and start DMA, frames that
+ * do not fit are dropped whole. Must be called with PRIMASK set.
+ */
+static void uart_tx_frame(const uint8_t *data, uint16_t length) {
+	uint16_t head = tx_head;
+	uint16_t free = UART_TX_BUFFER_SIZE - 1 - ((head - tx_tail) & (UART_TX_BUFFER_SIZE - 1));
+
+	if (length > free) {
+		tx_dropped += length;
+		return;
+	}
+	while (length--) {
+		tx_buffer[head] = (char)*data++;
+		head = (head + 1) & (UART_TX_BUFFER_SIZE - 1);
+	}
+	tx_head = head;
+
+	uart_tx_kick();
+}
+
+/*
+ * Copy as much of s as fits into the ring buffer and start DMA,
+ * must be called with PRIMASK set
+ */
+static void uart_tx_write(const char *s) {
+	uint16_t head = tx_head;
+	uint16_t free = UART_TX_BUFFER_SIZE - 1 - ((head - tx_tail) & (UART_TX_BUFFER_SIZE - 1));
+
+	while (*s != '\0' && free != 0) {
+		tx_buffer[head] = *s++;
+		head = (head + 1) & (UART_TX_BUFFER_SIZE - 1);
+		free--;
+	}
+	tx_head = head;
+
+	/* count what did not fit */
+	while (*s++ != '\0')
+		tx_dropped++;
+
+	uart_tx_kick();
+}
+
+static void uart_tx_byte(char c) {
+	while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET)
+		;
+	USART_SendData(USART1, (uint8_t)c);
+}
+
+/*
+ * Send what is queued and then s by polling. Until the scheduler starts
+ * the TC interrupt that refills DMA stays masked, so DMA would stop after
+ * the first chunk. Must be called with PRIMASK set.
+ */
+static void uart_tx_blocking(const char *s) {
+	if (tx_length != 0) {
+		while (DMA_GetFlagStatus(UART_TX_DMA_STREAM, UART_TX_DMA_FLAG_TC) == RESET)
+			;
+		DMA_ClearFlag(UART_TX_DMA_STREAM, UART_TX_DMA_FLAGS);
+		tx_tail = (tx_tail + tx_length) & (UART_TX_BUFFER_SIZE - 1);
+		tx_length = 0;
+	}
+	while (tx_tail != tx_head) {
+		uart_tx_byte(tx_buffer[tx_tail]);
+		tx_tail = (tx_tail + 1) & (UART_TX_BUFFER_SIZE - 1);
+	}
+	while (*s != '\0')
+		uart_tx_byte(*s++);
+}
+
+void DMA2_Stream7_IRQHandler(void) {
+	if (DMA_GetITStatus(UART_TX_DMA_STREAM, UART_TX_DMA_IT_TC)) {
+		DMA_ClearITPendingBit(UART_TX_DMA_STREAM, UART_TX_DMA_IT_TC);
+
+		/* release sent bytes and continue with the rest */
+		tx_tail = (tx_tail + tx_length) & (UART_TX_BUFFER_SIZE - 1);
+		tx_length = 0;
+		uart_tx_kick();
+	}
+}
+
+/*
+ * Split what DMA received since the last call into lines and queue
+ * them for the command task, called from the RX interrupts only
+ */
+static void uart_rx_process(void) {
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	uint16_t pos = (UART_RX_BUFFER_SIZE - DMA_GetCurrDataCounter(UART_RX_DMA_STREAM))
+			& (UART_RX_BUFFER_SIZE - 1);
+
+	while (rx_read != pos) {
+		char c = rx_buffer[rx_read];
+		rx_read = (rx_read + 1) & (UART_RX_BUFFER_SIZE - 1);
+
+		if (c == '\r' || c == '\n') {
+			if (rx_overflow) {
+				rx_dropped++;
+			} else if (buffer_index > 0) {
+				buffer[buffer_index] = '\0';
+				if (xQueueSendFromISR(xLineQueue, buffer, &xHigherPriorityTaskWoken) != pdTRUE)
+					rx_dropped++;
+			}
+			buffer_index = 0;
+			rx_overflow = 0;
+		} else if (buffer_index < MAX_UART_INPUT - 1) {
+			buffer[buffer_index++] = c;
+		} else {
+			rx_overflow = 1;
+		}
+	}
+
+	portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
 }
 
 void USART1_IRQHandler() {
-	/*
-	 * read a line from uart1
-	 */
-	USART1_ReadLine();
+	if (USART_GetITStatus(USART1, USART_IT_IDLE) != RESET) {
+		/* cleared by reading SR then DR */
+		USART_ReceiveData(USART1);
+		uart_rx_process();
+	}
 }
 
-void USART1_puts(char* s) {
-    while(*s != '\0') {
-        while(USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET);
-        USART_SendData(USART1, *s);
-        s++;
-    }
-}
-
-void USART1_ReadLine() {
-	while (USART_GetFlagStatus(USART1, USART_FLAG_RXNE) == RESET);
-	char c = USART_ReceiveData(USART1);
-	if (c == '\r' || c == '\n') {
-		buffer[buffer_index] = '\0';
-		USART1_puts(buffer);
-		buffer_index = 0;
+void DMA2_Stream5_IRQHandler(void) {
+	if (DMA_GetITStatus(UART_RX_DMA_STREAM, UART_RX_DMA_IT_HT)) {
+		DMA_ClearITPendingBit(UART_RX_DMA_STREAM, UART_RX_DMA_IT_HT);
+		uart_rx_process();
+	}
+	if (DMA_GetITStatus(UART_RX_DMA_STREAM, UART_RX_DMA_IT_TC)) {
+		DMA_ClearITPendingBit(UART_RX_DMA_STREAM, UART_RX_DMA_IT_TC);
+		uart_rx_process();
+	}
+}
+
+/* Argument of "name value" lines, NULL if str is not that command */
+static char *command_arg(char *str, const char *name) {
+	while (*name != '\0')
+		if (*str++ != *name++)
+			return NULL;
+	if (*str != ' ')
+		return NULL;
+	while (*str == ' ')
+		str++;
+	return str;
+}
+
+/* Ends arg at the next space, returns the argument after it or NULL */
+static char *command_split(char *arg) {
+	while (*arg != ' ' && *arg != '\0')
+		arg++;
+	if (*arg == '\0')
+		return NULL;
+	*arg++ = '\0';
+	while (*arg == ' ')
+		arg++;
+	return arg;
+}
+
+/* Lines without argument */
+static uint8_t command_is(char *str, const char *name) {
+	while (*name != '\0')
+		if (*str++ != *name++)
+			return 0;
+	return *str == '\0';
+}
+
+static TM_MPU6050_Result_t command_range(char *arg, const uint16_t *ranges, uint8_t *index) {
+	uint16_t value = shell_atoi(arg);
+
+	for (*index = 0; *index < 4; (*index)++)
+		if (ranges[*index] == value)
+			return TM_MPU6050_Result_Ok;
+	return TM_MPU6050_Result_Invalid;
+}
+
+/* Apply a setting line to one sensor, returns 0 if it is not a setting */
+static uint8_t command_sensor(TM_MPU6050_t *sensor, char *str, TM_MPU6050_Result_t *result) {
+	static const uint16_t acce_ranges[4] = { 2, 4, 8, 16 };
+	static const uint16_t gyro_ranges[4] = { 250, 500, 1000, 2000 };
+	uint8_t index;
+	char *arg;
+
+	if ((arg = command_arg(str, "rate")) != NULL) {
+		*result = MPU6050_SetDataRate(sensor, shell_atoi(arg));
+	} else if ((arg = command_arg(str, "dlpf")) != NULL) {
+		*result = MPU6050_SetDLPF(sensor, (TM_MPU6050_DLPF_t)shell_atoi(arg));
+	} else if ((arg = command_arg(str, "accel")) != NULL) {
+		*result = command_range(arg, acce_ranges, &index);
+		if (*result == TM_MPU6050_Result_Ok)
+			*result = MPU6050_SetAccelerometer(sensor, (TM_MPU6050_Accelerometer_t)index);
+	} else if ((arg = command_arg(str, "gyro")) != NULL) {
+		*result = command_range(arg, gyro_ranges, &index);
+		if (*result == TM_MPU6050_Result_Ok)
+			*result = MPU6050_SetGyroscope(sensor, (TM_MPU6050_Gyroscope_t)index);
+	} else if ((arg = command_arg(str, "autorange")) != NULL) {
+		*result = MPU6050_SetAutoRange(sensor, shell_atoi(arg));
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* Print " label value" */
+static void command_value(const char *label, uint32_t value) {
+	char out[12];
+
+	USART1_puts(" ");
+	USART1_puts((char *)label);
+	USART1_puts(" ");
+	shell_utoa(value, out);
+	USART1_puts(out);
+}
+
+#ifdef MPU6050_L3GD20_FUSION
+static void command_signed(const char *label, int32_t value) {
+	char out[12];
+
+	USART1_puts(" ");
+	USART1_puts((char *)label);
+	USART1_puts(value < 0 ? " -" : " ");
+	shell_utoa(value < 0 ? -value : value, out);
+	USART1_puts(out);
+}
+#endif
+
+static void command_recovery(uint32_t errors, uint32_t recoveries, uint32_t time, uint32_t time_max) {
+	command_value("errors", errors);
+	command_value("recoveries", recoveries);
+	command_value("last_us", time);
+	command_value("max_us", time_max);
+}
+
+/* Error and recovery counters of the I2C buses and sensors, USART1 drops */
+static void command_i2c(void) {
+	static I2C_TypeDef* const buses[] = { I2C1, I2C3 };
+	static const char* const names[] = { "\r\nI2C1", "\r\nI2C3" };
+	I2C_Stats_t stats;
+	TM_MPU6050_t *sensor;
+	uint8_t i;
+
+	for (i = 0; i < 2; i++) {
+		if (!I2C_GetStats(buses[i], &stats))
+			continue;
+		USART1_puts((char *)names[i]);
+		command_value("transactions", stats.Transactions);
+		command_recovery(stats.Errors, stats.Recoveries, stats.RecoveryTime, stats.RecoveryTimeMax);
+	}
+	for (i = 0; (sensor = MPU6050_GetDevice(i)) != NULL; i++) {
+		USART1_puts("\r\nMPU6050");
+		command_value("address", sensor->Address);
+		command_recovery(sensor->Errors, sensor->Recoveries, sensor->RecoveryTime, sensor->RecoveryTimeMax);
+	}
+	USART1_puts("\r\nUSART1");
+	command_value("tx_dropped", USART1_GetDropped());
+	command_value("rx_dropped", USART1_GetRxDropped());
+}
+
+/* Samples taken in each range and how often the ranges switched */
+static void command_ranges(void) {
+	static const char* const acce_names[4] = { "2g", "4g", "8g", "16g" };
+	static const char* const gyro_names[4] = { "250dps", "500dps", "1000dps", "2000dps" };
+	TM_MPU6050_t *sensor;
+	uint8_t i, r;
+
+	for (i = 0; (sensor = MPU6050_GetDevice(i)) != NULL; i++) {
+		USART1_puts("\r\nMPU6050");
+		command_value("address", sensor->Address);
+		command_value("auto", sensor->AutoRange);
+		for (r = 0; r < 4; r++)
+			command_value(acce_names[r], sensor->Acce_RangeCount[r]);
+		for (r = 0; r < 4; r++)
+			command_value(gyro_names[r], sensor->Gyro_RangeCount[r]);
+		command_value("saturated", sensor->Saturations);
+		command_value("switches", sensor->RangeSwitches);
+	}
+}
+
+#ifdef MPU6050_L3GD20_FUSION
+/* L3GD20 reads and how it is fused, bias in millidegrees/s */
+static void command_l3gd20(void) {
+	TM_MPU6050_t *primary = MPU6050_GetDevice(0);
+	L3GD20_Stats_t gyro;
+	fusion_stats_t stats;
+	uint8_t i;
+
+	L3GD20_Gyro_GetStats(&gyro);
+	fusion_get_stats(&stats);
+	USART1_puts("\r\nL3GD20");
+	command_value("frames", gyro.Frames);
+	command_value("overruns", gyro.Overruns);
+	command_value("errors", gyro.Errors);
+	command_value("period_us", gyro.Period);
+	USART1_puts("\r\nfusion");
+	command_value("fused", stats.fused);
+	command_value("stale", stats.stale);
+	command_value("disagreements", stats.disagreements);
+	command_value("weight", (uint32_t)stats.weight * 1000 >> 15);
+	for (i = 0; i < 3 && primary != NULL; i++)
+		command_signed("bias", (int32_t)lrintf(stats.bias[i] / 256.0f * primary->Gyro_Mult * 1000));
+}
+#endif
+
+/* Recorded motion gestures and how matching went */
+static void command_templates(void) {
+	const dtw_template_t *templates = dtw_get_templates();
+	dtw_stats_t stats;
+	uint8_t i;
+
+	for (i = 0; i < DTW_TEMPLATES; i++) {
+		if (templates[i].command == GESTURE_NONE)
+			continue;
+		USART1_puts("\r\ntemplate");
+		command_value("slot", i);
+		command_value("frames", templates[i].length);
+		USART1_puts(" ");
+		USART1_puts((char *)gesture_name(templates[i].command));
+	}
+	dtw_get_stats(&stats);
+	USART1_puts("\r\ndtw");
+	command_value("matches", stats.matches);
+	command_value("compared", stats.compared);
+	command_value("abandoned", stats.abandoned);
+	command_value("cells_max", stats.cells_max);
+}
+
+/* Confirmation times per command and how confirmation went */
+static void command_gestures(void) {
+	const gesture_confirm_t *confirm = gesture_get_confirm();
+	gesture_stats_t stats;
+	uint8_t i;
+
+	for (i = GESTURE_RIGHT; i <= GESTURE_SUSPEND; i++) {
+		USART1_puts("\r\n");
+		USART1_puts((char *)gesture_name(i));
+		command_value("dwell_ms", confirm[i].dwell_ms);
+		command_value("release_ms", confirm[i].release_ms);
+	}
+	gesture_get_stats(&stats);
+	USART1_puts("\r\nconfirm");
+	command_value("fired", stats.fired);
+	command_value("immediate", stats.immediate);
+	command_value("rejected", stats.rejected);
+	command_value("latency_ms", stats.latency_us / 1000);
+	command_value("latency_max_ms", stats.latency_max_us / 1000);
+}
+
+/* confirm <command> <dwell_ms> <release_ms> */
+static uint8_t command_confirm(char *str, TM_MPU6050_Result_t *result) {
+	char *arg, *dwell, *release;
+	uint16_t command;
+
+	if ((arg = command_arg(str, "confirm")) == NULL)
+		return 0;
+	*result = TM_MPU6050_Result_Invalid;
+	if ((dwell = command_split(arg)) == NULL || (release = command_split(dwell)) == NULL)
+		return 1;
+	command_split(release);
+	command = shell_atoi(arg);
+	if (command > GESTURE_NONE && command <= GESTURE_SUSPEND) {
+		gesture_set_confirm(command, shell_atoi(dwell), shell_atoi(release));
+		*result = TM_MPU6050_Result_Ok;
+	}
+	return 1;
+}
+
+/* Curve of each proportional control axis */
+static void command_curves(void) {
+	static const char* const names[CONTROL_AXES] = { "\r\nroll", "\r\npitch", "\r\nyaw" };
+	const control_axis_t *axes = control_get_axes();
+	uint8_t i;
+
+	for (i = 0; i < CONTROL_AXES; i++) {
+		USART1_puts((char *)names[i]);
+		command_value("deadband", axes[i].deadband);
+		command_value("range", axes[i].range);
+		command_value("expo", axes[i].expo);
+	}
+}
+
+/* control <0|1>, protocol <0|1> and curve <axis> <deadband> <range> <expo> */
+static uint8_t command_control(char *str, TM_MPU6050_Result_t *result) {
+	char *arg, *deadband, *range, *expo;
+	uint16_t enable, axis;
+
+	if ((arg = command_arg(str, "control")) != NULL) {
+		enable = shell_atoi(arg);
+		*result = (enable <= 1) ? TM_MPU6050_Result_Ok : TM_MPU6050_Result_Invalid;
+		if (*result == TM_MPU6050_Result_Ok)
+			control_enable(enable);
+		return 1;
+	}
+	if ((arg = command_arg(str, "protocol")) != NULL) {
+		enable = shell_atoi(arg);
+		*result = (enable <= 1) ? TM_MPU6050_Result_Ok : TM_MPU6050_Result_Invalid;
+		if (*result == TM_MPU6050_Result_Ok)
+			protocol_enable(enable);
+		return 1;
+	}
+	if ((arg = command_arg(str, "curve")) == NULL)
+		return 0;
+	*result = TM_MPU6050_Result_Invalid;
+	if ((deadband = command_split(arg)) == NULL || (range = command_split(deadband)) == NULL
+			|| (expo = command_split(range)) == NULL)
+		return 1;
+	command_split(expo);
+	axis = shell_atoi(arg);
+	if (axis < CONTROL_AXES && shell_atoi(deadband) < shell_atoi(range) && shell_atoi(expo) <= 100) {
+		control_set_axis(axis, shell_atoi(deadband), shell_atoi(range), shell_atoi(expo));
+		*result = TM_MPU6050_Result_Ok;
+	}
+	return 1;
+}
+
+/* Template requests, carried out by the sensor task */
+static uint8_t command_template(char *str, TM_MPU6050_Result_t *result) {
+	uint16_t value;
+	char *arg;
+
+	if ((arg = command_arg(str, "record")) != NULL) {
+		value = shell_atoi(arg);
+		*result = (value > GESTURE_NONE && value <= GESTURE_SUSPEND)
+				? TM_MPU6050_Result_Ok : TM_MPU6050_Result_Invalid;
+		if (*result == TM_MPU6050_Result_Ok)
+			dtw_record(value);
+	} else if ((arg = command_arg(str, "forget")) != NULL) {
+		value = shell_atoi(arg);
+		*result = (value < DTW_TEMPLATES && dtw_get_templates()[value].command != GESTURE_NONE)
+				? TM_MPU6050_Result_Ok : TM_MPU6050_Result_Invalid;
+		if (*result == TM_MPU6050_Result_Ok)
+			dtw_forget(value);
 	} else {
-		buffer[buffer_index++] = c;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Sensor settings, applied to every sensor without re-initializing it:
+ *   rate <4..1000>        sample rate in Hz, 31 and more with dlpf 0
+ *   dlpf <0..6>           low-pass filter, 0 off (260Hz) to 6 (5Hz)
+ *   accel <2|4|8|16>      accelerometer range in g
+ *   gyro <250|...|2000>   gyroscope range in degrees/s
+ *   autorange <0..3>      automatic range switching, 1 accelerometer, 2 gyroscope, 3 both
+ * Setting a range turns automatic switching off for it. "ranges" prints
+ * samples per range, clipped samples and range switches.
+ * "i2c" prints bus and sensor error counters and recovery times, then the
+ * bytes USART1 dropped from a full ring and the lines it dropped on receive.
+ * "calibrate" measures the bias of the primary sensor again, keep it still.
+ * Motion gestures:
+ *   record <1..6>         record the next motion as a template for that command
+ *   forget <slot>         delete a template, empty slots are invalid
+ * "templates" lists them with the matching counters.
+ * Confirmation of tilt gestures:
+ *   confirm <1..6> <dwell_ms> <release_ms>
+ * "gestures" prints the times with the confirmation counters and latency.
+ * Binary frames (protocol.h):
+ *   protocol <0|1>        send gestures as frames instead of names
+ *   control <0|1>         stream setpoint frames instead of gestures
+ *   curve <0..2> <deadband> <range> <expo>
+ *                         roll, pitch or yaw curve, 0.1 degrees (/s) and percent
+ * "curves" prints them.
+ * With MPU6050_L3GD20_FUSION "l3gd20" prints L3GD20 reads, the weight
+ * it gets in permille and its bias.
+ * Other lines are echoed back.
+ */
+void command_detect(char *str) {
+	TM_MPU6050_Result_t result = TM_MPU6050_Result_Ok;
+	TM_MPU6050_t *sensor;
+	uint8_t i, known = 0;
+
+	if (command_is(str, "i2c")) {
+		command_i2c();
+		return;
+	}
+	if (command_is(str, "templates")) {
+		command_templates();
+		return;
+	}
+	if (command_is(str, "gestures")) {
+		command_gestures();
+		return;
+	}
+	if (command_is(str, "curves")) {
+		command_curves();
+		return;
 	}
+	if (command_template(str, &result) || command_confirm(str, &result)
+			|| command_control(str, &result)) {
+		USART1_puts(result == TM_MPU6050_Result_Ok ? "\r\nok" : "\r\ninvalid");
+		return;
+	}
+	if (command_is(str, "ranges")) {
+		command_ranges();
+		return;
+	}
+#ifdef MPU6050_L3GD20_FUSION
+	if (command_is(str, "l3gd20")) {
+		command_l3gd20();
+		return;
+	}
+#endif
+	if (command_is(str, "calibrate")) {
+		result = MPU6050_Calibrate(MPU6050_GetDevice(0));
+		USART1_puts(result == TM_MPU6050_Result_Ok ? "\r\nok" : "\r\ninvalid");
+		return;
+	}
+
+	for (i = 0; (sensor = MPU6050_GetDevice(i)) != NULL; i++) {
+		known = command_sensor(sensor, str, &result);
+		if (!known || result != TM_MPU6050_Result_Ok)
+			break;
+	}
+
+	if (!known) {
+		/* echo the line back */
+		USART1_puts("\r\n");
+		USART1_puts(str);
+		return;
+	}
+
+	USART1_puts(result == TM_MPU6050_Result_Ok ? "\r\nok" : "\r\ninvalid");
+}
+
+void CommandTask(void) {
+	char line[MAX_UART_INPUT];
+
+	while (1) {
+		if (xQueueReceive(xLineQueue, line, portMAX_DELAY) == pdTRUE)
+			command_detect(line);
+	}
+}
+
+uint8_t Command_Task_Creat() {
+	BaseType_t ret = xTaskCreate(CommandTask,
+			"Command",
+			256,
+			(void * ) NULL,
+			tskIDLE_PRIORITY + 2,
+			NULL);
+	if (ret != pdPASS)
+		return 0;
+	return 1;
+}
+
+/*
+ * Safe from tasks and interrupts of any priority. PRIMASK rather than a
+ * critical section, which leaves priorities above
+ * configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY running.
+ */
+void USART1_puts(char* s) {
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	/* before the scheduler runs, critical sections stay masked until it starts */
+	if (xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED)
+		uart_tx_blocking(s);
+	else
+		uart_tx_write(s);
+	__set_PRIMASK(primask);
+}
+
+void USART1_write(const uint8_t *data, uint16_t length) {
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	uart_tx_frame(data, length);
+	__set_PRIMASK(primask);
+}
+
+uint32_t USART1_GetDropped() {
+	return tx_dropped;
+}
+
+uint32_t USART1_GetRxDropped() {
+	return rx_dropped;
 }
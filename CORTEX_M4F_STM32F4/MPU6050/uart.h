@@ -3,16 +3,55 @@
 
 #define MAX_UART_INPUT 50
 
+/* Transmit ring buffer, must be a power of 2 */
+#define UART_TX_BUFFER_SIZE 512
+
+/*
+ * USART1 TX is routed to DMA2 stream 7, channel 4.
+ * Lower priority than the sensor interrupts, the TC interrupt only
+ * refills the DMA from the ring buffer.
+ */
+#define UART_TX_DMA_STREAM		DMA2_Stream7
+#define UART_TX_DMA_CHANNEL		DMA_Channel_4
+#define UART_TX_DMA_IRQn		DMA2_Stream7_IRQn
+#define UART_TX_DMA_IT_TC		DMA_IT_TCIF7
+#define UART_TX_DMA_FLAG_TC		DMA_FLAG_TCIF7
+#define UART_TX_DMA_FLAGS		(DMA_FLAG_TCIF7 | DMA_FLAG_HTIF7 | DMA_FLAG_TEIF7 | DMA_FLAG_DMEIF7 | DMA_FLAG_FEIF7)
+#define UART_IRQ_PRIORITY		9
+
+/*
+ * USART1 RX is received by DMA2 stream 5, channel 4 into a circular
+ * buffer. Half transfer, transfer complete and IDLE line interrupts
+ * split it into lines, so one interrupt never handles more than half
+ * of the buffer.
+ */
+#define UART_RX_BUFFER_SIZE 256 // must be a power of 2
+#define UART_RX_DMA_STREAM		DMA2_Stream5
+#define UART_RX_DMA_CHANNEL		DMA_Channel_4
+#define UART_RX_DMA_IRQn		DMA2_Stream5_IRQn
+#define UART_RX_DMA_IT_HT		DMA_IT_HTIF5
+#define UART_RX_DMA_IT_TC		DMA_IT_TCIF5
+
+/* Completed lines waiting for the command task */
+#define UART_LINE_QUEUE_LENGTH 4
+
 #include "misc.h"
 #include "stm32f4xx_gpio.h"
 #include "stm32f4xx_rcc.h"
 #include "stm32f4xx_usart.h"
+#include "stm32f4xx_dma.h"
 
 void uart1_peripheral_init();
 
 //void USART1_IRQHandler();
+void DMA2_Stream7_IRQHandler(void);
+void DMA2_Stream5_IRQHandler(void);
+void CommandTask(void);
+uint8_t Command_Task_Creat();
 void command_detect(char *str);
 void USART1_puts(char* s);
-void USART1_ReadLine();
+void USART1_write(const uint8_t *data, uint16_t length);
+uint32_t USART1_GetDropped(); // bytes that did not fit the ring
+uint32_t USART1_GetRxDropped(); // received lines too long or not queued
 
 #endif
@@ -30,23 +30,47 @@
 #include "MPU6050/uart.h"
 #include "MPU6050/mpu6050.h"
 
+#ifdef BENCH
+#include "bench.h"
+#endif
+
 #include "FreeRTOS.h"
 #include "task.h"
 //#include "semphr.h"
 
 //#include "stm32f4xx_conf.h"
 
+static TM_MPU6050_t MPU6050_Sensor;
+#ifdef MPU6050_SECOND_SENSOR
+static TM_MPU6050_t MPU6050_SecondSensor;
+#endif
+
 int main(void)
 {
+	/* FreeRTOS expects all priority bits to be preempt priority bits */
+	NVIC_PriorityGroupConfig(NVIC_PriorityGroup_4);
+
 	uart1_peripheral_init();
 	user_button_Interrupts_Configure();
 
+#ifdef BENCH
+	bench_run(USART1_puts);
+#endif
+
 	/* Initialize MPU6050 sensor 0, address = 0xD0, AD0 pin on sensor is low */
-	while (MPU6050_Init(TM_MPU6050_Accelerometer_4G, TM_MPU6050_Gyroscope_250s)
-			!= TM_MPU6050_Result_Ok) {
+	while (MPU6050_Init(&MPU6050_Sensor, MPU6050_I2C, TM_MPU6050_Device_0,
+			TM_MPU6050_Accelerometer_4G, TM_MPU6050_Gyroscope_250s) != TM_MPU6050_Result_Ok) {
 		/* Display message to user */
 		USART1_puts("\r\nRemote is NOT READY! PLEASE Checkout.");
 	}
+
+#ifdef MPU6050_SECOND_SENSOR
+	/* Remote still works with one hand if the second sensor is missing */
+	if (MPU6050_Init(&MPU6050_SecondSensor, MPU6050_SECOND_I2C, MPU6050_SECOND_DEVICE,
+			TM_MPU6050_Accelerometer_4G, TM_MPU6050_Gyroscope_250s) != TM_MPU6050_Result_Ok) {
+		USART1_puts("\r\nSecond sensor is NOT READY!");
+	}
+#endif
 	
 	USART1_puts("\r\nRemote is ready to use!");
 
@@ -54,5 +78,9 @@ int main(void)
 		USART1_puts("Initialize information task failed!\r\n");
 	}
 
+	if (!Command_Task_Creat()) {
+		USART1_puts("Initialize command task failed!\r\n");
+	}
+
 	vTaskStartScheduler();
 }
@@ -0,0 +1,302 @@
+#ifndef STM32F429_439xx
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "bench.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "MPU6050/kalman.h"
+#include "MPU6050/mahony.h"
+#include "MPU6050/mahony_q.h"
+#include "MPU6050/gesture.h"
+#include "MPU6050/filter.h"
+#include "MPU6050/fusion.h"
+#include "MPU6050/dtw.h"
+#include "MPU6050/classifier.h"
+#include "MPU6050/control.h"
+#include "MPU6050/protocol.h"
+#include "MPU6050/shell.h"
+
+#ifdef STM32F429_439xx
+#include "stm32f4xx.h"
+
+#define BENCH_UNIT "cycles"
+
+static void bench_timer_init(void) {
+	/* Enable DWT cycle counter */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static uint32_t bench_now(void) {
+	return DWT->CYCCNT;
+}
+#else
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_UNIT "ns"
+
+static void bench_timer_init(void) {
+}
+
+static uint32_t bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+#define BENCH_INPUTS 16
+
+typedef struct {
+	const char *name;
+	void (*fn)(uint32_t i);
+} bench_t;
+
+static float inputs[BENCH_INPUTS];
+static int16_t raw_inputs[BENCH_INPUTS];
+static uint8_t raw_bytes[14];
+static int16_t filter_samples[FILTER_BLOCK_SIZE * FILTER_CHANNELS];
+static dtw_template_t dtw_templates[DTW_TEMPLATES];
+static Kalman kalman;
+static Mahony mahony;
+static MahonyQ mahony_q;
+
+/* Results go here so calls are not optimized away */
+static volatile float sink_f;
+static volatile int16_t sink_i;
+static char sink_str[16];
+
+static void bench_empty(uint32_t i) {
+	sink_i = (int16_t)i;
+}
+
+static void bench_getAngle(uint32_t i) {
+	sink_f = getAngle(&kalman, inputs[i % BENCH_INPUTS], inputs[(i + 5) % BENCH_INPUTS], 0.01f);
+}
+
+static void bench_updateMahony(uint32_t i) {
+	updateMahony(&mahony, inputs[i % BENCH_INPUTS] * 0.01f, inputs[(i + 3) % BENCH_INPUTS] * 0.01f,
+			inputs[(i + 7) % BENCH_INPUTS] * 0.01f, raw_inputs[i % BENCH_INPUTS],
+			raw_inputs[(i + 5) % BENCH_INPUTS], -8192, 0.01f);
+	sink_f = mahony.q0;
+}
+
+/* Same inputs as bench_updateMahony, rates in Q16 */
+static void bench_updateMahonyQ(uint32_t i) {
+	updateMahonyQ(&mahony_q, (int32_t)(inputs[i % BENCH_INPUTS] * 655.36f),
+			(int32_t)(inputs[(i + 3) % BENCH_INPUTS] * 655.36f),
+			(int32_t)(inputs[(i + 7) % BENCH_INPUTS] * 655.36f), raw_inputs[i % BENCH_INPUTS],
+			raw_inputs[(i + 5) % BENCH_INPUTS], -8192, 10000);
+	sink_i = (int16_t)mahony_q.q0;
+}
+
+static void bench_sqrt1(uint32_t i) {
+	sink_f = sqrt1(inputs[i % BENCH_INPUTS] * inputs[i % BENCH_INPUTS] + 1.0f);
+}
+
+static void bench_atan1(uint32_t i) {
+	sink_f = atan1(inputs[i % BENCH_INPUTS]);
+}
+
+static void bench_shell_float2str(uint32_t i) {
+	shell_float2str(inputs[i % BENCH_INPUTS], sink_str);
+}
+
+static void bench_shell_itoa(uint32_t i) {
+	shell_itoa(raw_inputs[i % BENCH_INPUTS], sink_str);
+}
+
+static void bench_unpack(uint32_t i) {
+	int16_t raw[7];
+
+	raw_bytes[0] = (uint8_t)i;
+	shell_unpack16(raw_bytes, raw, 7);
+	sink_i = raw[0] + raw[6];
+}
+
+static void bench_gesture_sample(uint32_t i) {
+	gesture_fuse(raw_inputs[i % BENCH_INPUTS], raw_inputs[(i + 5) % BENCH_INPUTS], -8192,
+			raw_inputs[(i + 3) % BENCH_INPUTS] / 16, raw_inputs[(i + 7) % BENCH_INPUTS] / 16,
+			raw_inputs[(i + 9) % BENCH_INPUTS] / 16, 1.0f / 131, i * 10000);
+	sink_i = gesture_classify();
+}
+
+/* One sample of all six channels, as read in interrupt mode */
+static void bench_filter_sample(uint32_t i) {
+	int16_t sample[FILTER_CHANNELS];
+	uint8_t ch;
+
+	for (ch = 0; ch < FILTER_CHANNELS; ch++)
+		sample[ch] = raw_inputs[(i + ch) % BENCH_INPUTS];
+	filter_block(sample, 1);
+	sink_i = sample[0];
+}
+
+/* A full FIFO burst, per_call divided by FILTER_BLOCK_SIZE is per sample */
+static void bench_filter_block(uint32_t i) {
+	filter_samples[0] = raw_inputs[i % BENCH_INPUTS];
+	filter_block(filter_samples, FILTER_BLOCK_SIZE);
+	sink_i = filter_samples[0];
+}
+
+/* Second gyroscope at twice the rate, slow turns so it is fused after settling */
+static void bench_fusion_sample(uint32_t i) {
+	int16_t gyro[3];
+	uint8_t ch;
+
+	for (ch = 0; ch < 3; ch++)
+		gyro[ch] = raw_inputs[(i + ch) % BENCH_INPUTS] / 256;
+	fusion_push(gyro, i * 10000 - 5000);
+	fusion_push(gyro, i * 10000);
+	sink_i = fusion_apply(gyro, i * 10000 - 2000);
+}
+
+/*
+ * Full template slots that never give up early at 200Hz, the most a
+ * sample can cost. cells_max of the "templates" command counts the same.
+ */
+static void bench_dtw_sample(uint32_t i) {
+	int16_t gyro[3] = { raw_inputs[i % BENCH_INPUTS] / 64, raw_inputs[(i + 3) % BENCH_INPUTS] / 64, 0 };
+
+	sink_i = dtw_push(gyro, 1.0f / 131);
+}
+
+/* One window through the decision tree, features spread over all branches */
+static void bench_classifier_predict(uint32_t i) {
+	int8_t features[CLASSIFIER_FEATURES];
+	uint8_t f;
+
+	for (f = 0; f < CLASSIFIER_FEATURES; f++)
+		features[f] = (int8_t)(raw_inputs[(i + f) % BENCH_INPUTS] >> 7);
+	sink_i = classifier_predict(features);
+}
+
+/* Curves of all three axes and the frame, once per CONTROL_RATE */
+static void bench_control_frame(uint32_t i) {
+	static const control_axis_t axis = { 30, 350, 30 };
+	int16_t setpoints[CONTROL_AXES];
+	uint8_t payload[CONTROL_PAYLOAD_SIZE];
+	uint8_t frame[PROTOCOL_MAX_FRAME];
+	uint8_t a;
+
+	for (a = 0; a < CONTROL_AXES; a++)
+		setpoints[a] = control_curve(&axis, raw_inputs[(i + a) % BENCH_INPUTS] / 16);
+	sink_i = protocol_frame(PROTOCOL_CONTROL, i * 20000, payload, control_pack(setpoints, payload), frame);
+}
+
+/* A gesture command frame, CRC by the peripheral on the remote */
+static void bench_protocol_gesture(uint32_t i) {
+	uint8_t command = (uint8_t)(i % GESTURE_SUSPEND) + 1;
+	uint8_t frame[PROTOCOL_MAX_FRAME];
+
+	sink_i = protocol_frame(PROTOCOL_GESTURE, i * 10000, &command, 1, frame) + frame[2];
+}
+
+static const bench_t benches[] = {
+	{ "empty", bench_empty },
+	{ "getAngle", bench_getAngle },
+	{ "updateMahony", bench_updateMahony },
+	{ "updateMahonyQ", bench_updateMahonyQ },
+	{ "sqrt1", bench_sqrt1 },
+	{ "atan1", bench_atan1 },
+	{ "shell_float2str", bench_shell_float2str },
+	{ "shell_itoa", bench_shell_itoa },
+	{ "unpack_acc_gyo", bench_unpack },
+	{ "gesture_sample", bench_gesture_sample },
+	{ "filter_sample", bench_filter_sample },
+	{ "filter_block", bench_filter_block },
+	{ "fusion_sample", bench_fusion_sample },
+	{ "dtw_sample", bench_dtw_sample },
+	{ "classifier_predict", bench_classifier_predict },
+	{ "control_frame", bench_control_frame },
+	{ "protocol_gesture", bench_protocol_gesture },
+};
+
+static char *append(char *dst, const char *src) {
+	while (*src != '\0')
+		*dst++ = *src++;
+	*dst = '\0';
+	return dst;
+}
+
+static char *append_u32(char *dst, uint32_t n) {
+	shell_utoa(n, dst);
+	return dst + s_strlen(dst);
+}
+
+void bench_run(void (*puts_fn)(char *)) {
+	char line[128];
+	uint32_t i, b;
+
+	bench_timer_init();
+
+	/* Deterministic inputs around the ranges seen by the remote */
+	for (i = 0; i < BENCH_INPUTS; i++) {
+		inputs[i] = (float)i * 13.7f - 100.0f;
+		raw_inputs[i] = (int16_t)(i * 1021 - 8000);
+	}
+	for (i = 0; i < sizeof(raw_bytes); i++)
+		raw_bytes[i] = (uint8_t)(i * 37);
+	for (i = 0; i < FILTER_BLOCK_SIZE * FILTER_CHANNELS; i++)
+		filter_samples[i] = raw_inputs[i % BENCH_INPUTS];
+	initKalman(&kalman);
+	initMahony(&mahony);
+	initMahonyQ(&mahony_q);
+	gesture_init(100, 0, 0, -8192, 0);
+	filter_init(100);
+	fusion_init();
+	fusion_set_scale(1.0f / 131, 0.07f);
+	for (i = 0; i < DTW_TEMPLATES; i++) {
+		dtw_templates[i].command = GESTURE_UP;
+		dtw_templates[i].length = DTW_MAX_LENGTH;
+		dtw_templates[i].threshold = 0xFFFF;
+	}
+	dtw_set_templates(dtw_templates);
+	dtw_init(200);
+	protocol_init();
+
+	for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+		uint32_t start, total;
+		char *p = line;
+
+		start = bench_now();
+		for (i = 0; i < BENCH_ITERATIONS; i++)
+			benches[b].fn(i);
+		total = bench_now() - start;
+
+		p = append(p, "{\"bench\":\"");
+		p = append(p, benches[b].name);
+		p = append(p, "\",\"unit\":\"" BENCH_UNIT "\",\"iterations\":");
+		p = append_u32(p, BENCH_ITERATIONS);
+		p = append(p, ",\"total\":");
+		p = append_u32(p, total);
+		p = append(p, ",\"per_call\":");
+		p = append_u32(p, total / BENCH_ITERATIONS);
+		p = append(p, "}\r\n");
+		puts_fn(line);
+	}
+}
+
+#ifndef STM32F429_439xx
+static void bench_puts(char *s) {
+	/* Host output uses plain newlines */
+	size_t n = strlen(s);
+
+	if (n >= 2 && s[n - 2] == '\r') {
+		s[n - 2] = '\n';
+		s[n - 1] = '\0';
+	}
+	fputs(s, stdout);
+}
+
+int main(void) {
+	bench_run(bench_puts);
+	return 0;
+}
+#endif
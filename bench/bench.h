@@ -0,0 +1,14 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/*
+ * Micro-benchmarks of the sensor-fusion and formatting hot paths.
+ * Cycles from DWT->CYCCNT on the remote, nanoseconds from clock_gettime
+ * on the host. Results are written through puts_fn as JSON lines.
+ */
+
+#define BENCH_ITERATIONS 10000
+
+void bench_run(void (*puts_fn)(char *));
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ * Host simulation of the gesture pipeline.
+ *
+ * Replays a raw sample trace recorded with TRACE defined in mpu6050.c
+ * through the same pre-filter, attitude estimator and classifier the
+ * sensor task runs, as fast as possible. Confirmed commands go to stdout
+ * so the output of two builds can be diffed, throughput goes to stderr.
+ * With -a every sample prints roll, pitch and yaw instead, to compare
+ * the float and fixed-point (GESTURE_FIXED) builds. -w and -e set the
+ * dwell and release time of every command in ms (gesture_confirm_t).
+ * With -c the proportional setpoints (control.h) are printed instead,
+ * one line per frame. -p also builds the binary frame (protocol.h) of
+ * every output, decodes it again and prints the bytes sent to stderr.
+ *
+ * Trace format, one sample per line, '#' starts a comment:
+ *     timestamp_us ax ay az gx gy gz
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gesture.h"
+#include "filter.h"
+#include "control.h"
+#include "protocol.h"
+
+/* Gyro sensitivities in LSB per deg/s, see mpu6050.h */
+#define GYRO_SENS_250	131.0f
+#define GYRO_SENS_500	65.5f
+#define GYRO_SENS_1000	32.8f
+#define GYRO_SENS_2000	16.4f
+
+typedef struct {
+	uint32_t timestamp;
+	int16_t raw[6];
+} sample_t;
+
+static sample_t *samples;
+static size_t sample_count;
+
+static size_t frames, frame_bytes, text_bytes;
+
+/* Frame a message like the sensor task and check that it decodes */
+static void send_frame(uint8_t type, uint32_t timestamp, const uint8_t *payload, uint8_t length) {
+	static uint8_t expected;
+	uint8_t frame[PROTOCOL_MAX_FRAME];
+	uint8_t size = protocol_frame(type, timestamp, payload, length, frame);
+	protocol_message_t message;
+
+	if (!protocol_decode(frame + 1, size - 2, &message) || message.type != type
+			|| message.sequence != expected++ || message.length != length
+			|| memcmp(message.payload, payload, length) != 0) {
+		fprintf(stderr, "frame %zu does not decode\n", frames);
+		exit(1);
+	}
+	frames++;
+	frame_bytes += size;
+}
+
+/* Stand-in for USART1_puts, the sensor task prints to USART1 */
+void USART1_puts(char *s) {
+	fputs(s, stdout);
+}
+
+static int load_trace(FILE *f) {
+	char line[128];
+	size_t size = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		long v[7];
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%ld %ld %ld %ld %ld %ld %ld",
+				&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+			continue;
+
+		if (sample_count == size) {
+			size = size ? size * 2 : 4096;
+			samples = realloc(samples, size * sizeof(sample_t));
+			if (samples == NULL)
+				return -1;
+		}
+		samples[sample_count].timestamp = (uint32_t)v[0];
+		for (int i = 0; i < 6; i++)
+			samples[sample_count].raw[i] = (int16_t)v[i + 1];
+		sample_count++;
+	}
+	return sample_count ? 0 : -1;
+}
+
+/* Stand-in for MPU6050_ReadAccGyo, hands out the next recorded sample */
+static const sample_t *read_acc_gyo(size_t n) {
+	return &samples[n % sample_count];
+}
+
+static float gyro_mult(int range) {
+	switch (range) {
+	case 500:
+		return 1.0f / GYRO_SENS_500;
+	case 1000:
+		return 1.0f / GYRO_SENS_1000;
+	case 2000:
+		return 1.0f / GYRO_SENS_2000;
+	default:
+		return 1.0f / GYRO_SENS_250;
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-r rate_hz] [-g gyro_range] [-n repeat] [-w dwell_ms] [-e release_ms]\n"
+			"       [-F] [-a] [-c] [-p] [trace]\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int rate = 100, range = 250, repeat = 1, prefilter = 1, angles = 0, control = 0, protocol = 0, opt;
+	int dwell = GESTURE_DWELL_MS, release = GESTURE_RELEASE_MS;
+	gesture_stats_t stats;
+	FILE *f = stdin;
+	struct timespec start, end;
+
+	while ((opt = getopt(argc, argv, "r:g:n:w:e:Facp")) != -1) {
+		switch (opt) {
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'g':
+			range = atoi(optarg);
+			break;
+		case 'n':
+			repeat = atoi(optarg);
+			break;
+		case 'w':
+			dwell = atoi(optarg);
+			break;
+		case 'e':
+			release = atoi(optarg);
+			break;
+		case 'F':
+			prefilter = 0;
+			break;
+		case 'a':
+			angles = 1;
+			break;
+		case 'c':
+			control = 1;
+			break;
+		case 'p':
+			protocol = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (rate <= 0 || repeat <= 0 || dwell < 0 || dwell > 65535 || release < 0 || release > 65535)
+		usage(argv[0]);
+	if (optind < argc && (f = fopen(argv[optind], "r")) == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (load_trace(f) != 0) {
+		fprintf(stderr, "no samples in trace\n");
+		return 1;
+	}
+
+	const float mult = gyro_mult(range);
+	const size_t total = sample_count * (size_t)repeat;
+	uint32_t commands = 0;
+
+	for (uint8_t c = GESTURE_RIGHT; c <= GESTURE_SUSPEND; c++)
+		gesture_set_confirm(c, (uint16_t)dwell, (uint16_t)release);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	gesture_init(rate, samples[0].raw[0], samples[0].raw[1], samples[0].raw[2], samples[0].timestamp);
+	if (prefilter) {
+		int16_t first[FILTER_CHANNELS] = { samples[0].raw[0], samples[0].raw[1], samples[0].raw[2] };
+
+		filter_init(rate);
+		filter_prime(first);
+	}
+	control_init();
+	control_enable(control);
+	protocol_init();
+	for (size_t n = 0; n < total; n++) {
+		const sample_t *s = read_acc_gyo(n);
+		int16_t raw[FILTER_CHANNELS];
+		int16_t setpoints[CONTROL_AXES];
+		uint8_t command;
+
+		memcpy(raw, s->raw, sizeof(raw));
+		if (prefilter)
+			filter_block(raw, 1);
+		gesture_fuse(raw[0], raw[1], raw[2], raw[3], raw[4], raw[5], mult, s->timestamp);
+		command = gesture_classify();
+		if (control) {
+			if (control_update(mult, s->timestamp, setpoints)) {
+				printf("%zu %u %d %d %d\n", n, s->timestamp, setpoints[CONTROL_ROLL],
+						setpoints[CONTROL_PITCH], setpoints[CONTROL_YAW]);
+				if (protocol) {
+					uint8_t payload[CONTROL_PAYLOAD_SIZE];
+
+					send_frame(PROTOCOL_CONTROL, s->timestamp, payload, control_pack(setpoints, payload));
+				}
+			}
+		} else if (angles) {
+			printf("%zu %.4f %.4f %.4f\n", n, GESTURE_DEG(angleX), GESTURE_DEG(angleY),
+					GESTURE_DEG(angleZ));
+		} else if (command != GESTURE_NONE) {
+			printf("%zu %u ", n, s->timestamp);
+			USART1_puts((char *)gesture_name(command));
+			USART1_puts("\n");
+			commands++;
+			if (protocol)
+				send_frame(PROTOCOL_GESTURE, s->timestamp, &command, 1);
+			/* what the remote sends in text mode */
+			text_bytes += 2 + strlen(gesture_name(command));
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+	fprintf(stderr, "samples: %zu commands: %u time: %.6f s throughput: %.0f samples/s\n",
+			total, commands, seconds, seconds > 0 ? total / seconds : 0.0);
+	if (protocol)
+		fprintf(stderr, "frames: %zu bytes: %zu (%.1f per frame), as text: %zu\n", frames, frame_bytes,
+				frames ? (double)frame_bytes / frames : 0.0, text_bytes);
+	gesture_get_stats(&stats);
+	fprintf(stderr, "rejected: %u latency: last %u us max %u us\n",
+			stats.rejected, stats.latency_us, stats.latency_max_us);
+
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,415 @@
+/*
+ * Offline trainer for the gesture decision tree (classifier.h).
+ *
+ * Replays labelled traces (format in sim.c) through the same pre-filter,
+ * attitude estimator and window averaging the sensor task runs, fits a
+ * CART tree on the int8 window features and writes it as C tables for
+ * classifier_model.c. Every trace argument is "command:trace", command
+ * is the GESTURE_* number held throughout the recording. With -R windows
+ * are labelled by the former hand-tuned thresholds (gesture_rules), with
+ * -s a sweep of static orientations labelled the same way is added,
+ * which is how the shipped model was made.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gesture.h"
+#include "classifier.h"
+#include "filter.h"
+
+/* Gyro sensitivities in LSB per deg/s, see mpu6050.h */
+#define GYRO_SENS_250	131.0f
+#define GYRO_SENS_500	65.5f
+#define GYRO_SENS_1000	32.8f
+#define GYRO_SENS_2000	16.4f
+
+/* Accelerometer LSB per g in the 4G range, see mpu6050.h */
+#define ACCE_SENS_4		8192.0f
+
+#define COMMANDS		(GESTURE_SUSPEND + 1)
+#define VALUES			256
+#define PI				3.14159265f
+
+typedef struct {
+	int8_t features[CLASSIFIER_FEATURES];
+	uint8_t label;
+} window_t;
+
+static window_t *windows;
+static size_t window_count, window_size;
+
+static classifier_node_t nodes[CLASSIFIER_MAX_NODES];
+static int node_count;
+
+static int max_depth = 7, min_leaf = 4, rate = 100;
+static float mult;
+
+static const char * const feature_names[CLASSIFIER_FEATURES] = {
+	"CLASSIFIER_ACC_X",
+	"CLASSIFIER_ACC_Y",
+	"CLASSIFIER_ACC_Z",
+	"CLASSIFIER_ROLL",
+	"CLASSIFIER_PITCH",
+	"CLASSIFIER_GYRO_X",
+	"CLASSIFIER_GYRO_Y",
+	"CLASSIFIER_GYRO_Z"
+};
+
+static const char * const command_names[COMMANDS] = {
+	"GESTURE_NONE",
+	"GESTURE_RIGHT",
+	"GESTURE_LEFT",
+	"GESTURE_FORWARD",
+	"GESTURE_DOWN",
+	"GESTURE_UP",
+	"GESTURE_SUSPEND"
+};
+
+/* gesture.c prints through the shell */
+void USART1_puts(char *s) {
+	fputs(s, stderr);
+}
+
+static void add_window(const int8_t *features, uint8_t label) {
+	if (window_count == window_size) {
+		window_size = window_size ? window_size * 2 : 4096;
+		windows = realloc(windows, window_size * sizeof(window_t));
+		if (windows == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(windows[window_count].features, features, CLASSIFIER_FEATURES);
+	windows[window_count].label = label;
+	window_count++;
+}
+
+/* Replays one trace, label 0 takes the label from gesture_rules */
+static int load_trace(const char *path, uint8_t label) {
+	char line[128];
+	int8_t features[CLASSIFIER_FEATURES];
+	int16_t raw[FILTER_CHANNELS];
+	size_t before = window_count;
+	int first = 1;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		long v[7];
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%ld %ld %ld %ld %ld %ld %ld",
+				&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+			continue;
+
+		for (int i = 0; i < FILTER_CHANNELS; i++)
+			raw[i] = (int16_t)v[i + 1];
+		if (first) {
+			gesture_init(rate, raw[0], raw[1], raw[2], (uint32_t)v[0]);
+			filter_init(rate);
+			filter_prime(raw);
+			first = 0;
+		}
+		filter_block(raw, 1);
+		gesture_fuse(raw[0], raw[1], raw[2], raw[3], raw[4], raw[5], mult, (uint32_t)v[0]);
+		if (gesture_window(features))
+			add_window(features, label ? label : gesture_rules());
+	}
+	fclose(f);
+	fprintf(stderr, "%s: %zu windows\n", path, window_count - before);
+	return 0;
+}
+
+/* Static orientations every degree of roll and pitch, labelled by the rules */
+static void synthesize(void) {
+	const float g = ACCE_SENS_4;
+	int8_t features[CLASSIFIER_FEATURES];
+	size_t before = window_count;
+
+	for (int pitch = -90; pitch <= 90; pitch++) {
+		for (int roll = -180; roll < 180; roll++) {
+			const float p = pitch * PI / 180, r = roll * PI / 180;
+			const int16_t ax = (int16_t)lrintf(-g * sinf(p));
+			const int16_t ay = (int16_t)lrintf(-g * cosf(p) * sinf(r));
+			const int16_t az = (int16_t)lrintf(-g * cosf(p) * cosf(r));
+			uint32_t t = 0;
+
+			gesture_init(rate, ax, ay, az, t);
+			do {
+				t += 1000000 / rate;
+				gesture_fuse(ax, ay, az, 0, 0, 0, mult, t);
+			} while (!gesture_window(features));
+			add_window(features, gesture_rules());
+		}
+	}
+	fprintf(stderr, "sweep: %zu windows\n", window_count - before);
+}
+
+static double gini(const uint32_t *counts, uint32_t total) {
+	double sum = 0;
+
+	if (total == 0)
+		return 0;
+	for (int c = 0; c < COMMANDS; c++)
+		sum += (double)counts[c] * counts[c];
+	return 1.0 - sum / ((double)total * total);
+}
+
+static uint8_t majority(const uint32_t *counts) {
+	uint8_t best = 0;
+
+	for (int c = 1; c < COMMANDS; c++)
+		if (counts[c] > counts[best])
+			best = c;
+	return best;
+}
+
+/*
+ * Grows the subtree of windows[first, last), splitting on the feature and
+ * threshold with the lowest weighted gini impurity, returns its node index
+ */
+static int grow(size_t first, size_t last, int depth) {
+	static uint32_t histogram[VALUES][COMMANDS];
+	uint32_t counts[COMMANDS] = { 0 };
+	const uint32_t total = (uint32_t)(last - first);
+	double best_score;
+	int best_feature = -1, best_threshold = 0;
+	int node;
+
+	if (node_count >= CLASSIFIER_MAX_NODES) {
+		fprintf(stderr, "tree larger than %d nodes, lower -d\n", CLASSIFIER_MAX_NODES);
+		exit(1);
+	}
+	node = node_count++;
+
+	for (size_t i = first; i < last; i++)
+		counts[windows[i].label]++;
+	best_score = gini(counts, total);
+
+	if (depth < max_depth && best_score > 0 && total >= 2 * (uint32_t)min_leaf) {
+		for (int f = 0; f < CLASSIFIER_FEATURES; f++) {
+			uint32_t left[COMMANDS] = { 0 }, right[COMMANDS];
+			uint32_t left_total = 0;
+
+			memset(histogram, 0, sizeof(histogram));
+			for (size_t i = first; i < last; i++)
+				histogram[windows[i].features[f] + 128][windows[i].label]++;
+			memcpy(right, counts, sizeof(right));
+
+			for (int v = 0; v < VALUES - 1; v++) {
+				uint32_t moved = 0;
+				double score;
+
+				for (int c = 0; c < COMMANDS; c++) {
+					left[c] += histogram[v][c];
+					right[c] -= histogram[v][c];
+					moved += histogram[v][c];
+				}
+				left_total += moved;
+				if (moved == 0 || left_total < (uint32_t)min_leaf)
+					continue;
+				if (total - left_total < (uint32_t)min_leaf)
+					break;
+				score = (left_total * gini(left, left_total)
+						+ (total - left_total) * gini(right, total - left_total)) / total;
+				if (score < best_score - 1e-9) {
+					best_score = score;
+					best_feature = f;
+					best_threshold = v - 128;
+				}
+			}
+		}
+	}
+
+	if (best_feature < 0) {
+		nodes[node].feature = CLASSIFIER_LEAF;
+		nodes[node].threshold = 0;
+		nodes[node].left = majority(counts);
+		nodes[node].right = 0;
+		return node;
+	}
+
+	/* Partition in place, windows <= threshold first */
+	size_t split = first;
+
+	for (size_t i = first; i < last; i++) {
+		if (windows[i].features[best_feature] <= best_threshold) {
+			window_t tmp = windows[split];
+
+			windows[split++] = windows[i];
+			windows[i] = tmp;
+		}
+	}
+	nodes[node].feature = (int8_t)best_feature;
+	nodes[node].threshold = (int8_t)best_threshold;
+	nodes[node].left = (uint8_t)grow(first, split, depth + 1);
+	nodes[node].right = (uint8_t)grow(split, last, depth + 1);
+
+	/* Two leaves with the same command, they are the last nodes allocated */
+	if (nodes[nodes[node].left].feature == CLASSIFIER_LEAF
+			&& nodes[nodes[node].right].feature == CLASSIFIER_LEAF
+			&& nodes[nodes[node].left].left == nodes[nodes[node].right].left) {
+		nodes[node] = nodes[nodes[node].left];
+		node_count -= 2;
+	}
+	return node;
+}
+
+static uint8_t predict(const int8_t *features) {
+	const classifier_node_t *node = nodes;
+
+	while (node->feature != CLASSIFIER_LEAF)
+		node = &nodes[(features[node->feature] <= node->threshold) ? node->left : node->right];
+	return node->left;
+}
+
+/* The model lives in the firmware tree, which uses CRLF line endings */
+static void write_model(FILE *f, const char *source, double accuracy) {
+	fprintf(f, "/*\r\n"
+			" * Generated by remote_train (sim/train.c), do not edit.\r\n"
+			" * %s, %d Hz, depth %d, min leaf %d\r\n"
+			" * %zu windows, %.2f%% classified as labelled\r\n"
+			" */\r\n"
+			"\r\n"
+			"#include \"classifier.h\"\r\n"
+			"#include \"gesture.h\"\r\n"
+			"\r\n"
+			"const classifier_node_t classifier_nodes[] = {\r\n",
+			source, rate, max_depth, min_leaf, window_count, accuracy);
+	for (int i = 0; i < node_count; i++) {
+		if (nodes[i].feature == CLASSIFIER_LEAF)
+			fprintf(f, "\t/* %3d */ { CLASSIFIER_LEAF, 0, %s, 0 },\r\n",
+					i, command_names[nodes[i].left]);
+		else
+			fprintf(f, "\t/* %3d */ { %s, %d, %d, %d },\r\n", i,
+					feature_names[nodes[i].feature], nodes[i].threshold,
+					nodes[i].left, nodes[i].right);
+	}
+	fprintf(f, "};\r\n"
+			"\r\n"
+			"const uint8_t classifier_node_count = sizeof(classifier_nodes) / sizeof(classifier_nodes[0]);\r\n");
+}
+
+static float gyro_mult(int range) {
+	switch (range) {
+	case 500:
+		return 1.0f / GYRO_SENS_500;
+	case 1000:
+		return 1.0f / GYRO_SENS_1000;
+	case 2000:
+		return 1.0f / GYRO_SENS_2000;
+	default:
+		return 1.0f / GYRO_SENS_250;
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-r rate_hz] [-g gyro_range] [-d depth] [-m min_leaf] [-o model.c]\n"
+			"       [-R] [-s] [command:]trace...\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int range = 250, rules = 0, sweep = 0, opt;
+	const char *output = NULL;
+	char source[64];
+	uint32_t confusion[COMMANDS][COMMANDS] = { { 0 } };
+	size_t correct = 0, agree = 0;
+	FILE *f = stdout;
+
+	while ((opt = getopt(argc, argv, "r:g:d:m:o:Rs")) != -1) {
+		switch (opt) {
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'g':
+			range = atoi(optarg);
+			break;
+		case 'd':
+			max_depth = atoi(optarg);
+			break;
+		case 'm':
+			min_leaf = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'R':
+			rules = 1;
+			break;
+		case 's':
+			sweep = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (rate <= 0 || max_depth <= 0 || min_leaf <= 0 || (optind == argc && !sweep))
+		usage(argv[0]);
+	mult = gyro_mult(range);
+
+	if (sweep)
+		synthesize();
+	for (int i = optind; i < argc; i++) {
+		const char *path = argv[i], *colon = strchr(argv[i], ':');
+		int label = 0;
+
+		if (colon) {
+			label = atoi(argv[i]);
+			path = colon + 1;
+		}
+		if ((label <= GESTURE_NONE || label > GESTURE_SUSPEND) && !rules) {
+			fprintf(stderr, "%s: command must be %d..%d\n", argv[i], GESTURE_RIGHT, GESTURE_SUSPEND);
+			return 2;
+		}
+		if (load_trace(path, rules ? 0 : (uint8_t)label) != 0)
+			return 1;
+	}
+	if (window_count == 0) {
+		fprintf(stderr, "no windows\n");
+		return 1;
+	}
+
+	grow(0, window_count, 0);
+
+	for (size_t i = 0; i < window_count; i++) {
+		const uint8_t predicted = predict(windows[i].features);
+
+		confusion[windows[i].label][predicted]++;
+		correct += predicted == windows[i].label;
+		agree += classifier_predict(windows[i].features) == windows[i].label;
+	}
+
+	fprintf(stderr, "nodes: %d accuracy: %.2f%% (current model %.2f%%)\nlabel \\ predicted\n",
+			node_count, 100.0 * correct / window_count, 100.0 * agree / window_count);
+	for (int l = 0; l < COMMANDS; l++) {
+		fprintf(stderr, "%-16s", command_names[l]);
+		for (int p = 0; p < COMMANDS; p++)
+			fprintf(stderr, " %7u", confusion[l][p]);
+		fprintf(stderr, "\n");
+	}
+
+	snprintf(source, sizeof(source), "%s%s%s", sweep ? "orientation sweep" : "",
+			sweep && optind < argc ? " and " : "",
+			optind < argc ? (rules ? "traces labelled by gesture_rules" : "labelled traces") : "");
+	if (output && (f = fopen(output, "wb")) == NULL) {
+		perror(output);
+		return 1;
+	}
+	write_model(f, source, 100.0 * correct / window_count);
+	if (f != stdout)
+		fclose(f);
+
+	free(windows);
+	return 0;
+}